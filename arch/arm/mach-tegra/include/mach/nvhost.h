@@ -96,6 +96,30 @@ struct nvhost_reloc {
 	__u32 target_offset;
 };
 
+/* one submit of a NVHOST_IOCTL_CHANNEL_SUBMIT batch: the header, cmdbuf
+ * and reloc arrays which would otherwise be streamed through write() */
+struct nvhost_submit_desc {
+	__u32 syncpt_id;
+	__u32 syncpt_incrs;
+	__u32 num_cmdbufs;
+	__u32 num_relocs;
+	unsigned long cmdbufs;	/* array of struct nvhost_cmdbuf */
+	unsigned long relocs;	/* array of struct nvhost_reloc */
+	__u32 flags;
+	__u32 fence;		/* returned syncpoint value */
+};
+
+#define NVHOST_SUBMIT_NULL_KICKOFF	(1 << 0)
+/* fail with -EAGAIN instead of waiting for space in the channel's queues,
+ * as opening the channel with O_NONBLOCK does for all submits */
+#define NVHOST_SUBMIT_NONBLOCK		(1 << 1)
+
+struct nvhost_submit_args {
+	unsigned long submits;	/* array of struct nvhost_submit_desc */
+	__u32 num_submits;
+	__u32 num_done;		/* returned number of submits made */
+};
+
 struct nvhost_get_param_args {
 	__u32 value;
 };
@@ -116,9 +140,21 @@ struct nvhost_set_nvmap_fd_args {
 	_IOW(NVHOST_IOCTL_MAGIC, 5, struct nvhost_set_nvmap_fd_args)
 #define NVHOST_IOCTL_CHANNEL_NULL_KICKOFF	\
 	_IOR(NVHOST_IOCTL_MAGIC, 6, struct nvhost_get_param_args)
+/* value 1 makes submits skip relocations whose slot, handles and target
+ * address are unchanged since the previous submit, 0 patches every
+ * relocation. setting either value forgets the remembered relocations.
+ * while enabled, userspace must not rewrite relocated command buffer words
+ * of a buffer it submits again. */
+#define NVHOST_IOCTL_CHANNEL_SET_RELOC_CACHE	\
+	_IOW(NVHOST_IOCTL_MAGIC, 7, struct nvhost_get_param_args)
+/* makes each submit of an array in turn, as write() and FLUSH (or
+ * NULL_KICKOFF) would, and stores its fence in the array. stops at the
+ * first submit which fails; num_done tells how many were made. */
+#define NVHOST_IOCTL_CHANNEL_SUBMIT		\
+	_IOWR(NVHOST_IOCTL_MAGIC, 8, struct nvhost_submit_args)
 #define NVHOST_IOCTL_CHANNEL_LAST		\
-	_IOC_NR(NVHOST_IOCTL_CHANNEL_NULL_KICKOFF)
-#define NVHOST_IOCTL_CHANNEL_MAX_ARG_SIZE sizeof(struct nvhost_get_param_args)
+	_IOC_NR(NVHOST_IOCTL_CHANNEL_SUBMIT)
+#define NVHOST_IOCTL_CHANNEL_MAX_ARG_SIZE sizeof(struct nvhost_submit_args)
 
 struct nvhost_ctrl_syncpt_read_args {
 	__u32 id;
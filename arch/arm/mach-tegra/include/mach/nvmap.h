@@ -67,6 +67,15 @@ struct nvmap_pinarray_elem {
 	__u32 pin_offset;
 };
 
+/* the relocation and address last written into one slot of a pin array,
+ * and the serials of the handles it referred to */
+struct nvmap_reloc_cache {
+	struct nvmap_pinarray_elem elem;
+	__u32 addr;
+	__u32 pin_serial;
+	__u32 patch_serial;
+};
+
 struct nvmap_client *nvmap_create_client(struct nvmap_device *dev,
 					 const char *name);
 
@@ -110,6 +119,12 @@ int nvmap_pin_array(struct nvmap_client *client, struct nvmap_handle *gather,
 		    const struct nvmap_pinarray_elem *arr, int nr,
 		    struct nvmap_handle **unique);
 
+int nvmap_pin_array_cached(struct nvmap_client *client,
+			   struct nvmap_handle *gather,
+			   const struct nvmap_pinarray_elem *arr, int nr,
+			   struct nvmap_handle **unique,
+			   struct nvmap_reloc_cache *cache, int *patched);
+
 void nvmap_unpin_handles(struct nvmap_client *client,
 			 struct nvmap_handle **h, int nr);
 
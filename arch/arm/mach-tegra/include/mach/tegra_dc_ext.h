@@ -35,6 +35,9 @@ void tegra_dc_ext_unregister(struct tegra_dc_ext *dc_ext);
 void tegra_dc_ext_enable(struct tegra_dc_ext *dc_ext);
 void tegra_dc_ext_disable(struct tegra_dc_ext *dc_ext);
 
+/* called from the display controller's irq thread while flips are queued */
+void tegra_dc_ext_vblank(struct tegra_dc_ext *dc_ext);
+
 int tegra_dc_ext_process_hotplug(int output);
 
 #else /* CONFIG_TEGRA_DC_EXTENSIONS */
@@ -68,6 +71,10 @@ void tegra_dc_ext_disable(struct tegra_dc_ext *dc_ext)
 {
 }
 static inline
+void tegra_dc_ext_vblank(struct tegra_dc_ext *dc_ext)
+{
+}
+static inline
 int tegra_dc_ext_process_hotplug(int output)
 {
 	return 0;
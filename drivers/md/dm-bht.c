@@ -94,20 +94,18 @@ static void dm_bht_log_mismatch(struct dm_bht *bht, u8 *given, u8 *computed)
 typedef int (*dm_bht_compare_cb)(struct dm_bht *, u8 *, u8 *);
 
 /**
- * dm_bht_compute_hash: hashes a page of data
+ * dm_bht_hash_page: hashes a page of data using the given crypto context
  */
-static int dm_bht_compute_hash(struct dm_bht *bht, struct page *pg,
-			       unsigned int offset, u8 *digest)
+static int dm_bht_hash_page(struct dm_bht *bht, struct hash_desc *hash_desc,
+			    struct page *pg, unsigned int offset, u8 *digest)
 {
-	struct hash_desc *hash_desc = &bht->hash_desc[smp_processor_id()];
 	struct scatterlist sg;
 
 	sg_init_table(&sg, 1);
 	sg_set_page(&sg, pg, PAGE_SIZE, offset);
 	/* Note, this is synchronous. */
 	if (crypto_hash_init(hash_desc)) {
-		DMCRIT("failed to reinitialize crypto hash (proc:%d)",
-			smp_processor_id());
+		DMCRIT("failed to reinitialize crypto hash");
 		return -EINVAL;
 	}
 	if (crypto_hash_update(hash_desc, &sg, PAGE_SIZE)) {
@@ -129,6 +127,23 @@ static int dm_bht_compute_hash(struct dm_bht *bht, struct page *pg,
 	return 0;
 }
 
+/**
+ * dm_bht_compute_hash: hashes a page of data
+ *
+ * Preemption is disabled so that the per-CPU crypto context cannot be
+ * shared with another verifier scheduled on the same CPU.
+ */
+static int dm_bht_compute_hash(struct dm_bht *bht, struct page *pg,
+			       unsigned int offset, u8 *digest)
+{
+	int r;
+
+	r = dm_bht_hash_page(bht, &bht->hash_desc[get_cpu()], pg, offset,
+			     digest);
+	put_cpu();
+	return r;
+}
+
 static __always_inline struct dm_bht_level *dm_bht_get_level(struct dm_bht *bht,
 							     int depth)
 {
@@ -445,8 +460,9 @@ EXPORT_SYMBOL(dm_bht_write_completed);
 /* dm_bht_verify_path
  * Verifies the path. Returns 0 on ok.
  */
-static int dm_bht_verify_path(struct dm_bht *bht, unsigned int block,
-			      struct page *pg, unsigned int offset)
+static int dm_bht_verify_path(struct dm_bht *bht, struct hash_desc *hash_desc,
+			      unsigned int block, struct page *pg,
+			      unsigned int offset)
 {
 	int depth = bht->depth;
 	u8 digest[DM_BHT_MAX_DIGEST_SIZE];
@@ -466,7 +482,7 @@ static int dm_bht_verify_path(struct dm_bht *bht, unsigned int block,
 		BUG_ON(state < DM_BHT_ENTRY_READY);
 		node = dm_bht_get_node(bht, entry, depth, block);
 
-		if (dm_bht_compute_hash(bht, pg, offset, digest) ||
+		if (dm_bht_hash_page(bht, hash_desc, pg, offset, digest) ||
 		    memcmp(digest, node, bht->digest_size))
 			goto mismatch;
 
@@ -478,7 +494,7 @@ static int dm_bht_verify_path(struct dm_bht *bht, unsigned int block,
 	} while (--depth > 0 && state != DM_BHT_ENTRY_VERIFIED);
 
 	if (depth == 0 && state != DM_BHT_ENTRY_VERIFIED) {
-		if (dm_bht_compute_hash(bht, pg, offset, digest) ||
+		if (dm_bht_hash_page(bht, hash_desc, pg, offset, digest) ||
 		    memcmp(digest, bht->root_digest, bht->digest_size))
 			goto mismatch;
 		atomic_set(&entry->state, DM_BHT_ENTRY_VERIFIED);
@@ -746,6 +762,31 @@ bool dm_bht_is_populated(struct dm_bht *bht, unsigned int block)
 }
 EXPORT_SYMBOL(dm_bht_is_populated);
 
+/* Allocates the nodes of an entry claimed by the caller (now PENDING) and
+ * issues the read for it.
+ */
+static int dm_bht_load_entry(struct dm_bht *bht, void *ctx, int depth,
+			     unsigned int index)
+{
+	struct dm_bht_level *level = dm_bht_get_level(bht, depth);
+	struct dm_bht_entry *entry = &level->entries[index];
+	struct page *pg;
+
+	pg = alloc_page(GFP_NOIO);
+	if (!pg) {
+		DMCRIT("failed to allocate memory for entry->nodes");
+		return -ENOMEM;
+	}
+
+	/* dm-bht guarantees page-aligned memory for callbacks. */
+	entry->nodes = page_address(pg);
+
+	/* TODO(wad) error check callback here too */
+	bht->read_cb(ctx, level->sector + to_sector(index * PAGE_SIZE),
+		     entry->nodes, to_sector(PAGE_SIZE), entry);
+	return 0;
+}
+
 /**
  * dm_bht_populate - reads entries from disk needed to verify a given block
  * @bht:	pointer to a dm_bht_create()d bht
@@ -765,10 +806,7 @@ int dm_bht_populate(struct dm_bht *bht, void *ctx,
 	DMDEBUG("dm_bht_populate(%u)", block);
 
 	for (depth = bht->depth - 1; depth >= 0; --depth) {
-		struct dm_bht_level *level;
 		struct dm_bht_entry *entry;
-		unsigned int index;
-		struct page *pg;
 
 		entry = dm_bht_get_entry(bht, depth, block);
 		state = atomic_cmpxchg(&entry->state,
@@ -783,19 +821,9 @@ int dm_bht_populate(struct dm_bht *bht, void *ctx,
 			continue;
 
 		/* Current entry is claimed for allocation and loading */
-		pg = alloc_page(GFP_NOIO);
-		if (!pg)
-			goto nomem;
-
-		/* dm-bht guarantees page-aligned memory for callbacks. */
-		entry->nodes = page_address(pg);
-
-		/* TODO(wad) error check callback here too */
-
-		level = &bht->levels[depth];
-		index = dm_bht_index_at_level(bht, depth, block);
-		bht->read_cb(ctx, level->sector + to_sector(index * PAGE_SIZE),
-			     entry->nodes, to_sector(PAGE_SIZE), entry);
+		if (dm_bht_load_entry(bht, ctx, depth,
+				      dm_bht_index_at_level(bht, depth, block)))
+			return -ENOMEM;
 	}
 
 	return 0;
@@ -803,13 +831,47 @@ int dm_bht_populate(struct dm_bht *bht, void *ctx,
 error_state:
 	DMCRIT("block %u at depth %d is in an error state", block, depth);
 	return state;
-
-nomem:
-	DMCRIT("failed to allocate memory for entry->nodes");
-	return -ENOMEM;
 }
 EXPORT_SYMBOL(dm_bht_populate);
 
+/**
+ * dm_bht_populate_level - reads all entries at a given depth from disk
+ * @bht:	pointer to a dm_bht_create()d bht
+ * @ctx:        context used for all read_cb calls on this request
+ * @depth:	depth of the level to read
+ *
+ * Meant for prefetching the upper levels of the tree, which are small and
+ * needed by every verification.  Entries which are already loaded or
+ * being loaded are skipped.
+ *
+ * Returns the number of reads issued or a negative value on error.
+ */
+int dm_bht_populate_level(struct dm_bht *bht, void *ctx, int depth)
+{
+	struct dm_bht_level *level;
+	unsigned int index;
+	int issued = 0;
+
+	BUG_ON(depth < 0 || depth >= bht->depth);
+
+	level = dm_bht_get_level(bht, depth);
+	for (index = 0; index < level->count; index++) {
+		struct dm_bht_entry *entry = &level->entries[index];
+
+		if (atomic_cmpxchg(&entry->state, DM_BHT_ENTRY_UNALLOCATED,
+				   DM_BHT_ENTRY_PENDING) !=
+		    DM_BHT_ENTRY_UNALLOCATED)
+			continue;
+
+		if (dm_bht_load_entry(bht, ctx, depth, index))
+			return -ENOMEM;
+		issued++;
+	}
+
+	return issued;
+}
+EXPORT_SYMBOL(dm_bht_populate_level);
+
 
 /**
  * dm_bht_verify_block - checks that all nodes in the path for @block are valid
@@ -825,12 +887,50 @@ EXPORT_SYMBOL(dm_bht_populate);
 int dm_bht_verify_block(struct dm_bht *bht, unsigned int block,
 			struct page *pg, unsigned int offset)
 {
+	int r;
+
 	BUG_ON(offset != 0);
 
-	return  dm_bht_verify_path(bht, block, pg, offset);
+	r = dm_bht_verify_path(bht, &bht->hash_desc[get_cpu()], block, pg,
+			       offset);
+	put_cpu();
+	return r;
 }
 EXPORT_SYMBOL(dm_bht_verify_block);
 
+/**
+ * dm_bht_verify_blocks - checks a run of consecutive blocks
+ * @bht:	pointer to a dm_bht_create()d bht
+ * @block:	index of the first block
+ * @pages:	array of @count pages holding the block data, at offset 0
+ * @count:	number of blocks
+ *
+ * Like dm_bht_verify_block() for each block, but all the blocks are
+ * hashed back to back on one crypto context instead of reacquiring it
+ * per block.  Blocks sharing a leaf entry only walk up the tree for the
+ * first of them, as the entry is verified after that.  Callers should
+ * keep @count small as preemption is disabled for the whole run.
+ *
+ * Returns as dm_bht_verify_block(), stopping at the first failure.
+ */
+int dm_bht_verify_blocks(struct dm_bht *bht, unsigned int block,
+			 struct page **pages, unsigned int count)
+{
+	struct hash_desc *hash_desc = &bht->hash_desc[get_cpu()];
+	unsigned int i;
+	int r = 0;
+
+	for (i = 0; i < count; i++) {
+		r = dm_bht_verify_path(bht, hash_desc, block + i, pages[i], 0);
+		if (r)
+			break;
+	}
+
+	put_cpu();
+	return r;
+}
+EXPORT_SYMBOL(dm_bht_verify_blocks);
+
 /**
  * dm_bht_destroy - cleans up all memory used by @bht
  * @bht:	pointer to a dm_bht_create()d bht
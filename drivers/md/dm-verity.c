@@ -20,6 +20,7 @@
 #include <linux/genhd.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/mempool.h>
 #include <linux/module.h>
 #include <linux/slab.h>
@@ -106,28 +107,63 @@ static int dev_wait;
 module_param(dev_wait, bool, 0444);
 MODULE_PARM_DESC(dev_wait, "Wait forever for a backing device");
 
+/* Number of requests that may be verified concurrently (0 = one per CPU). */
+static int verify_workers;
+module_param(verify_workers, int, 0444);
+MODULE_PARM_DESC(verify_workers, "Concurrent verify workers (0 = nr cpus)");
+
+/* Controls whether all but the leaf level of the tree is read on first use. */
+static int prefetch_tree = 1;
+module_param(prefetch_tree, bool, 0644);
+MODULE_PARM_DESC(prefetch_tree, "Read the upper levels of the hash tree "
+				"on first use");
+
+/* Blocks hashed per call to dm_bht_verify_blocks() */
+#define VERITY_VERIFY_BATCH 8
+
 /* Used for tracking pending bios as well as for exporting information via
  * STATUSTYPE_INFO.
  */
+enum verity_stage {
+	VERITY_STAGE_IO_WAIT,		/* map to first pass on the io queue */
+	VERITY_STAGE_READ,		/* data and hash tree reads */
+	VERITY_STAGE_VERIFY_WAIT,	/* queued for verification */
+	VERITY_STAGE_VERIFY,		/* hashing and tree checks */
+	VERITY_STAGES
+};
+
 struct verity_stats {
 	unsigned int io_queue;
 	unsigned int verify_queue;
 	unsigned int average_requeues;
 	unsigned int total_requeues;
 	unsigned long long total_requests;
+
+	/* Cumulative time spent by completed requests in each stage */
+	spinlock_t stage_lock;
+	u64 stage_ns[VERITY_STAGES];
+	u64 stage_count;
 };
 
 /* per-requested-bio private data */
 enum verity_io_flags {
 	VERITY_IOFLAGS_CLONED = 0x1,	/* original bio has been cloned */
+	VERITY_IOFLAGS_PREFETCH = 0x2,	/* no bio, only reads hash tree */
 };
 
 struct dm_verity_io {
 	struct dm_target *target;
 	struct bio *bio;
-	struct delayed_work work;
+	struct work_struct work;
+	struct list_head list;  /* on verity_config.bht_waiters */
 	unsigned int flags;
 
+	/* Stage start times, see enum verity_stage */
+	ktime_t mapped;
+	ktime_t started;
+	ktime_t populated;
+	ktime_t verifying;
+
 	int error;
 	atomic_t pending;
 
@@ -157,6 +193,14 @@ struct verity_config {
 
 	int error_behavior;
 
+	/* I/Os waiting for hash tree reads issued on behalf of other I/Os. */
+	spinlock_t wait_lock;
+	struct list_head bht_waiters;
+
+	/* Set once the upper levels of the tree have been requested. */
+	unsigned long prefetch_started;
+	struct completion prefetch_done;
+
 	struct verity_stats stats;
 };
 
@@ -167,6 +211,7 @@ static void kverityd_verify(struct work_struct *work);
 static void kverityd_io(struct work_struct *work);
 static void kverityd_io_bht_populate(struct dm_verity_io *io);
 static void kverityd_io_bht_populate_end(struct bio *, int error);
+static void verity_prefetch_tree(struct dm_target *ti);
 
 static BLOCKING_NOTIFIER_HEAD(verity_error_notifier);
 
@@ -213,6 +258,44 @@ void verity_stats_average_requeues(struct verity_config *vc, int requeues)
 	/* TODO(wad) */
 }
 
+static void verity_stats_account_stages(struct verity_config *vc,
+					struct dm_verity_io *io)
+{
+	ktime_t now = ktime_get();
+	s64 ns[VERITY_STAGES];
+	int i;
+
+	ns[VERITY_STAGE_IO_WAIT] = ktime_to_ns(ktime_sub(io->started,
+							 io->mapped));
+	ns[VERITY_STAGE_READ] = ktime_to_ns(ktime_sub(io->populated,
+						      io->started));
+	ns[VERITY_STAGE_VERIFY_WAIT] = ktime_to_ns(ktime_sub(io->verifying,
+							     io->populated));
+	ns[VERITY_STAGE_VERIFY] = ktime_to_ns(ktime_sub(now, io->verifying));
+
+	spin_lock(&vc->stats.stage_lock);
+	for (i = 0; i < VERITY_STAGES; i++)
+		vc->stats.stage_ns[i] += ns[i];
+	vc->stats.stage_count++;
+	spin_unlock(&vc->stats.stage_lock);
+}
+
+/* Average time per request in each stage, in microseconds */
+static void verity_stats_stage_avg_us(struct verity_config *vc,
+				      unsigned long long *avg)
+{
+	u64 count;
+	int i;
+
+	spin_lock(&vc->stats.stage_lock);
+	count = vc->stats.stage_count;
+	for (i = 0; i < VERITY_STAGES; i++) {
+		avg[i] = count ? div64_u64(vc->stats.stage_ns[i], count) : 0;
+		do_div(avg[i], NSEC_PER_USEC);
+	}
+	spin_unlock(&vc->stats.stage_lock);
+}
+
 /*-----------------------------------------------
  * Exported interfaces
  *-----------------------------------------------*/
@@ -264,6 +347,8 @@ static struct dm_verity_io *verity_io_alloc(struct dm_target *ti,
 	io->bio = bio;
 	io->sector = sector;
 	io->error = 0;
+	io->mapped = ktime_get();
+	io->started = ktime_set(0, 0);
 
 	/* Adjust the sector by the virtual starting sector */
 	io->block = (to_bytes(sector)) >> VERITY_BLOCK_SHIFT;
@@ -575,6 +660,40 @@ static bool verity_is_bht_populated(struct dm_verity_io *io)
 	return true;
 }
 
+/* Requeues every I/O waiting on a hash tree read.  Called after each
+ * completed read, so requeued I/Os either find their entries ready or
+ * go back to waiting.
+ */
+static void verity_wake_bht_waiters(struct verity_config *vc)
+{
+	struct dm_verity_io *io, *tmp;
+	unsigned long flags;
+	LIST_HEAD(waiters);
+
+	spin_lock_irqsave(&vc->wait_lock, flags);
+	list_splice_init(&vc->bht_waiters, &waiters);
+	spin_unlock_irqrestore(&vc->wait_lock, flags);
+
+	list_for_each_entry_safe(io, tmp, &waiters, list) {
+		list_del(&io->list);
+		queue_work(kverityd_ioq, &io->work);
+	}
+}
+
+static void verity_wait_for_bht(struct verity_config *vc,
+				struct dm_verity_io *io)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vc->wait_lock, flags);
+	list_add_tail(&io->list, &vc->bht_waiters);
+	spin_unlock_irqrestore(&vc->wait_lock, flags);
+
+	/* The read may have completed before the I/O was on the list. */
+	if (verity_is_bht_populated(io))
+		verity_wake_bht_waiters(vc);
+}
+
 /* verity_dec_pending manages the lifetime of all dm_verity_io structs.
  * Non-bug error handling is centralized through this interface and
  * all passage from workqueue to workqueue.
@@ -589,6 +708,9 @@ static void verity_dec_pending(struct dm_verity_io *io)
 	if (!atomic_dec_and_test(&io->pending))
 		goto done;
 
+	if (unlikely(io->flags & VERITY_IOFLAGS_PREFETCH))
+		goto prefetch_done;
+
 	if (unlikely(io->error))
 		goto io_error;
 
@@ -596,21 +718,32 @@ static void verity_dec_pending(struct dm_verity_io *io)
 	if (verity_is_bht_populated(io)) {
 		verity_stats_io_queue_dec(vc);
 		verity_stats_verify_queue_inc(vc);
-		INIT_DELAYED_WORK(&io->work, kverityd_verify);
-		queue_delayed_work(kveritydq, &io->work, 0);
+		io->populated = ktime_get();
+		INIT_WORK(&io->work, kverityd_verify);
+		queue_work(kveritydq, &io->work);
 		REQTRACE("Block %llu+ is being queued for verify (io:%p)",
 			 ULL(io->block), io);
 	} else {
-		INIT_DELAYED_WORK(&io->work, kverityd_io);
-		queue_delayed_work(kverityd_ioq, &io->work, HZ/10);
+		/* Some entries are being read by other I/Os.  Rather than
+		 * polling, wait for the next hash tree read to complete.
+		 */
+		INIT_WORK(&io->work, kverityd_io);
 		verity_stats_total_requeues_inc(vc);
-		REQTRACE("Block %llu+ is being requeued for io (io:%p)",
+		verity_wait_for_bht(vc, io);
+		REQTRACE("Block %llu+ is waiting for hash reads (io:%p)",
 			 ULL(io->block), io);
 	}
 
 done:
 	return;
 
+prefetch_done:
+	REQTRACE("Hash tree prefetch completed (error:%d)", io->error);
+	mempool_free(io, vc->io_pool);
+	/* verity_dtr may free vc as soon as this completes */
+	complete(&vc->prefetch_done);
+	return;
+
 io_error:
 	verity_return_bio_to_caller(io);
 }
@@ -622,13 +755,15 @@ io_error:
 static int verity_verify(struct verity_config *vc,
 			 struct bio *bio)
 {
-	unsigned int idx;
-	u64 block;
+	struct page *pages[VERITY_VERIFY_BATCH];
+	unsigned int idx, count = 0;
+	u64 block, first;
 	int r;
 
 	VERITY_BUG_ON(bio == NULL);
 
 	block = to_bytes(bio->bi_sector) >> VERITY_BLOCK_SHIFT;
+	first = block;
 
 	for (idx = bio->bi_idx; idx < bio->bi_vcnt; idx++) {
 		struct bio_vec *bv = bio_iovec_idx(bio, idx);
@@ -636,17 +771,22 @@ static int verity_verify(struct verity_config *vc,
 		VERITY_BUG_ON(bv->bv_offset % VERITY_BLOCK_SIZE);
 		VERITY_BUG_ON(bv->bv_len % VERITY_BLOCK_SIZE);
 
-		DMDEBUG("Updating hash for block %llu", ULL(block));
-
 		/* TODO(msb) handle case where multiple blocks fit in a page */
-		r = dm_bht_verify_block(&vc->bht, block,
-					bv->bv_page, bv->bv_offset);
+		pages[count++] = bv->bv_page;
+		block++;
+		if (count < VERITY_VERIFY_BATCH && idx + 1 < bio->bi_vcnt)
+			continue;
+
+		DMDEBUG("Updating hash for blocks %llu-%llu", ULL(first),
+			ULL(block - 1));
+
+		r = dm_bht_verify_blocks(&vc->bht, first, pages, count);
 		/* dm_bht functions aren't expected to return errno friendly
 		 * values.  They are converted here for uniformity.
 		 */
 		if (r > 0) {
-			DMERR("Pending data for block %llu seen at verify",
-			      ULL(block));
+			DMERR("Pending data for block %llu+ seen at verify",
+			      ULL(first));
 			r = -EBUSY;
 			goto bad_state;
 		}
@@ -655,12 +795,12 @@ static int verity_verify(struct verity_config *vc,
 			r = -EACCES;
 			goto bad_match;
 		}
-		REQTRACE("Block %llu verified", ULL(block));
+		REQTRACE("Blocks %llu-%llu verified", ULL(first),
+			 ULL(block - 1));
 
-		block++;
-		/* After completing a block, allow a reschedule.
-		 * TODO(wad) determine if this is truly needed.
-		 */
+		first = block;
+		count = 0;
+		/* After completing a batch, allow a reschedule. */
 		cond_resched();
 	}
 
@@ -674,13 +814,14 @@ bad_match:
 /* Services the verify workqueue */
 static void kverityd_verify(struct work_struct *work)
 {
-	struct delayed_work *dwork = container_of(work, struct delayed_work,
-						  work);
-	struct dm_verity_io *io = container_of(dwork, struct dm_verity_io,
+	struct dm_verity_io *io = container_of(work, struct dm_verity_io,
 					       work);
 	struct verity_config *vc = io->target->private;
 
+	io->verifying = ktime_get();
 	io->error = verity_verify(vc, io->bio);
+	if (!io->error)
+		verity_stats_account_stages(vc, io);
 
 	/* Free up the bio and tag with the return value */
 	verity_stats_verify_queue_dec(vc);
@@ -701,6 +842,7 @@ static void kverityd_io_bht_populate_end(struct bio *bio, int error)
 	 * the given entry.
 	 */
 	dm_bht_read_completed(entry, error);
+	verity_wake_bht_waiters(io->target->private);
 
 	/* Clean up for reuse when reading data to be checked */
 	bio->bi_vcnt = 0;
@@ -713,8 +855,9 @@ static void kverityd_io_bht_populate_end(struct bio *bio, int error)
 
 	/* We bail but assume the tree has been marked bad. */
 	if (unlikely(error)) {
-		DMERR("Failed to read for sector %llu (%u)",
-		      ULL(io->bio->bi_sector), io->bio->bi_size);
+		if (io->bio)
+			DMERR("Failed to read for sector %llu (%u)",
+			      ULL(io->bio->bi_sector), io->bio->bi_size);
 		io->error = error;
 		/* Pass through the error to verity_dec_pending below */
 	}
@@ -872,18 +1015,54 @@ static void kverityd_src_io_read(struct dm_verity_io *io)
 	generic_make_request(clone);
 }
 
+/* Reads every level of the tree but the leaves the first time the device is
+ * used.  These levels are small and every verification needs them, so
+ * fetching them in one go keeps the first reads from serialising on them.
+ */
+static void verity_prefetch_tree(struct dm_target *ti)
+{
+	struct verity_config *vc = ti->private;
+	struct dm_verity_io *io;
+	int depth;
+
+	if (test_and_set_bit(0, &vc->prefetch_started))
+		return;
+
+	io = mempool_alloc(vc->io_pool, GFP_NOIO);
+	memset(io, 0, sizeof(*io));
+	io->target = ti;
+	io->flags = VERITY_IOFLAGS_PREFETCH;
+	atomic_set(&io->pending, 1);
+
+	for (depth = 0; depth < vc->bht.depth - 1; depth++) {
+		int issued = dm_bht_populate_level(&vc->bht, io, depth);
+		if (issued < 0) {
+			DMERR("Failed to prefetch hash tree level %d: %d",
+			      depth, issued);
+			break;
+		}
+		REQTRACE("Prefetching %d entries at depth %d", issued, depth);
+	}
+
+	verity_dec_pending(io);
+}
+
 /* kverityd_io services the I/O workqueue. For each pass through
  * the I/O workqueue, a call to populate both the origin drive
  * data and the hash tree data is made.
  */
 static void kverityd_io(struct work_struct *work)
 {
-	struct delayed_work *dwork = container_of(work, struct delayed_work,
-						  work);
-	struct dm_verity_io *io = container_of(dwork, struct dm_verity_io,
+	struct dm_verity_io *io = container_of(work, struct dm_verity_io,
 					       work);
 	VERITY_BUG_ON(!io->bio);
 
+	if (!ktime_to_ns(io->started)) {
+		io->started = ktime_get();
+		if (prefetch_tree)
+			verity_prefetch_tree(io->target);
+	}
+
 	/* Issue requests asynchronously. */
 	verity_inc_pending(io);
 	kverityd_src_io_read(io);
@@ -944,8 +1123,8 @@ static int verity_map(struct dm_target *ti, struct bio *bio,
 			return DM_MAPIO_REQUEUE;
 		}
 		verity_stats_io_queue_inc(vc);
-		INIT_DELAYED_WORK(&io->work, kverityd_io);
-		queue_delayed_work(kverityd_ioq, &io->work, 0);
+		INIT_WORK(&io->work, kverityd_io);
+		queue_work(kverityd_ioq, &io->work);
 	}
 
 	return DM_MAPIO_SUBMITTED;
@@ -1178,6 +1357,11 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_bs;
 	}
 
+	spin_lock_init(&vc->wait_lock);
+	INIT_LIST_HEAD(&vc->bht_waiters);
+	init_completion(&vc->prefetch_done);
+	spin_lock_init(&vc->stats.stage_lock);
+
 	ti->num_flush_requests = 1;
 	ti->private = vc;
 
@@ -1211,6 +1395,10 @@ static void verity_dtr(struct dm_target *ti)
 {
 	struct verity_config *vc = (struct verity_config *) ti->private;
 
+	/* The prefetch I/O is not tied to any bio, so wait for it here. */
+	if (test_bit(0, &vc->prefetch_started))
+		wait_for_completion(&vc->prefetch_done);
+
 	DMDEBUG("Destroying bs");
 	bioset_free(vc->bs);
 	DMDEBUG("Destroying io_pool");
@@ -1234,17 +1422,23 @@ static int verity_status(struct dm_target *ti, status_type_t type,
 	unsigned int sz = 0;
 	char hashdev[BDEVNAME_SIZE], vdev[BDEVNAME_SIZE];
 	u8 hexdigest[VERITY_MAX_DIGEST_SIZE * 2 + 1] = { 0 };
+	unsigned long long stage_us[VERITY_STAGES];
 
 	dm_bht_root_hexdigest(&vc->bht, hexdigest, sizeof(hexdigest));
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		DMEMIT("%u %u %u %u %llu",
+		verity_stats_stage_avg_us(vc, stage_us);
+		DMEMIT("%u %u %u %u %llu %llu %llu %llu %llu",
 		       vc->stats.io_queue,
 		       vc->stats.verify_queue,
 		       vc->stats.average_requeues,
 		       vc->stats.total_requeues,
-		       vc->stats.total_requests);
+		       vc->stats.total_requests,
+		       stage_us[VERITY_STAGE_IO_WAIT],
+		       stage_us[VERITY_STAGE_READ],
+		       stage_us[VERITY_STAGE_VERIFY_WAIT],
+		       stage_us[VERITY_STAGE_VERIFY]);
 		break;
 
 	case STATUSTYPE_TABLE:
@@ -1325,7 +1519,12 @@ static int __init dm_verity_init(void)
 		goto bad_io_queue;
 	}
 
-	kveritydq = alloc_workqueue("kverityd", VERITY_WQ_FLAGS, 1);
+	/* Verification is spread over unbound workers, so that requests
+	 * completing on one CPU do not serialise behind each other.
+	 */
+	if (verify_workers <= 0)
+		verify_workers = num_online_cpus();
+	kveritydq = alloc_workqueue("kverityd", WQ_UNBOUND, verify_workers);
 	if (!kveritydq) {
 		DMERR("failed to create workqueue kveritydq");
 		goto bad_verify_queue;
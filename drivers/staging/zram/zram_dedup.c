@@ -0,0 +1,151 @@
+/*
+ * Compressed RAM block device - compressed object deduplication
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/*
+ * When dedup is enabled, every compressed object is indexed by a hash
+ * of its compressed content. A write whose compressed output matches
+ * an object already in the index just takes a reference on it instead
+ * of allocating a new one from the pool.
+ *
+ * Lock ordering: table lock -> dedup_lock -> pool lock. Compaction
+ * takes the pool lock first and therefore only trylocks dedup_lock.
+ */
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_table[checksum & (zram->dedup_table_size - 1)];
+}
+
+u32 zram_dedup_checksum(const unsigned char *mem, size_t len)
+{
+	return jhash(mem, len, 0);
+}
+
+/*
+ * Look for an object with the same compressed content. On success a
+ * reference is taken on the returned entry.
+ */
+struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 checksum)
+{
+	struct hlist_node *pos;
+	struct zram_dedup_entry *entry;
+
+	write_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+			node) {
+		unsigned char *cmem;
+		int match;
+
+		if (entry->checksum != checksum || entry->clen != len)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->page,
+				entry->offset, ZS_MM_RO);
+		match = !memcmp(cmem + sizeof(struct zobj_header), mem, len);
+		zs_unmap_object(zram->mem_pool, entry->page, entry->offset,
+				cmem, ZS_MM_RO);
+
+		if (match) {
+			entry->refcount++;
+			write_unlock(&zram->dedup_lock);
+			return entry;
+		}
+	}
+	write_unlock(&zram->dedup_lock);
+
+	return NULL;
+}
+
+/*
+ * The entry is allocated before the object is written so that the
+ * object's back-reference can point to it. Returns NULL if no memory
+ * is available, in which case the object is kept out of the index.
+ */
+struct zram_dedup_entry *zram_dedup_alloc(void)
+{
+	return kzalloc(sizeof(struct zram_dedup_entry), GFP_NOIO);
+}
+
+/*
+ * Index a newly stored object.
+ */
+void zram_dedup_insert(struct zram *zram, struct zram_dedup_entry *entry,
+		struct page *page, u32 offset, size_t len, u32 checksum)
+{
+	write_lock(&zram->dedup_lock);
+	entry->page = page;
+	entry->offset = offset;
+	entry->clen = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+	hlist_add_head(&entry->node, zram_dedup_bucket(zram, checksum));
+	write_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drop a reference. Returns 1 if this was the last one, in which case
+ * the object has been freed.
+ */
+int zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	write_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		write_unlock(&zram->dedup_lock);
+		return 0;
+	}
+	hlist_del(&entry->node);
+	write_unlock(&zram->dedup_lock);
+
+	zs_free(zram->mem_pool, entry->page, entry->offset);
+	kfree(entry);
+
+	return 1;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t size;
+
+	/* Aim for chains of about 16 objects when the disk is full */
+	size = roundup_pow_of_two(max_t(size_t, num_pages >> 4, 1));
+
+	zram->dedup_table = vzalloc(size * sizeof(*zram->dedup_table));
+	if (!zram->dedup_table)
+		return -ENOMEM;
+
+	zram->dedup_table_size = size;
+	rwlock_init(&zram->dedup_lock);
+
+	return 0;
+}
+
+/*
+ * All entries must have been released through zram_dedup_put().
+ */
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->dedup_table);
+	zram->dedup_table = NULL;
+	zram->dedup_table_size = 0;
+}
@@ -24,6 +24,7 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/ktime.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
@@ -32,57 +33,91 @@
 
 #if defined(CONFIG_ZRAM_LZO)
 #include <linux/lzo.h>
-#define COMPRESS_E_OK	LZO_E_OK
-#define WMSIZE		LZO1X_MEM_COMPRESS
-#define COMPRESS(src, src_len, dst, dst_len, wm) \
-	lzo1x_1_compress(src, src_len, dst, dst_len, wm)
-#define DECOMPRESS(src, src_len, dst, dst_len) \
-	lzo1x_decompress_safe(src, src_len, dst, dst_len)
-#elif defined(CONFIG_ZRAM_SNAPPY)
+
+static int zram_lzo_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *workmem)
+{
+	return lzo1x_1_compress(src, src_len, dst, dst_len, workmem);
+}
+
+static int zram_lzo_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len)
+{
+	return lzo1x_decompress_safe(src, src_len, dst, dst_len);
+}
+
+static const struct zram_compressor zram_lzo = {
+	.name = "lzo",
+	.id = ZRAM_COMP_LZO,
+	.workmem_size = LZO1X_MEM_COMPRESS,
+	.compress = zram_lzo_compress,
+	.decompress = zram_lzo_decompress,
+};
+#endif
+
+#if defined(CONFIG_ZRAM_SNAPPY)
 #include <linux/csnappy.h>
-#define COMPRESS_E_OK	CSNAPPY_E_OK
-#define WMSIZE_ORDER	min(15, PAGE_SHIFT+1)
-#define WMSIZE		(1 << WMSIZE_ORDER)
-static inline void
-snappy_compress_(const char *src, size_t src_len, char *dst, size_t *dst_len,
-		 char *workmem, int workmem_order)
-{
-	const char* end = csnappy_compress_fragment(
-		src, (uint32_t)src_len, dst, workmem, workmem_order);
-	*dst_len = end - dst;
-}
-#define COMPRESS(src, src_len, dst, dst_len, wm) \
-	snappy_compress_(src, src_len, dst, dst_len, wm, WMSIZE_ORDER)
-static inline int
-snappy_decompress_(const char *src, size_t src_len, char *dst, size_t *dst_len)
+#define SNAPPY_WMSIZE_ORDER	(PAGE_SHIFT + 1 < 15 ? PAGE_SHIFT + 1 : 15)
+
+static int zram_snappy_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *workmem)
+{
+	const char *end = csnappy_compress_fragment(src, (uint32_t)src_len,
+			dst, workmem, SNAPPY_WMSIZE_ORDER);
+	*dst_len = end - (char *)dst;
+	return 0;
+}
+
+static int zram_snappy_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len)
 {
 	uint32_t dst_len_ = (uint32_t)*dst_len;
 	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
 	*dst_len = (size_t)dst_len_;
 	return ret;
 }
-#define DECOMPRESS(src, src_len, dst, dst_len) \
-	snappy_decompress_(src, src_len, dst, dst_len)
-#else
+
+static const struct zram_compressor zram_snappy = {
+	.name = "snappy",
+	.id = ZRAM_COMP_SNAPPY,
+	.workmem_size = 1 << SNAPPY_WMSIZE_ORDER,
+	.compress = zram_snappy_compress,
+	.decompress = zram_snappy_decompress,
+};
+#endif
+
+#if !defined(CONFIG_ZRAM_LZO) && !defined(CONFIG_ZRAM_SNAPPY)
 #error CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
 #endif
 
+/* Available compressors; the first one is the default */
+const struct zram_compressor *zram_compressors[] = {
+#if defined(CONFIG_ZRAM_LZO)
+	&zram_lzo,
+#endif
+#if defined(CONFIG_ZRAM_SNAPPY)
+	&zram_snappy,
+#endif
+	NULL
+};
 
 /* Globals */
 static int zram_major;
 struct zram *devices;
+static struct workqueue_struct *zram_async_wq;
+static struct kmem_cache *zram_async_cache;
 
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -104,6 +139,114 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+static rwlock_t *zram_table_lock(struct zram *zram, u32 index)
+{
+	return &zram->table_lock[index & (ZRAM_TABLE_LOCKS - 1)];
+}
+
+/*
+ * Each CPU has its own compression buffers so that writers running
+ * on different CPUs can compress in parallel. The stream mutex
+ * covers the case where a writer sleeps (in zs_malloc) or is
+ * migrated while it still holds the stream.
+ */
+static struct zram_comp_stream *zram_comp_stream_get(struct zram *zram)
+{
+	struct zram_comp_stream *zstrm;
+
+	zstrm = per_cpu_ptr(zram->comp, raw_smp_processor_id());
+	mutex_lock(&zstrm->lock);
+
+	return zstrm;
+}
+
+static void zram_comp_stream_put(struct zram_comp_stream *zstrm)
+{
+	mutex_unlock(&zstrm->lock);
+}
+
+static void zram_comp_streams_free(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->comp)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_comp_stream *zstrm = per_cpu_ptr(zram->comp, cpu);
+
+		kfree(zstrm->workmem);
+		free_pages((unsigned long)zstrm->buffer, 1);
+	}
+
+	free_percpu(zram->comp);
+	zram->comp = NULL;
+}
+
+static int zram_comp_streams_alloc(struct zram *zram)
+{
+	int cpu;
+
+	zram->comp = alloc_percpu(struct zram_comp_stream);
+	if (!zram->comp)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_comp_stream *zstrm = per_cpu_ptr(zram->comp, cpu);
+
+		mutex_init(&zstrm->lock);
+		zstrm->workmem = kzalloc(zram->comp_alg->workmem_size,
+					GFP_KERNEL);
+		zstrm->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!zstrm->workmem || !zstrm->buffer) {
+			zram_comp_streams_free(zram);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int zram_compress(struct zram *zram, const unsigned char *src,
+		unsigned char *dst, size_t *dst_len, void *workmem)
+{
+	int ret;
+	ktime_t start;
+	const struct zram_compressor *comp = zram->comp_alg;
+	struct zram_comp_stats *cs = &zram->comp_stats[comp->id];
+
+	start = ktime_get();
+	ret = comp->compress(src, PAGE_SIZE, dst, dst_len, workmem);
+
+	spin_lock(&zram->stat64_lock);
+	cs->compress_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	cs->num_compress++;
+	cs->orig_size += PAGE_SIZE;
+	cs->compr_size += *dst_len;
+	spin_unlock(&zram->stat64_lock);
+
+	return ret;
+}
+
+static int zram_decompress(struct zram *zram, const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t *dst_len)
+{
+	int ret;
+	ktime_t start;
+	const struct zram_compressor *comp = zram->comp_alg;
+	struct zram_comp_stats *cs = &zram->comp_stats[comp->id];
+
+	start = ktime_get();
+	ret = comp->decompress(src, src_len, dst, dst_len);
+
+	spin_lock(&zram->stat64_lock);
+	cs->decompress_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	cs->num_decompress++;
+	spin_unlock(&zram->stat64_lock);
+
+	return ret;
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -122,18 +265,23 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Check whether the page is one word repeated throughout; zero filled
+ * pages are the most common case of this.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -166,26 +314,69 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/*
+ * Called with the table lock for @index held for writing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
 	void *obj;
+	struct page *page;
+	u32 offset;
+
+	/* Any writeback in progress must not install stale data */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_wb_free_block(zram, zram->table[index].element);
+		zram->table[index].element = 0;
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram_stat_dec(&zram->stats.pages_stored);
+		return;
+	}
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/*
+	 * No memory is allocated for zero or same filled pages.
+	 * Simply clear the flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_clear_flag(zram, index, ZRAM_ZERO);
+		zram_stat_dec(&zram->stats.pages_zero);
+		return;
+	}
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
 		return;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		struct zram_dedup_entry *entry = zram->table[index].dedup;
+
+		clen = entry->clen;
+		if (clen <= PAGE_SIZE / 2)
+			zram_stat_dec(&zram->stats.good_compress);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		zram->table[index].dedup = NULL;
+
+		/* Only the last reference frees any memory */
+		if (zram_dedup_put(zram, entry))
+			zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+		else
+			zram_stat_dec(&zram->stats.pages_dedup);
+		return;
+	}
+
+	page = zram->table[index].page;
+	offset = zram->table[index].offset;
+	if (unlikely(!page))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
 		__free_page(page);
@@ -194,11 +385,11 @@ static void zram_free_page(struct zram *zram, size_t index)
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	obj = zs_map_object(zram->mem_pool, page, offset, ZS_MM_RO);
+	clen = ((struct zobj_header *)obj)->size;
+	zs_unmap_object(zram->mem_pool, page, offset, obj, ZS_MM_RO);
 
-	xv_free(zram->mem_pool, page, offset);
+	zs_free(zram->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -221,6 +412,19 @@ static void handle_zero_page(struct page *page)
 	flush_dcache_page(page);
 }
 
+static void handle_same_page(struct page *page, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *user_mem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+		user_mem[pos] = element;
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+}
+
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
@@ -237,6 +441,107 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
+/*
+ * Read the page stored at @index into @page.
+ */
+static int zram_read_page(struct zram *zram, struct page *page, u32 index)
+{
+	int ret, shared;
+	size_t clen;
+	u32 obj_offset;
+	unsigned long blk;
+	struct page *obj_page;
+	struct zobj_header *zheader;
+	unsigned char *user_mem, *cmem;
+	rwlock_t *lock = zram_table_lock(zram, index);
+
+	read_lock(lock);
+
+	/*
+	 * Readers only race with each other here (writers hold the lock
+	 * for writing), and all of them clear the same bit.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_IDLE))
+		zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		read_unlock(lock);
+		handle_zero_page(page);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
+
+		read_unlock(lock);
+		handle_same_page(page, element);
+		return 0;
+	}
+
+	/* Page has been written back to the backing device */
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		blk = zram->table[index].element;
+		read_unlock(lock);
+
+		ret = zram_wb_read_page(zram, page, blk);
+		if (!ret)
+			flush_dcache_page(page);
+		return ret;
+	}
+
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].page)) {
+		read_unlock(lock);
+		pr_debug("Read before write: page=%u\n", index);
+		/* Do nothing */
+		return 0;
+	}
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		read_unlock(lock);
+		return 0;
+	}
+
+	shared = zram_test_flag(zram, index, ZRAM_DEDUP);
+	if (shared) {
+		/* Keep compaction from moving the shared object */
+		read_lock(&zram->dedup_lock);
+		obj_page = zram->table[index].dedup->page;
+		obj_offset = zram->table[index].dedup->offset;
+	} else {
+		obj_page = zram->table[index].page;
+		obj_offset = zram->table[index].offset;
+	}
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	clen = PAGE_SIZE;
+
+	cmem = zs_map_object(zram->mem_pool, obj_page, obj_offset, ZS_MM_RO);
+	zheader = (struct zobj_header *)cmem;
+
+	ret = zram_decompress(zram,
+		cmem + sizeof(*zheader), zheader->size,
+		user_mem, &clen);
+
+	zs_unmap_object(zram->mem_pool, obj_page, obj_offset, cmem, ZS_MM_RO);
+	kunmap_atomic(user_mem, KM_USER0);
+	if (shared)
+		read_unlock(&zram->dedup_lock);
+	read_unlock(lock);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		return ret;
+	}
+
+	flush_dcache_page(page);
+	return 0;
+}
+
 static int zram_read(struct zram *zram, struct bio *bio)
 {
 
@@ -254,59 +559,10 @@ static int zram_read(struct zram *zram, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
-
-		page = bvec->bv_page;
-
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
-
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			/* Do nothing */
-			index++;
-			continue;
-		}
-
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
-
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = DECOMPRESS(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
-
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
-
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != COMPRESS_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
+		if (unlikely(zram_read_page(zram, bvec->bv_page, index))) {
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
 			goto out;
 		}
-
-		flush_dcache_page(page);
 		index++;
 	}
 
@@ -321,51 +577,64 @@ out:
 
 static int zram_write(struct zram *zram, struct bio *bio)
 {
-	int i, ret;
+	int i;
 	u32 index;
 	struct bio_vec *bvec;
 
-	if (unlikely(!zram->init_done)) {
-		ret = zram_init_device(zram);
-		if (ret)
-			goto out;
-	}
-
 	zram_stat64_inc(zram, &zram->stats.num_writes);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
+		u32 offset, checksum = 0;
 		size_t clen;
+		unsigned long element;
+		int uncompressed = 0, shared = 0;
+		struct zram_dedup_entry *dedup = NULL;
 		struct zobj_header *zheader;
+		struct zram_comp_stream *zstrm;
 		struct page *page, *page_store;
 		unsigned char *user_mem, *cmem, *src;
+		rwlock_t *lock = zram_table_lock(zram, index);
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
 		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
+		 * Compression and allocation are done without holding the
+		 * table lock; it is taken only to swap the new object into
+		 * the table. Writers to different pages therefore proceed
+		 * in parallel.
 		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		zstrm = zram_comp_stream_get(zram);
+		src = zstrm->buffer;
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
+		if (page_same_filled(user_mem, &element)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_comp_stream_put(zstrm);
+
+			write_lock(lock);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			zram_free_page(zram, index);
+			if (!element) {
+				zram_set_flag(zram, index, ZRAM_ZERO);
+			} else {
+				zram_set_flag(zram, index, ZRAM_SAME);
+				zram->table[index].element = element;
+			}
+			write_unlock(lock);
+
+			if (!element)
+				zram_stat_inc(&zram->stats.pages_zero);
+			else
+				zram_stat_inc(&zram->stats.pages_same);
 			index++;
 			continue;
 		}
 
-		COMPRESS(user_mem, PAGE_SIZE, src, &clen,
-			 zram->compress_workmem);
+		zram_compress(zram, user_mem, src, &clen, zstrm->workmem);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
@@ -375,10 +644,11 @@ static int zram_write(struct zram *zram, struct bio *bio)
 		 * errors which has side effect of hanging the system.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
+			zram_comp_stream_put(zstrm);
+
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -387,51 +657,101 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			}
 
 			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
+			uncompressed = 1;
+
 			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, clen);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+		} else {
+			if (zram->dedup_table) {
+				checksum = zram_dedup_checksum(src, clen);
+				dedup = zram_dedup_find(zram, src, clen,
+						checksum);
+				if (dedup) {
+					zram_comp_stream_put(zstrm);
+					shared = 1;
+					goto store;
+				}
+			}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+			if (zs_malloc(zram->mem_pool, clen + sizeof(*zheader),
+					&page_store, &offset,
+					GFP_NOIO | __GFP_HIGHMEM)) {
+				zram_comp_stream_put(zstrm);
+				pr_info("Error allocating memory for "
+					"compressed page: %u, size=%zu\n",
+					index, clen);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_writes);
+				goto out;
+			}
 
-memstore:
-		zram->table[index].offset = offset;
+			/* Index the new object so later writes can share it */
+			if (zram->dedup_table)
+				dedup = zram_dedup_alloc();
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+			cmem = zs_map_object(zram->mem_pool, page_store, offset,
+					ZS_MM_WO);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+			/* Back-reference needed for memory defragmentation */
 			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+			if (dedup)
+				zheader->backref = (unsigned long)dedup |
+							ZOBJ_DEDUP;
+			else
+				zheader->backref = ZOBJ_BACKREF(index);
+			zheader->size = clen;
+
+			memcpy(cmem + sizeof(*zheader), src, clen);
+			zs_unmap_object(zram->mem_pool, page_store, offset,
+					cmem, ZS_MM_WO);
+
+			zram_comp_stream_put(zstrm);
+
+			if (dedup)
+				zram_dedup_insert(zram, dedup, page_store,
+						offset, clen, checksum);
+
+			/* Header and backref are in place: may be moved now */
+			zs_commit(zram->mem_pool, page_store, offset);
 		}
-#endif
 
-		memcpy(cmem, src, clen);
+store:
+		write_lock(lock);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_free_page(zram, index);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		if (dedup) {
+			zram->table[index].dedup = dedup;
+			zram_set_flag(zram, index, ZRAM_DEDUP);
+		} else {
+			zram->table[index].page = page_store;
+			zram->table[index].offset = offset;
+		}
+		if (uncompressed)
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		write_unlock(lock);
 
 		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
+		if (shared)
+			zram_stat_inc(&zram->stats.pages_dedup);
+		else
+			zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
+		if (uncompressed)
+			zram_stat_inc(&zram->stats.pages_expand);
+		else if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+		/* Incompressible pages are moved out of RAM if possible */
+		if (uncompressed && zram->bdev)
+			zram_writeback(zram, ZRAM_WB_HUGE);
+
 		index++;
 	}
 
@@ -461,12 +781,75 @@ static inline int valid_io_request(struct zram *zram, struct bio *bio)
 	return 1;
 }
 
+static void zram_account_latency(struct zram *zram, u64 *hist,
+				ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	zram_stat64_inc(zram, &hist[min(bucket, ZRAM_LAT_BUCKETS - 1)]);
+}
+
+static void zram_async_work(struct work_struct *work)
+{
+	struct zram_async_req *req, *tmp;
+	struct zram_async_queue *aq;
+	LIST_HEAD(batch);
+
+	aq = container_of(work, struct zram_async_queue, work);
+
+	/* Take everything queued so far and compress it in one go */
+	spin_lock(&aq->lock);
+	list_splice_init(&aq->reqs, &batch);
+	spin_unlock(&aq->lock);
+
+	list_for_each_entry_safe(req, tmp, &batch, list) {
+		zram_write(aq->zram, req->bio);
+		zram_account_latency(aq->zram,
+			aq->zram->stats.write_latency, req->start);
+		kmem_cache_free(zram_async_cache, req);
+	}
+}
+
+/*
+ * Hand a write bio to the worker of the current CPU, so that the
+ * submitter (often kswapd or direct reclaim) does not wait for
+ * compression. Returns non-zero if the bio must be handled inline.
+ */
+static int zram_queue_async_write(struct zram *zram, struct bio *bio,
+				ktime_t start)
+{
+	int cpu;
+	struct zram_async_req *req;
+	struct zram_async_queue *aq;
+
+	req = kmem_cache_alloc(zram_async_cache, GFP_NOIO | __GFP_NOWARN);
+	if (!req)
+		return -ENOMEM;
+
+	req->bio = bio;
+	req->start = start;
+
+	cpu = get_cpu();
+	aq = per_cpu_ptr(zram->async_queue, cpu);
+	spin_lock(&aq->lock);
+	list_add_tail(&req->list, &aq->reqs);
+	spin_unlock(&aq->lock);
+	queue_work_on(cpu, zram_async_wq, &aq->work);
+	put_cpu();
+
+	zram_stat64_inc(zram, &zram->stats.async_writes);
+
+	return 0;
+}
+
 /*
  * Handler function for all zram I/O requests.
  */
 static int zram_make_request(struct request_queue *queue, struct bio *bio)
 {
 	int ret = 0;
+	ktime_t start = ktime_get();
 	struct zram *zram = queue->queuedata;
 
 	if (!valid_io_request(zram, bio)) {
@@ -481,32 +864,74 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 		break;
 
 	case WRITE:
+		/*
+		 * Initialize before a worker can see the bio: a failed init
+		 * resets the device, which flushes the async workers.
+		 */
+		if (unlikely(!zram->init_done) && zram_init_device(zram)) {
+			bio_io_error(bio);
+			break;
+		}
+
+		if (zram->async_writes &&
+		    !zram_queue_async_write(zram, bio, start)) {
+			zram_account_latency(zram,
+				zram->stats.submit_latency, start);
+			break;
+		}
+
 		ret = zram_write(zram, bio);
+		zram_account_latency(zram, zram->stats.submit_latency, start);
+		zram_account_latency(zram, zram->stats.write_latency, start);
 		break;
 	}
 
 	return ret;
 }
 
+/*
+ * Wait for all queued async writes to complete.
+ */
+static void zram_flush_async_writes(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->async_queue)
+		return;
+
+	for_each_possible_cpu(cpu)
+		flush_work_sync(&per_cpu_ptr(zram->async_queue, cpu)->work);
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
+	zram_flush_async_writes(zram);
+
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	cancel_work_sync(&zram->wb_work);
+	zram->wb_pending = 0;
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free various per-device buffers */
+	zram_comp_streams_free(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		struct page *page;
 		u16 offset;
 
+		if (zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
+			continue;
+
+		if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+			zram_dedup_put(zram, zram->table[index].dedup);
+			continue;
+		}
+
 		page = zram->table[index].page;
 		offset = zram->table[index].offset;
 
@@ -516,13 +941,16 @@ void zram_reset_device(struct zram *zram)
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(page);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, page, offset);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zram_dedup_fini(zram);
+	zram_wb_reset(zram);
+
+	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -546,17 +974,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(WMSIZE, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_comp_streams_alloc(zram);
+	if (ret) {
+		pr_err("Error allocating compressor buffers!\n");
 		goto fail;
 	}
 
@@ -575,13 +995,21 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	if (zram->dedup_enable) {
+		ret = zram_dedup_init(zram, num_pages);
+		if (ret) {
+			pr_err("Error allocating dedup index\n");
+			goto fail;
+		}
+	}
+
 	zram->init_done = 1;
 	mutex_unlock(&zram->init_lock);
 
@@ -596,12 +1024,217 @@ fail:
 	return ret;
 }
 
+/*
+ * Update the reference to an object moved by compaction. Runs with the
+ * pool lock held, so table and dedup locks can only be trylocked; the
+ * object is skipped if it is busy or not (yet) referenced from the
+ * location it was found at. Only committed objects are passed in, so
+ * the backref is always valid.
+ */
+static int zram_migrate_object(void *priv, void *obj,
+		struct page *old_page, u32 old_offset,
+		struct page *new_page, u32 new_offset)
+{
+	u32 index;
+	int ret = -EBUSY;
+	rwlock_t *lock;
+	struct zram *zram = priv;
+	unsigned long backref = ((struct zobj_header *)obj)->backref;
+	const u8 not_object = BIT(ZRAM_UNCOMPRESSED) | BIT(ZRAM_ZERO) |
+				BIT(ZRAM_SAME) | BIT(ZRAM_DEDUP);
+
+	if (backref & ZOBJ_DEDUP) {
+		struct zram_dedup_entry *entry;
+
+		entry = (struct zram_dedup_entry *)(backref & ~ZOBJ_DEDUP);
+		if (!write_trylock(&zram->dedup_lock))
+			return -EBUSY;
+
+		if (entry->refcount && entry->page == old_page &&
+				entry->offset == old_offset) {
+			entry->page = new_page;
+			entry->offset = new_offset;
+			ret = 0;
+		}
+		write_unlock(&zram->dedup_lock);
+
+		return ret;
+	}
+
+	index = backref >> 1;
+	lock = zram_table_lock(zram, index);
+	if (!write_trylock(lock))
+		return -EBUSY;
+
+	if (!(zram->table[index].flags & not_object) &&
+			zram->table[index].page == old_page &&
+			zram->table[index].offset == old_offset) {
+		zram->table[index].page = new_page;
+		zram->table[index].offset = new_offset;
+		ret = 0;
+	}
+	write_unlock(lock);
+
+	return ret;
+}
+
+/*
+ * Write the page at @index back to the backing device if it matches
+ * @mode. The data is read and written without holding the table lock;
+ * ZRAM_UNDER_WB tells whether the page was overwritten meanwhile.
+ * Returns -ENOSPC once the backing device is full.
+ */
+static int zram_writeback_page(struct zram *zram, u32 index,
+		struct page *page, int huge, int idle)
+{
+	int ret;
+	unsigned long blk;
+	rwlock_t *lock = zram_table_lock(zram, index);
+	const u8 skip = BIT(ZRAM_ZERO) | BIT(ZRAM_SAME) | BIT(ZRAM_DEDUP) |
+			BIT(ZRAM_WB) | BIT(ZRAM_UNDER_WB);
+
+	write_lock(lock);
+	if (!zram->table[index].page ||
+	    (zram->table[index].flags & skip) ||
+	    !((huge && zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) ||
+	      (idle && zram_test_flag(zram, index, ZRAM_IDLE)))) {
+		write_unlock(lock);
+		return 0;
+	}
+	zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	write_unlock(lock);
+
+	blk = zram_wb_alloc_block(zram);
+	if (!blk) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	ret = zram_read_page(zram, page, index);
+	if (!ret)
+		ret = zram_wb_write_page(zram, page, blk);
+	if (ret)
+		goto out;
+
+	write_lock(lock);
+	if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		/* Overwritten or freed while we were writing it */
+		write_unlock(lock);
+		zram_wb_free_block(zram, blk);
+		return 0;
+	}
+	zram_free_page(zram, index);
+	zram->table[index].element = blk;
+	zram_set_flag(zram, index, ZRAM_WB);
+	write_unlock(lock);
+
+	/* zram_free_page() accounted the page as gone */
+	zram_stat_inc(&zram->stats.pages_stored);
+	zram_stat_inc(&zram->stats.pages_wb);
+
+	return 0;
+
+out:
+	write_lock(lock);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	write_unlock(lock);
+	if (blk)
+		zram_wb_free_block(zram, blk);
+
+	return ret;
+}
+
+static void zram_writeback_work(struct work_struct *work)
+{
+	int huge, idle;
+	size_t index;
+	struct page *page;
+	struct zram *zram = container_of(work, struct zram, wb_work);
+
+	huge = test_and_clear_bit(ZRAM_WB_HUGE, &zram->wb_pending);
+	idle = test_and_clear_bit(ZRAM_WB_IDLE, &zram->wb_pending);
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		int ret = zram_writeback_page(zram, index, page, huge, idle);
+
+		if (ret == -ENOSPC)
+			break;
+		if (ret)
+			zram_stat64_inc(zram, &zram->stats.failed_writes);
+
+		cond_resched();
+	}
+
+	__free_page(page);
+}
+
+/*
+ * Queue an asynchronous writeback pass. Requests made while a pass is
+ * already queued are merged into it.
+ */
+void zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	if (!zram->bdev || !zram->init_done)
+		return;
+
+	if (!test_and_set_bit(mode, &zram->wb_pending))
+		queue_work(zram_wb_wq, &zram->wb_work);
+}
+
+/*
+ * Mark all stored pages idle. Pages still idle at the next writeback
+ * pass (i.e. not accessed since) are written back.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return;
+	}
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		rwlock_t *lock = zram_table_lock(zram, index);
+
+		write_lock(lock);
+		if (zram->table[index].page &&
+		    !zram_test_flag(zram, index, ZRAM_ZERO) &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		write_unlock(lock);
+	}
+	mutex_unlock(&zram->init_lock);
+}
+
+unsigned long zram_compact(struct zram *zram)
+{
+	unsigned long freed = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		freed = zs_compact(zram->mem_pool, zram_migrate_object, zram);
+		zram_stat64_add(zram, &zram->stats.pages_compacted, freed);
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return freed;
+}
+
 void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 {
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(zram_table_lock(zram, index));
 	zram_free_page(zram, index);
+	write_unlock(zram_table_lock(zram, index));
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -612,11 +1245,33 @@ static const struct block_device_operations zram_devops = {
 
 static int create_device(struct zram *zram, int device_id)
 {
-	int ret = 0;
+	int i, cpu, ret = 0;
+
+	zram->async_queue = alloc_percpu(struct zram_async_queue);
+	if (!zram->async_queue) {
+		pr_err("Error allocating async queues for device %d\n",
+			device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct zram_async_queue *aq;
 
-	mutex_init(&zram->lock);
+		aq = per_cpu_ptr(zram->async_queue, cpu);
+		spin_lock_init(&aq->lock);
+		INIT_LIST_HEAD(&aq->reqs);
+		INIT_WORK(&aq->work, zram_async_work);
+		aq->zram = zram;
+	}
+
+	for (i = 0; i < ZRAM_TABLE_LOCKS; i++)
+		rwlock_init(&zram->table_lock[i]);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->wb_lock);
+	INIT_WORK(&zram->wb_work, zram_writeback_work);
+	zram->comp_alg = zram_compressors[0];
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -689,6 +1344,12 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	if (zram->async_queue) {
+		zram_flush_async_writes(zram);
+		free_percpu(zram->async_queue);
+		zram->async_queue = NULL;
+	}
 }
 
 static int __init zram_init(void)
@@ -702,11 +1363,25 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	ret = zram_wb_init();
+	if (ret) {
+		pr_warning("Unable to create writeback workqueue\n");
+		goto out;
+	}
+
+	zram_async_wq = alloc_workqueue("zram_async", WQ_MEM_RECLAIM, 0);
+	zram_async_cache = KMEM_CACHE(zram_async_req, 0);
+	if (!zram_async_wq || !zram_async_cache) {
+		pr_warning("Unable to create async write workqueue\n");
+		ret = -ENOMEM;
+		goto async_exit;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto async_exit;
 	}
 
 	if (!num_devices) {
@@ -736,6 +1411,12 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+async_exit:
+	if (zram_async_cache)
+		kmem_cache_destroy(zram_async_cache);
+	if (zram_async_wq)
+		destroy_workqueue(zram_async_wq);
+	zram_wb_exit();
 out:
 	return ret;
 }
@@ -751,9 +1432,13 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_wb_close(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	kmem_cache_destroy(zram_async_cache);
+	destroy_workqueue(zram_async_wq);
+	zram_wb_exit();
 
 	kfree(devices);
 	pr_debug("Cleanup done!\n");
@@ -15,10 +15,14 @@
 #ifndef _ZRAM_DRV_H_
 #define _ZRAM_DRV_H_
 
+#include <linux/bio.h>
+#include <linux/ktime.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "zspool.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -31,13 +35,17 @@ static const unsigned max_num_devices = 32;
  *
  * It stores back-reference to table entry which points to this
  * object. This is required to support memory defragmentation.
+ * For objects shared through the dedup index, it points to the
+ * zram_dedup_entry instead, tagged with ZOBJ_DEDUP.
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	unsigned long backref;
+	u16 size;		/* compressed size, excluding this header */
 };
 
+#define ZOBJ_DEDUP		1UL
+#define ZOBJ_BACKREF(index)	((unsigned long)(index) << 1)
+
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -51,9 +59,22 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
+ */
+
+/*
+ * Number of locks protecting the table. Table entries are hashed onto
+ * these by page index so writers to different pages do not contend.
+ * Must be a power of 2.
  */
+#define ZRAM_TABLE_LOCKS	64
+
+/*
+ * Latency histograms have power of 2 buckets in microseconds:
+ * bucket i counts latencies below (1 << i) us, the last one the rest.
+ */
+#define ZRAM_LAT_BUCKETS	21
 
 /*-- End of configurable params */
 
@@ -70,14 +91,65 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is filled with one repeated non-zero word (table.element) */
+	ZRAM_SAME,
+
+	/* Page shares a compressed object with other pages (table.dedup) */
+	ZRAM_DEDUP,
+
+	/* Page is on the backing device, at block table.element */
+	ZRAM_WB,
+
+	/* Page is being written back; cleared if it is overwritten */
+	ZRAM_UNDER_WB,
+
+	/* Page has not been accessed since it was last marked idle */
+	ZRAM_IDLE,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/* Compression backends (zram->comp_alg->id) */
+enum zram_comp_id {
+	ZRAM_COMP_LZO,
+	ZRAM_COMP_SNAPPY,
+
+	__NR_ZRAM_COMP,
+};
+
 /*-- Data structures */
 
+/*
+ * Compression backend. Both handlers return 0 on success; on entry
+ * *dst_len of decompress() is the size of the destination buffer.
+ */
+struct zram_compressor {
+	const char *name;
+	enum zram_comp_id id;
+	size_t workmem_size;
+	int (*compress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *workmem);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len);
+};
+
+/* An indexed compressed object, shared by refcount pages */
+struct zram_dedup_entry {
+	struct hlist_node node;
+	struct page *page;
+	u16 offset;
+	u16 clen;
+	u32 checksum;
+	u32 refcount;
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
+	union {
+		struct page *page;
+		unsigned long element;		/* ZRAM_SAME, ZRAM_WB */
+		struct zram_dedup_entry *dedup;		/* ZRAM_DEDUP */
+	};
 	u16 offset;
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
@@ -91,20 +163,61 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 pages_compacted;	/* pool pages released by compaction */
+	u64 async_writes;	/* write bios handled by async workers */
+	/* time from entering make_request to returning from it */
+	u64 submit_latency[ZRAM_LAT_BUCKETS];
+	/* time from entering make_request to write bio completion */
+	u64 write_latency[ZRAM_LAT_BUCKETS];
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of non-zero same filled pages */
+	atomic_t pages_dedup;	/* no. of pages sharing another's object */
+	atomic_t pages_wb;	/* no. of pages on the backing device */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+};
+
+/* Per-compressor stats; kept across device reset for comparison */
+struct zram_comp_stats {
+	u64 orig_size;		/* bytes fed to the compressor */
+	u64 compr_size;		/* bytes it produced */
+	u64 num_compress;
+	u64 num_decompress;
+	u64 compress_ns;	/* total time spent compressing */
+	u64 decompress_ns;	/* total time spent decompressing */
+};
+
+/* Write bio queued for an async worker */
+struct zram_async_req {
+	struct list_head list;
+	struct bio *bio;
+	ktime_t start;
+};
+
+/* Per-CPU queue of write bios, drained in batches by its worker */
+struct zram_async_queue {
+	spinlock_t lock;
+	struct list_head reqs;
+	struct work_struct work;
+	struct zram *zram;
+};
+
+/* Per-CPU compression workspace */
+struct zram_comp_stream {
+	void *workmem;
+	void *buffer;		/* 2 pages: compressed output may expand */
+	struct mutex lock;	/* writer may sleep or migrate while using it */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	const struct zram_compressor *comp_alg;
+	struct zram_comp_stream __percpu *comp;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/* protect table entries; indexed by page index */
+	rwlock_t table_lock[ZRAM_TABLE_LOCKS];
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -116,16 +229,74 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 
+	/* Compressed object index, NULL unless dedup is enabled */
+	int dedup_enable;
+	struct hlist_head *dedup_table;
+	size_t dedup_table_size;
+	/*
+	 * Protects dedup_table, refcounts and the location of shared
+	 * objects; held for reading while a shared object is accessed.
+	 */
+	rwlock_t dedup_lock;
+
+	/* Backing device for writeback, NULL unless configured */
+	struct block_device *bdev;
+	char *backing_dev;
+	unsigned long *wb_bitmap;	/* allocated blocks */
+	unsigned long wb_nr_blocks;
+	spinlock_t wb_lock;		/* protect wb_bitmap */
+	struct work_struct wb_work;
+	unsigned long wb_pending;	/* ZRAM_WB_* requests for wb_work */
+
+	/* Writes are handed to per-CPU workers when set */
+	int async_writes;
+	struct zram_async_queue __percpu *async_queue;
+
 	struct zram_stats stats;
+	struct zram_comp_stats comp_stats[__NR_ZRAM_COMP];
+};
+
+/* Writeback requests (zram->wb_pending) */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,		/* pages stored uncompressed */
+	ZRAM_WB_IDLE,		/* pages marked idle */
 };
 
 extern struct zram *devices;
 extern unsigned int num_devices;
+extern const struct zram_compressor *zram_compressors[];
 #ifdef CONFIG_SYSFS
 extern struct attribute_group zram_disk_attr_group;
 #endif
 
 extern int zram_init_device(struct zram *zram);
+extern unsigned long zram_compact(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram);
+extern void zram_writeback(struct zram *zram, enum zram_wb_mode mode);
 extern void zram_reset_device(struct zram *zram);
 
+extern u32 zram_dedup_checksum(const unsigned char *mem, size_t len);
+extern struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 checksum);
+extern struct zram_dedup_entry *zram_dedup_alloc(void);
+extern void zram_dedup_insert(struct zram *zram,
+		struct zram_dedup_entry *entry, struct page *page, u32 offset,
+		size_t len, u32 checksum);
+extern int zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry);
+extern int zram_dedup_init(struct zram *zram, size_t num_pages);
+extern void zram_dedup_fini(struct zram *zram);
+
+extern struct workqueue_struct *zram_wb_wq;
+extern int zram_wb_write_page(struct zram *zram, struct page *page,
+		unsigned long blk);
+extern int zram_wb_read_page(struct zram *zram, struct page *page,
+		unsigned long blk);
+extern unsigned long zram_wb_alloc_block(struct zram *zram);
+extern void zram_wb_free_block(struct zram *zram, unsigned long blk);
+extern void zram_wb_reset(struct zram *zram);
+extern int zram_wb_open(struct zram *zram, const char *path);
+extern void zram_wb_close(struct zram *zram);
+extern int zram_wb_init(void);
+extern void zram_wb_exit(void);
+
 #endif
@@ -113,6 +113,272 @@ static ssize_t reset_store(struct device *dev,
 	return len;
 }
 
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	for (i = 0; zram_compressors[i]; i++) {
+		const char *name = zram_compressors[i]->name;
+
+		if (zram_compressors[i] == zram->comp_alg)
+			sz += sprintf(buf + sz, "[%s] ", name);
+		else
+			sz += sprintf(buf + sz, "%s ", name);
+	}
+	sz += sprintf(buf + sz, "\n");
+
+	return sz;
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int i;
+	size_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	sz = strlen(buf);
+	if (sz && buf[sz - 1] == '\n')
+		sz--;
+
+	for (i = 0; zram_compressors[i]; i++) {
+		if (strlen(zram_compressors[i]->name) == sz &&
+		    !strncmp(zram_compressors[i]->name, buf, sz))
+			break;
+	}
+
+	if (!zram_compressors[i])
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change compressor for initialized device\n");
+		return -EBUSY;
+	}
+	zram->comp_alg = zram_compressors[i];
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * One line per compressor:
+ * name orig_size compr_size num_compress compress_ns
+ *	num_decompress decompress_ns
+ */
+static ssize_t comp_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	spin_lock(&zram->stat64_lock);
+	for (i = 0; zram_compressors[i]; i++) {
+		struct zram_comp_stats *cs =
+			&zram->comp_stats[zram_compressors[i]->id];
+
+		sz += sprintf(buf + sz,
+			"%s %llu %llu %llu %llu %llu %llu\n",
+			zram_compressors[i]->name,
+			cs->orig_size, cs->compr_size,
+			cs->num_compress, cs->compress_ns,
+			cs->num_decompress, cs->decompress_ns);
+	}
+	spin_unlock(&zram->stat64_lock);
+
+	return sz;
+}
+
+static ssize_t dedup_enable_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->dedup_enable);
+}
+
+static ssize_t dedup_enable_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change dedup for initialized device\n");
+		return -EBUSY;
+	}
+	zram->dedup_enable = !!val;
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	zram_compact(zram);
+
+	return len;
+}
+
+static ssize_t pages_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, &zram->stats.pages_compacted));
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	sz = sprintf(buf, "%s\n",
+		zram->backing_dev ? zram->backing_dev : "none");
+	mutex_unlock(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	char path[64];
+	struct zram *zram = dev_to_zram(dev);
+
+	if (len >= sizeof(path))
+		return -EINVAL;
+
+	strlcpy(path, buf, sizeof(path));
+	if (len && path[len - 1] == '\n')
+		path[len - 1] = '\0';
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change backing device for "
+			"initialized device\n");
+		return -EBUSY;
+	}
+	ret = zram_wb_open(zram, path);
+	mutex_unlock(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	zram_mark_idle(zram);
+
+	return len;
+}
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	if (sysfs_streq(buf, "huge"))
+		zram_writeback(zram, ZRAM_WB_HUGE);
+	else if (sysfs_streq(buf, "idle"))
+		zram_writeback(zram, ZRAM_WB_IDLE);
+	else
+		return -EINVAL;
+
+	return len;
+}
+
+static ssize_t wb_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_wb));
+}
+
+static ssize_t async_writes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->async_writes);
+}
+
+static ssize_t async_writes_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	zram->async_writes = !!val;
+
+	return len;
+}
+
+/*
+ * One line per bucket: upper bound in microseconds and count.
+ * The last bucket has no upper bound.
+ */
+static ssize_t latency_hist_show(struct zram *zram, u64 *hist, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+
+	spin_lock(&zram->stat64_lock);
+	for (i = 0; i < ZRAM_LAT_BUCKETS - 1; i++)
+		sz += sprintf(buf + sz, "%lu %llu\n", 1UL << i, hist[i]);
+	sz += sprintf(buf + sz, "inf %llu\n", hist[i]);
+	spin_unlock(&zram->stat64_lock);
+
+	return sz;
+}
+
+static ssize_t submit_latency_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return latency_hist_show(zram, zram->stats.submit_latency, buf);
+}
+
+static ssize_t write_latency_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return latency_hist_show(zram, zram->stats.write_latency, buf);
+}
+
 static ssize_t num_reads_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -154,7 +420,23 @@ static ssize_t zero_pages_show(struct device *dev,
 {
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_zero));
+}
+
+static ssize_t same_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_same));
+}
+
+static ssize_t dedup_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_dedup));
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
@@ -163,7 +445,7 @@ static ssize_t orig_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+		(u64)atomic_read(&zram->stats.pages_stored) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
@@ -182,8 +464,10 @@ static ssize_t mem_used_total_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
-			((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
+		u64 pages_expand = atomic_read(&zram->stats.pages_expand);
+
+		val = zs_get_total_size_bytes(zram->mem_pool) +
+			(pages_expand << PAGE_SHIFT);
 	}
 
 	return sprintf(buf, "%llu\n", val);
@@ -192,28 +476,60 @@ static ssize_t mem_used_total_show(struct device *dev,
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(comp_stats, S_IRUGO, comp_stats_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
 static DEVICE_ATTR(num_reads, S_IRUGO, num_reads_show, NULL);
 static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
+static DEVICE_ATTR(dedup_enable, S_IRUGO | S_IWUSR,
+		dedup_enable_show, dedup_enable_store);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(wb_pages, S_IRUGO, wb_pages_show, NULL);
+static DEVICE_ATTR(async_writes, S_IRUGO | S_IWUSR,
+		async_writes_show, async_writes_store);
+static DEVICE_ATTR(submit_latency, S_IRUGO, submit_latency_show, NULL);
+static DEVICE_ATTR(write_latency, S_IRUGO, write_latency_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
+static DEVICE_ATTR(same_pages, S_IRUGO, same_pages_show, NULL);
+static DEVICE_ATTR(dedup_pages, S_IRUGO, dedup_pages_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(pages_compacted, S_IRUGO, pages_compacted_show, NULL);
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
 	&dev_attr_initstate.attr,
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_comp_stats.attr,
 	&dev_attr_reset.attr,
 	&dev_attr_num_reads.attr,
 	&dev_attr_num_writes.attr,
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
+	&dev_attr_dedup_enable.attr,
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_wb_pages.attr,
+	&dev_attr_async_writes.attr,
+	&dev_attr_submit_latency.attr,
+	&dev_attr_write_latency.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_dedup_pages.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_pages_compacted.attr,
 	NULL,
 };
 
@@ -0,0 +1,230 @@
+/*
+ * Compressed RAM block device - backing device for writeback
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "zram_drv.h"
+
+/*
+ * Pages written back are stored one per PAGE_SIZE block of the backing
+ * device. Block 0 is never handed out so that it can mean "none".
+ */
+
+struct workqueue_struct *zram_wb_wq;
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_wb_rw_page(struct zram *zram, struct page *page,
+		unsigned long blk, int rw)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_end_io = zram_wb_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+/*
+ * Only called from the writeback worker.
+ */
+int zram_wb_write_page(struct zram *zram, struct page *page,
+		unsigned long blk)
+{
+	return zram_wb_rw_page(zram, page, blk, WRITE);
+}
+
+struct zram_wb_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int ret;
+};
+
+static void zram_wb_read_work_fn(struct work_struct *work)
+{
+	struct zram_wb_read_work *rw;
+
+	rw = container_of(work, struct zram_wb_read_work, work);
+	rw->ret = zram_wb_rw_page(rw->zram, rw->page, rw->blk, READ);
+}
+
+/*
+ * Called from zram_make_request(). A bio submitted from there is only
+ * dispatched once we return (see current->bio_list), so waiting for it
+ * in place would deadlock; the read is done from a worker instead.
+ */
+int zram_wb_read_page(struct zram *zram, struct page *page,
+		unsigned long blk)
+{
+	struct zram_wb_read_work rw;
+
+	if (!current->bio_list)
+		return zram_wb_rw_page(zram, page, blk, READ);
+
+	rw.zram = zram;
+	rw.page = page;
+	rw.blk = blk;
+
+	INIT_WORK_ONSTACK(&rw.work, zram_wb_read_work_fn);
+	queue_work(zram_wb_wq, &rw.work);
+	flush_work(&rw.work);
+	destroy_work_on_stack(&rw.work);
+
+	return rw.ret;
+}
+
+/*
+ * Returns a free block, or 0 if the backing device is full.
+ */
+unsigned long zram_wb_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->wb_lock);
+	blk = find_next_zero_bit(zram->wb_bitmap, zram->wb_nr_blocks, 1);
+	if (blk >= zram->wb_nr_blocks) {
+		spin_unlock(&zram->wb_lock);
+		return 0;
+	}
+	__set_bit(blk, zram->wb_bitmap);
+	spin_unlock(&zram->wb_lock);
+
+	return blk;
+}
+
+void zram_wb_free_block(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->wb_lock);
+	WARN_ON(!test_bit(blk, zram->wb_bitmap));
+	__clear_bit(blk, zram->wb_bitmap);
+	spin_unlock(&zram->wb_lock);
+}
+
+/*
+ * Forget all written back pages; used on device reset.
+ */
+void zram_wb_reset(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	spin_lock(&zram->wb_lock);
+	bitmap_zero(zram->wb_bitmap, zram->wb_nr_blocks);
+	spin_unlock(&zram->wb_lock);
+}
+
+void zram_wb_close(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->wb_bitmap);
+	kfree(zram->backing_dev);
+
+	zram->bdev = NULL;
+	zram->wb_bitmap = NULL;
+	zram->wb_nr_blocks = 0;
+	zram->backing_dev = NULL;
+}
+
+/*
+ * Must be called with init_lock held, before the device is initialized.
+ */
+int zram_wb_open(struct zram *zram, const char *path)
+{
+	char *name;
+	unsigned long nr_blocks, *bitmap;
+	struct block_device *bdev;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	bdev = blkdev_get_by_path(name,
+			FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (IS_ERR(bdev)) {
+		kfree(name);
+		return PTR_ERR(bdev);
+	}
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_blocks < 2) {
+		pr_info("Backing device %s is too small\n", name);
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(name);
+		return -EINVAL;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(name);
+		return -ENOMEM;
+	}
+
+	zram_wb_close(zram);
+
+	zram->bdev = bdev;
+	zram->backing_dev = name;
+	zram->wb_bitmap = bitmap;
+	zram->wb_nr_blocks = nr_blocks;
+
+	return 0;
+}
+
+int __init zram_wb_init(void)
+{
+	zram_wb_wq = alloc_workqueue("zram_wb", WQ_MEM_RECLAIM, 0);
+	if (!zram_wb_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void zram_wb_exit(void)
+{
+	destroy_workqueue(zram_wb_wq);
+}
@@ -0,0 +1,559 @@
+/*
+ * zspool memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Objects are grouped by size class. Each class owns a set of zspages,
+ * small groups of 0-order pages cut into equal-sized slots, so unlike
+ * xvmalloc every object in a page has a known size and position. This
+ * makes it possible to move objects out of sparsely used zspages and
+ * release them (zs_compact), given the owner can update its reference.
+ *
+ * Objects are identified by <first page of zspage, byte offset> so that
+ * callers can keep storing the same <page, offset> pair as before.
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zspool.h"
+#include "zspool_int.h"
+
+static struct zs_zspage *get_zspage(struct page *page)
+{
+	return (struct zs_zspage *)page_private(page);
+}
+
+static struct zs_class *get_class(struct zs_pool *pool, u32 size)
+{
+	if (size < ZS_MIN_ALLOC_SIZE)
+		size = ZS_MIN_ALLOC_SIZE;
+
+	return &pool->classes[DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+						ZS_ALIGN)];
+}
+
+/*
+ * Pick the number of pages per zspage which wastes the smallest
+ * fraction of memory for objects of the given size.
+ */
+static u16 get_pages_per_zspage(u32 size)
+{
+	int i, best = 1;
+	u32 best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		u32 zspage_size = i * PAGE_SIZE;
+		u32 usedpc = (zspage_size - zspage_size % size) * 100 /
+				zspage_size;
+
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void free_zspage(struct zs_zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < zspage->nr_pages; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+}
+
+static struct zs_zspage *alloc_zspage(struct zs_class *class, gfp_t flags)
+{
+	int i;
+	struct zs_zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page = alloc_page(flags);
+
+		if (!page) {
+			free_zspage(zspage);
+			return NULL;
+		}
+		zspage->pages[zspage->nr_pages++] = page;
+	}
+	set_page_private(zspage->pages[0], (unsigned long)zspage);
+
+	return zspage;
+}
+
+/*
+ * Copy @len bytes between a linear buffer and a zspage, possibly
+ * crossing a page boundary.
+ */
+static void zs_copy_from(struct zs_zspage *zspage, u32 offset,
+			void *buf, u32 len, enum km_type type)
+{
+	while (len) {
+		u32 off = offset & ~PAGE_MASK;
+		u32 n = min_t(u32, len, PAGE_SIZE - off);
+		char *addr;
+
+		addr = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT], type);
+		memcpy(buf, addr + off, n);
+		kunmap_atomic(addr, type);
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+static void zs_copy_to(struct zs_zspage *zspage, u32 offset,
+			const void *buf, u32 len, enum km_type type)
+{
+	while (len) {
+		u32 off = offset & ~PAGE_MASK;
+		u32 n = min_t(u32, len, PAGE_SIZE - off);
+		char *addr;
+
+		addr = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT], type);
+		memcpy(addr + off, buf, n);
+		kunmap_atomic(addr, type);
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @page: first page of the zspage holding the allocated block
+ * @offset: offset of the block within the zspage
+ *
+ * Returns 0 on success, -ENOMEM on failure.
+ */
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	u32 obj;
+	struct zs_class *class;
+	struct zs_zspage *zspage;
+
+	*page = NULL;
+	*offset = 0;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	class = get_class(pool, size);
+
+	spin_lock(&pool->lock);
+
+	if (list_empty(&class->partial)) {
+		spin_unlock(&pool->lock);
+		zspage = alloc_zspage(class, flags);
+		if (unlikely(!zspage))
+			return -ENOMEM;
+
+		spin_lock(&pool->lock);
+		list_add(&zspage->list, &class->partial);
+		pool->total_pages += zspage->nr_pages;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zs_zspage, list);
+
+	obj = find_first_zero_bit(zspage->used, class->objs_per_zspage);
+	__set_bit(obj, zspage->used);
+	if (++zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	spin_unlock(&pool->lock);
+
+	*page = zspage->pages[0];
+	*offset = obj * class->size;
+
+	return 0;
+}
+
+/**
+ * zs_commit - Allow compaction to move an object.
+ *
+ * Called once the object's contents, including whatever the owner's
+ * migrate callback reads from it, have been written.
+ */
+void zs_commit(struct zs_pool *pool, struct page *page, u32 offset)
+{
+	struct zs_zspage *zspage = get_zspage(page);
+	u32 obj = offset / zspage->class->size;
+
+	spin_lock(&pool->lock);
+	BUG_ON(!test_bit(obj, zspage->used));
+	__set_bit(obj, zspage->committed);
+	spin_unlock(&pool->lock);
+}
+
+/*
+ * Free block identified with <page, offset>
+ */
+void zs_free(struct zs_pool *pool, struct page *page, u32 offset)
+{
+	struct zs_zspage *zspage = get_zspage(page);
+	struct zs_class *class = zspage->class;
+	u32 obj = offset / class->size;
+
+	spin_lock(&pool->lock);
+
+	BUG_ON(!test_bit(obj, zspage->used));
+	__clear_bit(obj, zspage->used);
+	__clear_bit(obj, zspage->committed);
+
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		pool->total_pages -= zspage->nr_pages;
+		spin_unlock(&pool->lock);
+
+		free_zspage(zspage);
+		return;
+	}
+
+	spin_unlock(&pool->lock);
+}
+
+/**
+ * zs_map_object - Get a linear mapping of an object.
+ *
+ * Objects contained in a single page are kmapped (KM_USER1) directly;
+ * objects straddling two pages are copied to a per-cpu buffer. With
+ * ZS_MM_WO the buffer is written back by zs_unmap_object(). As with
+ * kmap_atomic(), the caller must not sleep until the object is unmapped.
+ */
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 offset,
+			enum zs_mapmode mm)
+{
+	struct zs_zspage *zspage = get_zspage(page);
+	u32 size = zspage->class->size;
+	u32 off = offset & ~PAGE_MASK;
+	struct zs_map_area *area;
+
+	if (off + size <= PAGE_SIZE)
+		return kmap_atomic(zspage->pages[offset >> PAGE_SHIFT],
+				KM_USER1) + off;
+
+	area = get_cpu_ptr(pool->map_area);
+	if (mm != ZS_MM_WO)
+		zs_copy_from(zspage, offset, area->buf, size, KM_USER1);
+
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, struct page *page, u32 offset,
+			void *obj, enum zs_mapmode mm)
+{
+	struct zs_zspage *zspage = get_zspage(page);
+	u32 size = zspage->class->size;
+	u32 off = offset & ~PAGE_MASK;
+	struct zs_map_area *area;
+
+	if (off + size <= PAGE_SIZE) {
+		kunmap_atomic(obj, KM_USER1);
+		return;
+	}
+
+	area = this_cpu_ptr(pool->map_area);
+	if (mm == ZS_MM_WO)
+		zs_copy_to(zspage, offset, area->buf, size, KM_USER1);
+	put_cpu_ptr(pool->map_area);
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	u64 ret;
+
+	spin_lock(&pool->lock);
+	ret = pool->total_pages << PAGE_SHIFT;
+	spin_unlock(&pool->lock);
+
+	return ret;
+}
+
+/*
+ * Source for compaction: the emptiest partial zspage not yet skipped.
+ * Returns NULL unless the other partial zspages have enough free
+ * slots to take all of its objects.
+ */
+static struct zs_zspage *find_compact_src(struct zs_class *class)
+{
+	u32 nr_free = 0;
+	struct zs_zspage *zspage, *src = NULL;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (!src || zspage->inuse < src->inuse) {
+			if (!zspage->compact_skip)
+				src = zspage;
+		}
+		nr_free += class->objs_per_zspage - zspage->inuse;
+	}
+
+	if (!src)
+		return NULL;
+
+	nr_free -= class->objs_per_zspage - src->inuse;
+	if (nr_free < src->inuse)
+		return NULL;
+
+	return src;
+}
+
+/* Destination: the fullest partial zspage other than @src */
+static struct zs_zspage *find_compact_dst(struct zs_class *class,
+				struct zs_zspage *src)
+{
+	struct zs_zspage *zspage, *dst = NULL;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (zspage == src)
+			continue;
+		if (!dst || zspage->inuse > dst->inuse)
+			dst = zspage;
+	}
+
+	return dst;
+}
+
+/*
+ * Try to move up to ZS_COMPACT_BATCH objects out of the emptiest zspage
+ * of @class, resuming where the last batch stopped, and free the zspage
+ * once it is empty. Objects that are uncommitted or that the owner will
+ * not release are passed over; a zspage is skipped once its scan ends
+ * with objects left. Returns the number of pages freed, or -1 if there
+ * is nothing left to compact. Called with pool->lock held.
+ */
+static long zs_compact_one(struct zs_pool *pool,
+		struct zs_class *class, zs_migrate_fn migrate, void *priv)
+{
+	int n;
+	long freed;
+	struct zs_zspage *src, *dst;
+
+	src = find_compact_src(class);
+	if (!src)
+		return -1;
+
+	for (n = 0; n < ZS_COMPACT_BATCH && src->inuse; n++) {
+		u32 obj, new_obj;
+
+		dst = find_compact_dst(class, src);
+		if (!dst)
+			break;
+
+		/* Objects not yet committed hold no valid header */
+		obj = find_next_bit(src->committed, class->objs_per_zspage,
+					src->compact_pos);
+		if (obj >= class->objs_per_zspage)
+			break;
+		src->compact_pos = obj + 1;
+
+		new_obj = find_first_zero_bit(dst->used,
+					class->objs_per_zspage);
+
+		/* Object must be in place before the owner is told */
+		zs_copy_from(src, obj * class->size, pool->compact_buf,
+				class->size, KM_USER0);
+		zs_copy_to(dst, new_obj * class->size, pool->compact_buf,
+				class->size, KM_USER0);
+
+		if (migrate(priv, pool->compact_buf,
+				src->pages[0], obj * class->size,
+				dst->pages[0], new_obj * class->size))
+			continue;
+
+		__set_bit(new_obj, dst->used);
+		__set_bit(new_obj, dst->committed);
+		if (++dst->inuse == class->objs_per_zspage)
+			list_move(&dst->list, &class->full);
+
+		__clear_bit(obj, src->used);
+		__clear_bit(obj, src->committed);
+		src->inuse--;
+	}
+
+	if (src->inuse) {
+		/* Batch used up: carry on with this zspage next time */
+		if (n == ZS_COMPACT_BATCH)
+			return 0;
+		src->compact_skip = 1;
+		return 0;
+	}
+
+	list_del(&src->list);
+	freed = src->nr_pages;
+	pool->total_pages -= freed;
+	free_zspage(src);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Release sparsely used zspages.
+ * @pool: pool to compact
+ * @migrate: called to update the owner's reference to each moved object
+ * @priv: passed to @migrate
+ *
+ * Objects are moved from the emptiest zspages of each class to the
+ * fullest ones. Objects the owner refuses to release are left in place.
+ * The pool lock is dropped between batches of ZS_COMPACT_BATCH objects,
+ * and each class gets a bounded number of batches.
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool, zs_migrate_fn migrate,
+			void *priv)
+{
+	int i;
+	long ret;
+	unsigned long freed = 0;
+	struct zs_zspage *zspage;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct zs_class *class = &pool->classes[i];
+		unsigned long budget = 0;
+
+		/* Enough batches to scan every partial zspage once */
+		spin_lock(&pool->lock);
+		list_for_each_entry(zspage, &class->partial, list)
+			budget += DIV_ROUND_UP(class->objs_per_zspage,
+						ZS_COMPACT_BATCH) + 1;
+		spin_unlock(&pool->lock);
+
+		while (budget--) {
+			spin_lock(&pool->lock);
+			ret = zs_compact_one(pool, class, migrate, priv);
+			spin_unlock(&pool->lock);
+
+			cond_resched();
+			if (ret < 0)
+				break;
+			freed += ret;
+		}
+
+		/* A skipped zspage may have been filled up meanwhile */
+		spin_lock(&pool->lock);
+		list_for_each_entry(zspage, &class->partial, list) {
+			zspage->compact_skip = 0;
+			zspage->compact_pos = 0;
+		}
+		list_for_each_entry(zspage, &class->full, list) {
+			zspage->compact_skip = 0;
+			zspage->compact_pos = 0;
+		}
+		spin_unlock(&pool->lock);
+	}
+
+	return freed;
+}
+
+static void zs_free_map_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	if (!pool->map_area)
+		return;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+	free_percpu(pool->map_area);
+}
+
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	spin_lock_init(&pool->lock);
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct zs_class *class = &pool->classes[i];
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_ALIGN;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+						class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	pool->compact_buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+	if (!pool->compact_buf)
+		goto fail;
+
+	return pool;
+
+fail:
+	zs_free_map_areas(pool);
+	kfree(pool);
+	return NULL;
+}
+
+static void zs_destroy_list(struct list_head *head)
+{
+	struct zs_zspage *zspage, *tmp;
+
+	list_for_each_entry_safe(zspage, tmp, head, list) {
+		list_del(&zspage->list);
+		free_zspage(zspage);
+	}
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		zs_destroy_list(&pool->classes[i].partial);
+		zs_destroy_list(&pool->classes[i].full);
+	}
+
+	zs_free_map_areas(pool);
+	kfree(pool->compact_buf);
+	kfree(pool);
+}
@@ -0,0 +1,53 @@
+/*
+ * zspool memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_POOL_H_
+#define _ZS_POOL_H_
+
+#include <linux/types.h>
+
+struct page;
+struct zs_pool;
+
+enum zs_mapmode {
+	ZS_MM_RO,	/* object is only read */
+	ZS_MM_WO,	/* object is (over)written as a whole */
+};
+
+/*
+ * Called by zs_compact() once an object has been copied to its new
+ * location. @obj holds the object contents. The owner must point its
+ * reference at <new_page, new_offset> and return 0, or return non-zero
+ * if the object cannot be moved right now (in use or being freed). Only
+ * objects passed to zs_commit() are moved, so @obj is always as the
+ * owner wrote it. Called with the pool lock held: must not sleep.
+ */
+typedef int (*zs_migrate_fn)(void *priv, void *obj,
+			struct page *old_page, u32 old_offset,
+			struct page *new_page, u32 new_offset);
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+			u32 *offset, gfp_t flags);
+void zs_commit(struct zs_pool *pool, struct page *page, u32 offset);
+void zs_free(struct zs_pool *pool, struct page *page, u32 offset);
+
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 offset,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, struct page *page, u32 offset,
+			void *obj, enum zs_mapmode mm);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+unsigned long zs_compact(struct zs_pool *pool, zs_migrate_fn migrate,
+			void *priv);
+
+#endif
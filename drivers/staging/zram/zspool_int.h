@@ -0,0 +1,83 @@
+/*
+ * zspool memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_POOL_INT_H_
+#define _ZS_POOL_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/* Size classes are separated by ZS_ALIGN bytes. Must be power of two */
+#define ZS_ALIGN_SHIFT		4
+#define ZS_ALIGN		(1 << ZS_ALIGN_SHIFT)
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * A zspage is a group of up to this many 0-order pages holding objects
+ * of one size class. Objects may straddle the pages of a zspage, which
+ * lets large classes pack without wasting the tail of every page.
+ * Offsets within a zspage must fit in 16 bits.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+#define ZS_NR_CLASSES	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+				/ ZS_ALIGN + 1)
+
+#define ZS_MAX_OBJS_PER_ZSPAGE	\
+	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE)
+
+/* Objects compaction tries to move per hold of the pool lock */
+#define ZS_COMPACT_BATCH	16
+
+/* End of user params */
+
+struct zs_class {
+	u32 size;
+	u16 pages_per_zspage;
+	u16 objs_per_zspage;
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;
+};
+
+struct zs_zspage {
+	struct list_head list;		/* class->partial or class->full */
+	struct zs_class *class;
+	u16 inuse;
+	u8 nr_pages;
+	u8 compact_skip;		/* compaction could not empty it */
+	u16 compact_pos;		/* next object compaction tries */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long used[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+	/* objects the owner has filled in; only these may be moved */
+	unsigned long committed[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+};
+
+/* Buffer used to access objects that straddle two pages */
+struct zs_map_area {
+	char *buf;
+};
+
+struct zs_pool {
+	spinlock_t lock;
+	u64 total_pages;
+
+	struct zs_class classes[ZS_NR_CLASSES];
+	struct zs_map_area __percpu *map_area;
+	char *compact_buf;		/* protected by lock */
+};
+
+#endif
@@ -41,6 +41,9 @@
 #include "dc_reg.h"
 #include "dc_priv.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/tegra_dc.h>
+
 static void _tegra_dc_disable(struct tegra_dc *dc);
 
 struct tegra_dc *tegra_dcs[TEGRA_MAX_DC];
@@ -312,12 +315,84 @@ static const struct file_operations dbg_fops = {
 	.release	= single_release,
 };
 
+static void dbg_win_config_print(struct seq_file *s,
+				 const struct tegra_dc_win_config *cfg)
+{
+	if (!cfg->enabled) {
+		seq_printf(s, "disabled\n");
+		return;
+	}
+
+	seq_printf(s, "fmt %2u %4ux%-4u -> %4ux%-4u filter %c%c %8lu KB/s\n",
+		   cfg->fmt, cfg->in_w, cfg->in_h, cfg->out_w, cfg->out_h,
+		   cfg->filter_h ? 'h' : '-', cfg->filter_v ? 'v' : '-',
+		   cfg->bandwidth);
+}
+
+static int dbg_underflow_show(struct seq_file *s, void *unused)
+{
+	struct tegra_dc *dc = s->private;
+	struct tegra_dc_win_config config[DC_N_WINDOWS];
+	unsigned long underflows[DC_N_WINDOWS];
+	struct tegra_dc_underflow *log;
+	unsigned int i, n, first;
+
+	log = kmalloc(sizeof(dc->underflow_log), GFP_KERNEL);
+	if (!log)
+		return -ENOMEM;
+
+	spin_lock_irq(&dc->underflow_lock);
+	memcpy(config, dc->win_config, sizeof(config));
+	memcpy(underflows, dc->underflows, sizeof(underflows));
+	n = dc->underflow_log_count;
+	first = dc->underflow_log_next + TEGRA_DC_UNDERFLOW_LOG_SIZE - n;
+	for (i = 0; i < n; i++)
+		log[i] = dc->underflow_log[(first + i) %
+					   TEGRA_DC_UNDERFLOW_LOG_SIZE];
+	spin_unlock_irq(&dc->underflow_lock);
+
+	seq_printf(s, "emc floor %lu kHz\n", dc->emc_rate / 1000);
+
+	for (i = 0; i < DC_N_WINDOWS; i++) {
+		seq_printf(s, "win %c: underflows %lu, ", 'a' + i,
+			   underflows[i]);
+		dbg_win_config_print(s, &config[i]);
+	}
+
+	seq_printf(s, "\nrecent underflows:\n");
+	for (i = 0; i < n; i++) {
+		seq_printf(s, "%lld us win %c frames %d: ",
+			   ktime_to_us(log[i].time), 'a' + log[i].win,
+			   log[i].frames);
+		dbg_win_config_print(s, &log[i].config);
+	}
+
+	kfree(log);
+	return 0;
+}
+
+static int dbg_underflow_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dbg_underflow_show, inode->i_private);
+}
+
+static const struct file_operations dbg_underflow_fops = {
+	.open		= dbg_underflow_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static void tegra_dc_dbg_add(struct tegra_dc *dc)
 {
 	char name[32];
 
 	snprintf(name, sizeof(name), "tegra_dc%d_regs", dc->ndev->id);
 	(void) debugfs_create_file(name, S_IRUGO, NULL, dc, &dbg_fops);
+
+	snprintf(name, sizeof(name), "tegra_dc%d_underflows", dc->ndev->id);
+	(void) debugfs_create_file(name, S_IRUGO, NULL, dc,
+				   &dbg_underflow_fops);
 }
 #else
 static void tegra_dc_dbg_add(struct tegra_dc *dc) {}
@@ -557,6 +632,122 @@ static inline u32 compute_initial_dda(fixed20_12 in)
 	return dfixed_frac(in);
 }
 
+/*
+ * Estimated memory bandwidth of a window, in KB/s.  This is the rate while
+ * the window is being scanned out: each output line time fetches in_h /
+ * out_h source lines, so vertical downscaling raises it.
+ */
+static unsigned long tegra_dc_win_bandwidth(struct tegra_dc *dc,
+					    struct tegra_dc_win *win)
+{
+	const struct tegra_dc_mode *mode = &dc->mode;
+	unsigned long h_total;
+	u64 bw;
+
+	h_total = mode->h_sync_width + mode->h_back_porch +
+		mode->h_active + mode->h_front_porch;
+	if (!h_total || !win->out_h)
+		return 0;
+
+	bw = (u64)dfixed_trunc(win->w) * dfixed_trunc(win->h) *
+		tegra_dc_fmt_bpp(win->fmt) / 8;
+	bw *= mode->pclk;
+	do_div(bw, h_total * win->out_h);
+	do_div(bw, 1024);
+
+	return bw;
+}
+
+/*
+ * The EMC moves 8 bytes per clock (32-bit DDR), of which the display can
+ * count on about half.
+ */
+#define TEGRA_DC_EMC_BYTES_PER_CLK	8
+#define TEGRA_DC_EMC_EFFICIENCY		50
+
+/* EMC rate, in Hz, needed by the windows of a head; called with dc->lock */
+static unsigned long tegra_dc_emc_rate(struct tegra_dc *dc)
+{
+	unsigned long bw = 0;
+	u64 rate;
+	int i;
+
+	for (i = 0; i < DC_N_WINDOWS; i++)
+		bw += dc->win_config[i].bandwidth;
+
+	rate = (u64)bw * 1024 * 100;
+	do_div(rate, TEGRA_DC_EMC_BYTES_PER_CLK * TEGRA_DC_EMC_EFFICIENCY);
+
+	/* the board's rate is a validated minimum, not just a boot value */
+	return max_t(unsigned long, rate, dc->pdata->emc_clk_rate);
+}
+
+/*
+ * Raises the EMC floor before new window state is latched.  A lower floor
+ * only takes effect once the windows have latched, from tegra_dc_emc_worker.
+ */
+static void tegra_dc_program_bandwidth(struct tegra_dc *dc)
+{
+	unsigned long rate = tegra_dc_emc_rate(dc);
+
+	dc->emc_rate_pending = rate;
+	if (rate > dc->emc_rate) {
+		dc->emc_rate = rate;
+		clk_set_rate(dc->emc_clk, rate);
+	}
+}
+
+static void tegra_dc_emc_worker(struct work_struct *work)
+{
+	struct tegra_dc *dc = container_of(work, struct tegra_dc, emc_work);
+	int i;
+
+	mutex_lock(&dc->lock);
+
+	/* an update still waiting to latch may need the old rate */
+	for (i = 0; i < DC_N_WINDOWS; i++) {
+		if (dc->windows[i].dirty) {
+			mutex_unlock(&dc->lock);
+			return;
+		}
+	}
+
+	if (dc->emc_rate_pending < dc->emc_rate) {
+		dc->emc_rate = dc->emc_rate_pending;
+		clk_set_rate(dc->emc_clk, dc->emc_rate);
+	}
+
+	mutex_unlock(&dc->lock);
+}
+
+static void tegra_dc_set_win_config(struct tegra_dc *dc,
+				    struct tegra_dc_win *win,
+				    bool filter_h, bool filter_v)
+{
+	struct tegra_dc_win_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	if (win->flags & TEGRA_WIN_FLAG_ENABLED) {
+		cfg.enabled = true;
+		cfg.filter_h = filter_h;
+		cfg.filter_v = filter_v;
+		cfg.fmt = win->fmt;
+		cfg.in_w = dfixed_trunc(win->w);
+		cfg.in_h = dfixed_trunc(win->h);
+		cfg.out_w = win->out_w;
+		cfg.out_h = win->out_h;
+		cfg.bandwidth = tegra_dc_win_bandwidth(dc, win);
+	}
+
+	spin_lock_irq(&dc->underflow_lock);
+	dc->win_config[win->idx] = cfg;
+	spin_unlock_irq(&dc->underflow_lock);
+
+	trace_tegra_dc_window_config(dc->ndev->id, win->idx, cfg.fmt,
+				     cfg.in_w, cfg.in_h, cfg.out_w, cfg.out_h,
+				     cfg.bandwidth);
+}
+
 /* does not support updating windows on multiple dcs in one call */
 int tegra_dc_update_windows(struct tegra_dc_win *windows[], int n)
 {
@@ -617,6 +808,8 @@ int tegra_dc_update_windows(struct tegra_dc_win *windows[], int n)
 
 		update_mask |= WIN_A_ACT_REQ << win->idx;
 
+		tegra_dc_set_win_config(dc, win, filter_h, filter_v);
+
 		if (!(win->flags & TEGRA_WIN_FLAG_ENABLED)) {
 			tegra_dc_writel(dc, 0, DC_WIN_WIN_OPTIONS);
 			continue;
@@ -702,6 +895,8 @@ int tegra_dc_update_windows(struct tegra_dc_win *windows[], int n)
 		}
 	}
 
+	tegra_dc_program_bandwidth(dc);
+
 	tegra_dc_writel(dc, update_mask << 8, DC_CMD_STATE_CONTROL);
 
 	val = tegra_dc_readl(dc, DC_CMD_INT_ENABLE);
@@ -1121,6 +1316,27 @@ unsigned tegra_dc_get_out_width(struct tegra_dc *dc)
 }
 EXPORT_SYMBOL(tegra_dc_get_out_width);
 
+/* called from the irq handler with underflow_lock held */
+static void tegra_dc_log_underflow(struct tegra_dc *dc, int win)
+{
+	struct tegra_dc_underflow *entry;
+
+	entry = &dc->underflow_log[dc->underflow_log_next];
+	entry->time = ktime_get();
+	entry->win = win;
+	entry->frames = dc->windows[win].underflows;
+	entry->config = dc->win_config[win];
+
+	dc->underflow_log_next = (dc->underflow_log_next + 1) %
+		TEGRA_DC_UNDERFLOW_LOG_SIZE;
+	if (dc->underflow_log_count < TEGRA_DC_UNDERFLOW_LOG_SIZE)
+		dc->underflow_log_count++;
+	dc->underflows[win]++;
+
+	trace_tegra_dc_underflow(dc->ndev->id, win, entry->frames,
+				 entry->config.bandwidth);
+}
+
 static irqreturn_t tegra_dc_irq(int irq, void *ptr)
 {
 	struct tegra_dc *dc = ptr;
@@ -1203,9 +1419,14 @@ static irqreturn_t tegra_dc_irq(int irq, void *ptr)
 		}
 	}
 
-	if (completed)
+	if (completed) {
+		dc->latch_time = ktime_get();
 		wake_up(&dc->wq);
 
+		if (dc->emc_rate_pending < dc->emc_rate)
+			schedule_work(&dc->emc_work);
+	}
+
 
 	/*
 	 * Overlays can get thier internal state corrupted during and underflow
@@ -1224,9 +1445,11 @@ static irqreturn_t tegra_dc_irq(int irq, void *ptr)
 	if (status & V_BLANK_INT) {
 		int i;
 
+		spin_lock(&dc->underflow_lock);
 		for (i = 0; i< DC_N_WINDOWS; i++) {
 			if (dc->underflow_mask & (WIN_A_UF_INT <<i)) {
 				dc->windows[i].underflows++;
+				tegra_dc_log_underflow(dc, i);
 
 				if (dc->windows[i].underflows > 4)
 					schedule_work(&dc->reset_work);
@@ -1234,8 +1457,9 @@ static irqreturn_t tegra_dc_irq(int irq, void *ptr)
 				dc->windows[i].underflows = 0;
 			}
 		}
+		spin_unlock(&dc->underflow_lock);
 
-		if (!dc->underflow_mask) {
+		if (!dc->underflow_mask && !dc->vblank_ref) {
 			val = tegra_dc_readl(dc, DC_CMD_INT_ENABLE);
 			val &= ~V_BLANK_INT;
 			tegra_dc_writel(dc, val, DC_CMD_INT_ENABLE);
@@ -1244,10 +1468,49 @@ static irqreturn_t tegra_dc_irq(int irq, void *ptr)
 		dc->underflow_mask = 0;
 	}
 
+	if (dc->vblank_ref &&
+	    (status & (V_BLANK_INT | FRAME_END_INT | H_BLANK_INT)))
+		return IRQ_WAKE_THREAD;
 
 	return IRQ_HANDLED;
 }
 
+static irqreturn_t tegra_dc_irq_thread(int irq, void *ptr)
+{
+	struct tegra_dc *dc = ptr;
+
+	if (dc->ext)
+		tegra_dc_ext_vblank(dc->ext);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * While referenced, V_BLANK_INT stays enabled and the irq thread runs once
+ * per frame, so that the dc extensions can latch queued flips.
+ */
+void tegra_dc_vblank_get(struct tegra_dc *dc)
+{
+	unsigned long val;
+
+	mutex_lock(&dc->lock);
+	if (dc->vblank_ref++ == 0 && dc->enabled) {
+		val = tegra_dc_readl(dc, DC_CMD_INT_ENABLE);
+		val |= V_BLANK_INT;
+		tegra_dc_writel(dc, val, DC_CMD_INT_ENABLE);
+	}
+	mutex_unlock(&dc->lock);
+}
+
+/* V_BLANK_INT is disabled by the irq handler once it is unused */
+void tegra_dc_vblank_put(struct tegra_dc *dc)
+{
+	mutex_lock(&dc->lock);
+	BUG_ON(dc->vblank_ref <= 0);
+	dc->vblank_ref--;
+	mutex_unlock(&dc->lock);
+}
+
 static void tegra_dc_set_color_control(struct tegra_dc *dc)
 {
 	u32 color_control;
@@ -1642,12 +1905,22 @@ static int tegra_dc_probe(struct nvhost_device *ndev)
 	emc_clk_rate = dc->pdata->emc_clk_rate;
 	clk_set_rate(emc_clk, emc_clk_rate ? emc_clk_rate : ULONG_MAX);
 
+	/*
+	 * Until windows are programmed, keep whatever was set above.  After
+	 * that, the rate follows the windows' bandwidth, with the platform
+	 * rate as a floor.
+	 */
+	dc->emc_rate = emc_clk_rate ? emc_clk_rate : ULONG_MAX;
+	dc->emc_rate_pending = dc->emc_rate;
+
 	if (dc->pdata->flags & TEGRA_DC_FLAG_ENABLED)
 		dc->enabled = true;
 
 	mutex_init(&dc->lock);
 	init_waitqueue_head(&dc->wq);
 	INIT_WORK(&dc->reset_work, tegra_dc_reset_worker);
+	INIT_WORK(&dc->emc_work, tegra_dc_emc_worker);
+	spin_lock_init(&dc->underflow_lock);
 
 	dc->n_windows = DC_N_WINDOWS;
 	for (i = 0; i < dc->n_windows; i++) {
@@ -1655,8 +1928,8 @@ static int tegra_dc_probe(struct nvhost_device *ndev)
 		dc->windows[i].dc = dc;
 	}
 
-	if (request_irq(irq, tegra_dc_irq, IRQF_DISABLED,
-			dev_name(&ndev->dev), dc)) {
+	if (request_threaded_irq(irq, tegra_dc_irq, tegra_dc_irq_thread,
+				 IRQF_DISABLED, dev_name(&ndev->dev), dc)) {
 		dev_err(&ndev->dev, "request_irq %d failed\n", irq);
 		ret = -EBUSY;
 		goto err_put_emc_clk;
@@ -1758,6 +2031,7 @@ static int tegra_dc_remove(struct nvhost_device *ndev)
 		_tegra_dc_disable(dc);
 
 	free_irq(dc->irq, dc);
+	cancel_work_sync(&dc->emc_work);
 	clk_put(dc->emc_clk);
 	clk_put(dc->clk);
 	iounmap(dc->base);
@@ -19,8 +19,10 @@
 #define __DRIVERS_VIDEO_TEGRA_DC_DC_PRIV_H
 
 #include <linux/io.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/wait.h>
 #include "../host/dev.h"
 
@@ -33,6 +35,30 @@ struct tegra_dc_blend {
 	unsigned flags[DC_N_WINDOWS];
 };
 
+/* window state as last programmed, kept for underflow reports */
+struct tegra_dc_win_config {
+	bool		enabled;
+	bool		filter_h;
+	bool		filter_v;
+	u8		fmt;
+	unsigned	in_w;
+	unsigned	in_h;
+	unsigned	out_w;
+	unsigned	out_h;
+	/* estimated memory bandwidth, in KB/s */
+	unsigned long	bandwidth;
+};
+
+#define TEGRA_DC_UNDERFLOW_LOG_SIZE	32
+
+struct tegra_dc_underflow {
+	ktime_t				time;
+	int				win;
+	/* consecutive frames the window has underflowed */
+	int				frames;
+	struct tegra_dc_win_config	config;
+};
+
 struct tegra_dc_out_ops {
 	/* initialize output.  dc clocks are not on at this point */
 	int (*init)(struct tegra_dc *dc);
@@ -63,6 +89,11 @@ struct tegra_dc {
 
 	struct clk			*clk;
 	struct clk			*emc_clk;
+	/* EMC floor requested for the windows, in Hz */
+	unsigned long			emc_rate;
+	/* floor needed once the last window update has latched */
+	unsigned long			emc_rate_pending;
+	struct work_struct		emc_work;
 
 	bool				connected;
 	bool				enabled;
@@ -92,10 +123,21 @@ struct tegra_dc {
 		u32			max;
 	} syncpt[DC_N_WINDOWS];
 	u32				vblank_syncpt;
+	int				vblank_ref;
+	/* when the last window update was latched by the hardware */
+	ktime_t				latch_time;
 
 	unsigned long			underflow_mask;
 	struct work_struct		reset_work;
 
+	/* underflow telemetry, updated from the irq handler */
+	spinlock_t			underflow_lock;
+	struct tegra_dc_win_config	win_config[DC_N_WINDOWS];
+	unsigned long			underflows[DC_N_WINDOWS];
+	struct tegra_dc_underflow	underflow_log[TEGRA_DC_UNDERFLOW_LOG_SIZE];
+	unsigned int			underflow_log_next;
+	unsigned int			underflow_log_count;
+
 	struct tegra_dc_ext		*ext;
 };
 
@@ -147,6 +189,9 @@ static inline void *tegra_dc_get_outdata(struct tegra_dc *dc)
 
 void tegra_dc_setup_clk(struct tegra_dc *dc, struct clk *clk);
 
+void tegra_dc_vblank_get(struct tegra_dc *dc);
+void tegra_dc_vblank_put(struct tegra_dc *dc);
+
 extern struct tegra_dc_out_ops tegra_dc_rgb_ops;
 extern struct tegra_dc_out_ops tegra_dc_hdmi_ops;
 
@@ -20,9 +20,10 @@
 
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
-#include <linux/workqueue.h>
 
 #include <video/tegra_dc_ext.h>
 
@@ -53,10 +54,29 @@ struct tegra_dc_ext_flip_win {
 
 struct tegra_dc_ext_flip_data {
 	struct tegra_dc_ext		*ext;
-	struct work_struct		work;
+	struct list_head		list;
 	struct tegra_dc_ext_flip_win	win[DC_N_WINDOWS];
+	/* previous front buffers, released once this flip is latched */
+	struct nvmap_handle_ref		*unpin_handles[DC_N_WINDOWS];
+	int				nr_unpin;
+	int				nr_disable;
+	u32				post_syncpt_id;
+	u32				post_syncpt_val;
+	ktime_t				queued;
+	/*
+	 * Pre-syncpoints of every window in the request, on any head; a
+	 * flip is latched anyway if they are not reached by the deadline.
+	 */
+	struct {
+		u32			id;
+		u32			val;
+	} pre[DC_N_WINDOWS * TEGRA_DC_EXT_FLIP_N_HEADS];
+	int				nr_pre;
+	unsigned long			deadline;
 };
 
+static void tegra_dc_ext_flip_drain(struct tegra_dc_ext *ext);
+
 int tegra_dc_ext_get_num_outputs(void)
 {
 	/* TODO: decouple output count from head count */
@@ -111,7 +131,8 @@ static int tegra_dc_ext_put_window(struct tegra_dc_ext_user *user,
 {
 	struct tegra_dc_ext *ext = user->ext;
 	struct tegra_dc_ext_win *win;
-	int ret = 0;
+	u32 queued;
+	int ret;
 
 	if (n >= DC_N_WINDOWS)
 		return -EINVAL;
@@ -120,15 +141,28 @@ static int tegra_dc_ext_put_window(struct tegra_dc_ext_user *user,
 
 	mutex_lock(&win->lock);
 
-	if (win->user == user) {
-		flush_workqueue(win->flip_wq);
-		win->user = 0;
-	} else {
-		ret = -EACCES;
+	if (win->user != user) {
+		mutex_unlock(&win->lock);
+		return -EACCES;
 	}
 
+	/* no new flips of this window once the lock is dropped */
+	win->user = 0;
+
+	mutex_lock(&ext->flip.lock);
+	queued = win->flips_queued;
+	mutex_unlock(&ext->flip.lock);
+
 	mutex_unlock(&win->lock);
 
+	/*
+	 * Wait for the user's own flips of this window only.  A flipping
+	 * thread may hold a queue slot while it waits for win->lock, so the
+	 * lock must not be held here.
+	 */
+	ret = wait_event_killable(ext->flip.wq,
+			(s32)(win->flips_done - queued) >= 0);
+
 	return ret;
 }
 
@@ -160,18 +194,13 @@ void tegra_dc_ext_enable(struct tegra_dc_ext *ext)
 
 void tegra_dc_ext_disable(struct tegra_dc_ext *ext)
 {
-	int i;
 	set_enable(ext, false);
 
 	/*
 	 * Flush the flip queue -- note that this must be called with dc->lock
 	 * unlocked or else it will hang.
 	 */
-	for (i = 0; i < ext->dc->n_windows; i++) {
-		struct tegra_dc_ext_win *win = &ext->win[i];
-
-		flush_workqueue(win->flip_wq);
-	}
+	tegra_dc_ext_flip_drain(ext);
 }
 
 static int tegra_dc_ext_set_windowattr(struct tegra_dc_ext *ext,
@@ -220,14 +249,6 @@ static int tegra_dc_ext_set_windowattr(struct tegra_dc_ext *ext,
 	win->stride = flip_win->attr.stride;
 	win->stride_uv = flip_win->attr.stride_uv;
 
-	if ((s32)flip_win->attr.pre_syncpt_id >= 0) {
-		nvhost_syncpt_wait_timeout(&ext->dc->ndev->host->syncpt,
-					   flip_win->attr.pre_syncpt_id,
-					   flip_win->attr.pre_syncpt_val,
-					   msecs_to_jiffies(500));
-	}
-
-
 	return 0;
 }
 
@@ -244,14 +265,46 @@ static void process_window_change(struct tegra_dc_ext *ext, int delta)
 	mutex_unlock(&ext->enable_change_lock);
 }
 
-static void tegra_dc_ext_flip_worker(struct work_struct *work)
+static bool tegra_dc_ext_flip_ready(struct tegra_dc_ext_flip_data *data)
+{
+	struct nvhost_syncpt *sp = &data->ext->dc->ndev->host->syncpt;
+	int i;
+
+	if (time_after_eq(jiffies, data->deadline))
+		return true;
+
+	for (i = 0; i < data->nr_pre; i++) {
+		nvhost_syncpt_update_min(sp, data->pre[i].id);
+		if (!nvhost_syncpt_min_cmp(sp, data->pre[i].id,
+					   data->pre[i].val))
+			return false;
+	}
+
+	return true;
+}
+
+static bool tegra_dc_ext_flip_latched(struct tegra_dc_ext_flip_data *data)
+{
+	int i;
+
+	for (i = 0; i < DC_N_WINDOWS; i++) {
+		int index = data->win[i].attr.index;
+
+		if (index < 0)
+			continue;
+
+		if (tegra_dc_get_window(data->ext->dc, index)->dirty)
+			return false;
+	}
+
+	return true;
+}
+
+static void tegra_dc_ext_flip_program(struct tegra_dc_ext_flip_data *data)
 {
-	struct tegra_dc_ext_flip_data *data =
-		container_of(work, struct tegra_dc_ext_flip_data, work);
 	struct tegra_dc_ext *ext = data->ext;
 	struct tegra_dc_win *wins[DC_N_WINDOWS];
-	struct nvmap_handle_ref *unpin_handles[DC_N_WINDOWS];
-	int i, nr_unpin = 0, nr_win = 0, nr_disable = 0;
+	int i, nr_win = 0;
 
 	for (i = 0; i < DC_N_WINDOWS; i++) {
 		struct tegra_dc_ext_flip_win *flip_win = &data->win[i];
@@ -274,12 +327,13 @@ static void tegra_dc_ext_flip_worker(struct work_struct *work)
 			if (new_ena)
 				process_window_change(ext, 1);
 			else
-				nr_disable++;
+				data->nr_disable++;
 		}
 		ext->win[index].enabled = new_ena;
 
 		if (old_ena && ext_win->cur_handle)
-			unpin_handles[nr_unpin++] = ext_win->cur_handle;
+			data->unpin_handles[data->nr_unpin++] =
+				ext_win->cur_handle;
 
 		tegra_dc_ext_set_windowattr(ext, win, &data->win[i]);
 
@@ -287,7 +341,34 @@ static void tegra_dc_ext_flip_worker(struct work_struct *work)
 	}
 
 	tegra_dc_update_windows(wins, nr_win);
-	tegra_dc_sync_windows(wins, nr_win);
+}
+
+static void tegra_dc_ext_flip_log(struct tegra_dc_ext_flip_data *data,
+				  ktime_t latched)
+{
+	struct tegra_dc_ext_flip_queue *q = &data->ext->flip;
+	struct tegra_dc_ext_flip_latch *entry = &q->log[q->log_next];
+
+	entry->post_syncpt_id = data->post_syncpt_id;
+	entry->post_syncpt_val = data->post_syncpt_val;
+	entry->queued = ktime_to_timespec(data->queued);
+	entry->latched = ktime_to_timespec(latched);
+
+	q->log_next = (q->log_next + 1) % TEGRA_DC_EXT_FLIP_LOG_SIZE;
+	if (q->log_count < TEGRA_DC_EXT_FLIP_LOG_SIZE)
+		q->log_count++;
+}
+
+/*
+ * Signals the post syncpoints of a flip and releases the buffers it
+ * replaced.  Called with the queue lock held, once the flip is latched or
+ * the head is going away.
+ */
+static void tegra_dc_ext_flip_complete(struct tegra_dc_ext_flip_data *data,
+				       ktime_t latched)
+{
+	struct tegra_dc_ext *ext = data->ext;
+	int i;
 
 	for (i = 0; i < DC_N_WINDOWS; i++) {
 		struct tegra_dc_ext_flip_win *flip_win = &data->win[i];
@@ -298,20 +379,144 @@ static void tegra_dc_ext_flip_worker(struct work_struct *work)
 
 		tegra_dc_incr_syncpt_min(ext->dc, index,
 			flip_win->syncpt_max);
+		ext->win[index].flips_done++;
 	}
 
 	/* unpin and deref previous front buffers */
-	for (i = 0; i < nr_unpin; i++) {
-		nvmap_unpin(ext->nvmap, unpin_handles[i]);
-		nvmap_free(ext->nvmap, unpin_handles[i]);
+	for (i = 0; i < data->nr_unpin; i++) {
+		nvmap_unpin(ext->nvmap, data->unpin_handles[i]);
+		nvmap_free(ext->nvmap, data->unpin_handles[i]);
 	}
 
-	if (nr_disable)
-		process_window_change(ext, -nr_disable);
+	if (data->nr_disable)
+		process_window_change(ext, -data->nr_disable);
 
+	tegra_dc_ext_flip_log(data, latched);
+
+	ext->flip.depth--;
+	wake_up(&ext->flip.wq);
 	kfree(data);
 }
 
+/*
+ * Retires the programmed flip once the hardware has latched it, then
+ * programs the next queued flip whose pre-syncpoints have been reached.
+ * Runs from the flip ioctl and from the dc irq thread, so a frame never
+ * waits on a worker.
+ */
+static void tegra_dc_ext_flip_advance(struct tegra_dc_ext *ext)
+{
+	struct tegra_dc_ext_flip_queue *q = &ext->flip;
+	struct tegra_dc_ext_flip_data *data;
+
+	mutex_lock(&q->lock);
+
+	data = q->programmed;
+	if (data && tegra_dc_ext_flip_latched(data)) {
+		ktime_t latched = ext->dc->latch_time;
+
+		/* a flip that only disables windows latches unobserved */
+		if (ktime_to_ns(latched) < ktime_to_ns(data->queued))
+			latched = ktime_get();
+
+		q->programmed = NULL;
+		tegra_dc_ext_flip_complete(data, latched);
+	}
+
+	if (!q->programmed && !list_empty(&q->pending)) {
+		data = list_first_entry(&q->pending,
+					struct tegra_dc_ext_flip_data, list);
+		if (tegra_dc_ext_flip_ready(data)) {
+			list_del(&data->list);
+			q->programmed = data;
+			tegra_dc_ext_flip_program(data);
+		}
+	}
+
+	if (q->vblank && !q->programmed && list_empty(&q->pending)) {
+		q->vblank = false;
+		tegra_dc_vblank_put(ext->dc);
+	}
+
+	mutex_unlock(&q->lock);
+}
+
+void tegra_dc_ext_vblank(struct tegra_dc_ext *ext)
+{
+	if (ext->enabled)
+		tegra_dc_ext_flip_advance(ext);
+}
+
+/* completes every queued flip, whether or not it reached the screen */
+static void tegra_dc_ext_flip_drain(struct tegra_dc_ext *ext)
+{
+	struct tegra_dc_ext_flip_queue *q = &ext->flip;
+	struct tegra_dc_ext_flip_data *data, *tmp;
+
+	/* the irq thread sees ext->enabled clear from here on */
+	synchronize_irq(ext->dc->irq);
+
+	mutex_lock(&q->lock);
+
+	if (q->programmed) {
+		tegra_dc_ext_flip_complete(q->programmed, ktime_get());
+		q->programmed = NULL;
+	}
+
+	list_for_each_entry_safe(data, tmp, &q->pending, list) {
+		int i;
+
+		list_del(&data->list);
+
+		/* never shown: drop its own buffers instead */
+		for (i = 0; i < DC_N_WINDOWS; i++) {
+			if (!data->win[i].handle)
+				continue;
+
+			data->unpin_handles[data->nr_unpin++] =
+				data->win[i].handle;
+		}
+		tegra_dc_ext_flip_complete(data, ktime_get());
+	}
+
+	if (q->vblank) {
+		q->vblank = false;
+		tegra_dc_vblank_put(ext->dc);
+	}
+
+	mutex_unlock(&q->lock);
+}
+
+/* blocks while TEGRA_DC_EXT_FLIP_QUEUE_DEPTH flips are waiting to latch */
+static int tegra_dc_ext_flip_reserve(struct tegra_dc_ext *ext)
+{
+	struct tegra_dc_ext_flip_queue *q = &ext->flip;
+	int ret;
+
+	for (;;) {
+		mutex_lock(&q->lock);
+		if (q->depth < TEGRA_DC_EXT_FLIP_QUEUE_DEPTH) {
+			q->depth++;
+			mutex_unlock(&q->lock);
+			return 0;
+		}
+		mutex_unlock(&q->lock);
+
+		ret = wait_event_interruptible(q->wq,
+				q->depth < TEGRA_DC_EXT_FLIP_QUEUE_DEPTH);
+		if (ret)
+			return ret;
+	}
+}
+
+static void tegra_dc_ext_flip_unreserve(struct tegra_dc_ext *ext)
+{
+	mutex_lock(&ext->flip.lock);
+	ext->flip.depth--;
+	mutex_unlock(&ext->flip.lock);
+	wake_up(&ext->flip.wq);
+}
+
 static int lock_windows_for_flip(struct tegra_dc_ext_user *user,
 				 struct tegra_dc_ext_flip *args)
 {
@@ -381,6 +586,10 @@ static int sanitize_flip_args(struct tegra_dc_ext_user *user,
 		if (used_windows & BIT(index))
 			return -EINVAL;
 
+		if ((s32)args->win[i].pre_syncpt_id >= 0 &&
+		    args->win[i].pre_syncpt_id >= NV_HOST1X_SYNCPT_NB_PTS)
+			return -EINVAL;
+
 		used_windows |= BIT(index);
 	}
 
@@ -390,12 +599,12 @@ static int sanitize_flip_args(struct tegra_dc_ext_user *user,
 	return 0;
 }
 
-static int tegra_dc_ext_flip(struct tegra_dc_ext_user *user,
-			     struct tegra_dc_ext_flip *args)
+/* validates a flip and pins its buffers, before any window is locked */
+static int tegra_dc_ext_flip_prepare(struct tegra_dc_ext_user *user,
+				     struct tegra_dc_ext_flip *args,
+				     struct tegra_dc_ext_flip_data **data_out)
 {
-	struct tegra_dc_ext *ext = user->ext;
 	struct tegra_dc_ext_flip_data *data;
-	int work_index;
 	int i, ret = 0;
 
 	if (!user->nvmap)
@@ -409,8 +618,7 @@ static int tegra_dc_ext_flip(struct tegra_dc_ext_user *user,
 	if (!data)
 		return -ENOMEM;
 
-	INIT_WORK(&data->work, tegra_dc_ext_flip_worker);
-	data->ext = ext;
+	data->ext = user->ext;
 
 	for (i = 0; i < DC_N_WINDOWS; i++) {
 		struct tegra_dc_ext_flip_win *flip_win = &data->win[i];
@@ -426,16 +634,59 @@ static int tegra_dc_ext_flip(struct tegra_dc_ext_user *user,
 					      &flip_win->phys_addr);
 		if (ret)
 			goto fail_pin;
+
+		if ((s32)flip_win->attr.pre_syncpt_id >= 0) {
+			data->pre[data->nr_pre].id =
+				flip_win->attr.pre_syncpt_id;
+			data->pre[data->nr_pre].val =
+				flip_win->attr.pre_syncpt_val;
+			data->nr_pre++;
+		}
 	}
 
-	ret = lock_windows_for_flip(user, args);
-	if (ret)
-		goto fail_pin;
+	*data_out = data;
 
-	if (!ext->enabled) {
-		ret = -ENXIO;
-		goto unlock;
+	return 0;
+
+fail_pin:
+	while (i--) {
+		if (!data->win[i].handle)
+			continue;
+
+		nvmap_unpin(user->ext->nvmap, data->win[i].handle);
+		nvmap_free(user->ext->nvmap, data->win[i].handle);
 	}
+	kfree(data);
+
+	return ret;
+}
+
+/* undoes tegra_dc_ext_flip_prepare() for a flip that was never queued */
+static void tegra_dc_ext_flip_release(struct tegra_dc_ext_flip_data *data)
+{
+	struct tegra_dc_ext *ext = data->ext;
+	int i;
+
+	for (i = 0; i < DC_N_WINDOWS; i++) {
+		if (!data->win[i].handle)
+			continue;
+
+		nvmap_unpin(ext->nvmap, data->win[i].handle);
+		nvmap_free(ext->nvmap, data->win[i].handle);
+	}
+	kfree(data);
+}
+
+/*
+ * Assigns the post syncpoints of a prepared flip and queues it.  Called
+ * with the flip's windows locked and the head enabled, so that a disable
+ * drains it.
+ */
+static void tegra_dc_ext_flip_enqueue(struct tegra_dc_ext_flip_data *data,
+				      struct tegra_dc_ext_flip *args)
+{
+	struct tegra_dc_ext *ext = data->ext;
+	int i;
 
 	for (i = 0; i < DC_N_WINDOWS; i++) {
 		u32 syncpt_max;
@@ -454,26 +705,204 @@ static int tegra_dc_ext_flip(struct tegra_dc_ext_user *user,
 		 */
 		args->post_syncpt_val = syncpt_max;
 		args->post_syncpt_id = tegra_dc_get_syncpt_id(ext->dc, index);
-		work_index = index;
 	}
-	queue_work(ext->win[work_index].flip_wq, &data->work);
+	data->post_syncpt_id = args->post_syncpt_id;
+	data->post_syncpt_val = args->post_syncpt_val;
+	data->queued = ktime_get();
+	data->deadline = jiffies + msecs_to_jiffies(500);
+
+	mutex_lock(&ext->flip.lock);
+	for (i = 0; i < DC_N_WINDOWS; i++) {
+		if (args->win[i].index >= 0)
+			ext->win[args->win[i].index].flips_queued++;
+	}
+	list_add_tail(&data->list, &ext->flip.pending);
+	if (!ext->flip.vblank) {
+		ext->flip.vblank = true;
+		tegra_dc_vblank_get(ext->dc);
+	}
+	mutex_unlock(&ext->flip.lock);
+}
+
+static int tegra_dc_ext_flip(struct tegra_dc_ext_user *user,
+			     struct tegra_dc_ext_flip *args)
+{
+	struct tegra_dc_ext *ext = user->ext;
+	struct tegra_dc_ext_flip_data *data;
+	int ret;
+
+	ret = tegra_dc_ext_flip_prepare(user, args, &data);
+	if (ret)
+		return ret;
+
+	ret = tegra_dc_ext_flip_reserve(ext);
+	if (ret)
+		goto fail;
+
+	ret = lock_windows_for_flip(user, args);
+	if (ret)
+		goto unreserve;
+
+	if (!ext->enabled) {
+		ret = -ENXIO;
+		goto unlock;
+	}
+
+	tegra_dc_ext_flip_enqueue(data, args);
 
 	unlock_windows_for_flip(user, args);
 
+	tegra_dc_ext_flip_advance(ext);
+
 	return 0;
 
 unlock:
 	unlock_windows_for_flip(user, args);
 
-fail_pin:
-	while (i--) {
-		if (!data->win[i].handle)
+unreserve:
+	tegra_dc_ext_flip_unreserve(ext);
+
+fail:
+	tegra_dc_ext_flip_release(data);
+
+	return ret;
+}
+
+static const struct file_operations tegra_dc_devops;
+
+/*
+ * Flips windows on several heads at once.  Each head is named by a file
+ * descriptor of its device node, whose user must own the windows.  Either
+ * every flip is queued or none is, and no head latches its part until the
+ * pre-syncpoints of all of them have been reached.
+ */
+static int tegra_dc_ext_flip_heads(struct tegra_dc_ext_flip_heads *args)
+{
+	struct file *files[TEGRA_DC_EXT_FLIP_N_HEADS];
+	struct tegra_dc_ext_user *users[TEGRA_DC_EXT_FLIP_N_HEADS];
+	struct tegra_dc_ext_flip *flips[TEGRA_DC_EXT_FLIP_N_HEADS];
+	struct tegra_dc_ext_flip_data *data[TEGRA_DC_EXT_FLIP_N_HEADS];
+	int nr_pre[TEGRA_DC_EXT_FLIP_N_HEADS];
+	int i, j, n = 0, prepared = 0, reserved = 0, locked = 0;
+	int ret = 0;
+
+	/* collect the heads in dc order, so windows are always locked in
+	 * the same order */
+	for (i = 0; i < TEGRA_DC_EXT_FLIP_N_HEADS; i++) {
+		struct file *file;
+
+		if (args->head[i].fd < 0)
 			continue;
 
-		nvmap_unpin(ext->nvmap, data->win[i].handle);
-		nvmap_free(ext->nvmap, data->win[i].handle);
+		file = fget(args->head[i].fd);
+		if (!file) {
+			ret = -EBADF;
+			goto put_files;
+		}
+		if (file->f_op != &tegra_dc_devops) {
+			fput(file);
+			ret = -EINVAL;
+			goto put_files;
+		}
+
+		for (j = n; j > 0; j--) {
+			struct tegra_dc_ext *ext = users[j - 1]->ext;
+			struct tegra_dc_ext_user *user = file->private_data;
+
+			if (ext == user->ext) {
+				fput(file);
+				ret = -EINVAL;
+				goto put_files;
+			}
+			if (ext->dc->ndev->id < user->ext->dc->ndev->id)
+				break;
+
+			files[j] = files[j - 1];
+			users[j] = users[j - 1];
+			flips[j] = flips[j - 1];
+		}
+		files[j] = file;
+		users[j] = file->private_data;
+		flips[j] = &args->head[i].flip;
+		n++;
+	}
+
+	if (!n)
+		return -EINVAL;
+
+	for (prepared = 0; prepared < n; prepared++) {
+		ret = tegra_dc_ext_flip_prepare(users[prepared],
+						flips[prepared],
+						&data[prepared]);
+		if (ret)
+			goto release;
 	}
-	kfree(data);
+
+	/* every part waits for the pre-syncpoints of the whole request */
+	for (i = 0; i < n; i++)
+		nr_pre[i] = data[i]->nr_pre;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			int k;
+
+			if (i == j)
+				continue;
+
+			for (k = 0; k < nr_pre[j]; k++)
+				data[i]->pre[data[i]->nr_pre++] =
+					data[j]->pre[k];
+		}
+	}
+
+	for (reserved = 0; reserved < n; reserved++) {
+		ret = tegra_dc_ext_flip_reserve(users[reserved]->ext);
+		if (ret)
+			goto unreserve;
+	}
+
+	for (locked = 0; locked < n; locked++) {
+		ret = lock_windows_for_flip(users[locked], flips[locked]);
+		if (ret)
+			goto unlock;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!users[i]->ext->enabled) {
+			ret = -ENXIO;
+			goto unlock;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		tegra_dc_ext_flip_enqueue(data[i], flips[i]);
+
+	for (i = n - 1; i >= 0; i--)
+		unlock_windows_for_flip(users[i], flips[i]);
+
+	for (i = 0; i < n; i++)
+		tegra_dc_ext_flip_advance(users[i]->ext);
+
+	for (i = 0; i < n; i++)
+		fput(files[i]);
+
+	return 0;
+
+unlock:
+	while (locked--)
+		unlock_windows_for_flip(users[locked], flips[locked]);
+
+unreserve:
+	while (reserved--)
+		tegra_dc_ext_flip_unreserve(users[reserved]->ext);
+
+release:
+	while (prepared--)
+		tegra_dc_ext_flip_release(data[prepared]);
+
+put_files:
+	while (n--)
+		fput(files[n]);
 
 	return ret;
 }
@@ -522,6 +951,23 @@ static u32 tegra_dc_ext_get_vblank_syncpt(struct tegra_dc_ext_user *user)
 	return dc->vblank_syncpt;
 }
 
+static void tegra_dc_ext_get_flip_log(struct tegra_dc_ext_user *user,
+				      struct tegra_dc_ext_flip_log *log)
+{
+	struct tegra_dc_ext_flip_queue *q = &user->ext->flip;
+	unsigned int i, first;
+
+	memset(log, 0, sizeof(*log));
+
+	mutex_lock(&q->lock);
+	log->count = q->log_count;
+	first = q->log_next + TEGRA_DC_EXT_FLIP_LOG_SIZE - q->log_count;
+	for (i = 0; i < q->log_count; i++)
+		log->frames[i] =
+			q->log[(first + i) % TEGRA_DC_EXT_FLIP_LOG_SIZE];
+	mutex_unlock(&q->lock);
+}
+
 static int tegra_dc_ext_get_status(struct tegra_dc_ext_user *user,
 				   struct tegra_dc_ext_status *status)
 {
@@ -566,6 +1012,22 @@ static long tegra_dc_ioctl(struct file *filp, unsigned int cmd,
 		return ret;
 	}
 
+	case TEGRA_DC_EXT_FLIP_HEADS:
+	{
+		struct tegra_dc_ext_flip_heads args;
+		int ret;
+
+		if (copy_from_user(&args, user_arg, sizeof(args)))
+			return -EFAULT;
+
+		ret = tegra_dc_ext_flip_heads(&args);
+
+		if (copy_to_user(user_arg, &args, sizeof(args)))
+			return -EFAULT;
+
+		return ret;
+	}
+
 	case TEGRA_DC_EXT_GET_CURSOR:
 		return tegra_dc_ext_get_cursor(user);
 	case TEGRA_DC_EXT_PUT_CURSOR:
@@ -609,6 +1071,18 @@ static long tegra_dc_ioctl(struct file *filp, unsigned int cmd,
 		return 0;
 	}
 
+	case TEGRA_DC_EXT_GET_FLIP_LOG:
+	{
+		struct tegra_dc_ext_flip_log args;
+
+		tegra_dc_ext_get_flip_log(user, &args);
+
+		if (copy_to_user(user_arg, &args, sizeof(args)))
+			return -EFAULT;
+
+		return 0;
+	}
+
 	case TEGRA_DC_EXT_GET_STATUS:
 	{
 		struct tegra_dc_ext_status args;
@@ -665,37 +1139,22 @@ static int tegra_dc_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
-static int tegra_dc_ext_setup_windows(struct tegra_dc_ext *ext)
+static void tegra_dc_ext_setup_windows(struct tegra_dc_ext *ext)
 {
-	int i, ret;
+	int i;
 
 	for (i = 0; i < ext->dc->n_windows; i++) {
 		struct tegra_dc_ext_win *win = &ext->win[i];
-		char name[32];
 
 		win->ext = ext;
 		win->idx = i;
 
-		snprintf(name, sizeof(name), "tegradc.%d/%c",
-			 ext->dc->ndev->id, 'a' + i);
-		win->flip_wq = create_singlethread_workqueue(name);
-		if (!win->flip_wq) {
-			ret = -ENOMEM;
-			goto cleanup;
-		}
-
 		mutex_init(&win->lock);
 	}
 
-	return 0;
-
-cleanup:
-	while (i--) {
-		struct tegra_dc_ext_win *win = &ext->win[i];
-		destroy_workqueue(win->flip_wq);
-	}
-
-	return ret;
+	mutex_init(&ext->flip.lock);
+	init_waitqueue_head(&ext->flip.wq);
+	INIT_LIST_HEAD(&ext->flip.pending);
 }
 
 static const struct file_operations tegra_dc_devops = {
@@ -747,9 +1206,7 @@ struct tegra_dc_ext *tegra_dc_ext_register(struct nvhost_device *ndev,
 		goto cleanup_device;
 	}
 
-	ret = tegra_dc_ext_setup_windows(ext);
-	if (ret)
-		goto cleanup_nvmap;
+	tegra_dc_ext_setup_windows(ext);
 
 	mutex_init(&ext->cursor.lock);
 	mutex_init(&ext->enable_change_lock);
@@ -758,9 +1215,6 @@ struct tegra_dc_ext *tegra_dc_ext_register(struct nvhost_device *ndev,
 
 	return ext;
 
-cleanup_nvmap:
-	nvmap_client_put(ext->nvmap);
-
 cleanup_device:
 	device_del(ext->dev);
 
@@ -775,14 +1229,8 @@ cleanup_alloc:
 
 void tegra_dc_ext_unregister(struct tegra_dc_ext *ext)
 {
-	int i;
-
-	for (i = 0; i < ext->dc->n_windows; i++) {
-		struct tegra_dc_ext_win *win = &ext->win[i];
-
-		flush_workqueue(win->flip_wq);
-		destroy_workqueue(win->flip_wq);
-	}
+	/* tegra_dc_ext_disable() has drained the flip queue */
+	WARN_ON(ext->flip.depth);
 
 	nvmap_client_put(ext->nvmap);
 	device_del(ext->dev);
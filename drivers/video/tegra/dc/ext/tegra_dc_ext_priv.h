@@ -23,6 +23,7 @@
 #include <linux/list.h>
 #include <linux/mutex.h>
 #include <linux/poll.h>
+#include <linux/wait.h>
 
 #include <mach/dc.h>
 #include <mach/nvmap.h>
@@ -30,6 +31,7 @@
 #include <video/tegra_dc_ext.h>
 
 struct tegra_dc_ext;
+struct tegra_dc_ext_flip_data;
 
 struct tegra_dc_ext_user {
 	struct tegra_dc_ext	*ext;
@@ -48,7 +50,31 @@ struct tegra_dc_ext_win {
 	struct nvmap_handle_ref	*cur_handle;
 	bool enabled;
 
-	struct workqueue_struct	*flip_wq;
+	/* flips of this window queued and completed so far; protected by
+	 * the flip queue lock */
+	u32			flips_queued;
+	u32			flips_done;
+};
+
+/*
+ * Flips not yet latched by the hardware, at most one of them programmed.
+ * With the frame on screen, this allows triple buffering.
+ */
+#define TEGRA_DC_EXT_FLIP_QUEUE_DEPTH	2
+
+struct tegra_dc_ext_flip_queue {
+	struct mutex			lock;
+	wait_queue_head_t		wq;
+
+	/* waiting for pre-syncpoints or for the programmed flip to latch */
+	struct list_head		pending;
+	struct tegra_dc_ext_flip_data	*programmed;
+	int				depth;
+	bool				vblank;
+
+	struct tegra_dc_ext_flip_latch	log[TEGRA_DC_EXT_FLIP_LOG_SIZE];
+	unsigned int			log_next;
+	unsigned int			log_count;
 };
 
 struct tegra_dc_ext {
@@ -61,6 +87,8 @@ struct tegra_dc_ext {
 
 	struct tegra_dc_ext_win		win[DC_N_WINDOWS];
 
+	struct tegra_dc_ext_flip_queue	flip;
+
 	struct {
 		struct tegra_dc_ext_user	*user;
 		struct nvmap_handle_ref		*cur_handle;
@@ -27,6 +27,12 @@
 #include <linux/slab.h>
 #include <linux/file.h>
 #include <linux/workqueue.h>
+#include <linux/console.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/hardirq.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
 
 #include <asm/atomic.h>
 
@@ -40,6 +46,32 @@
 #include "host/dev.h"
 #include "nvmap/nvmap.h"
 
+/* blits per command buffer ring; each slot holds one blit */
+#define TEGRA_FB_2D_SLOTS	16
+#define TEGRA_FB_2D_SLOT_WORDS	32
+
+/* the fb's blits share the 2D syncpt with userspace submits */
+#define TEGRA_FB_2D_SYNCPT	NVSYNCPT_2D_0
+#define TEGRA_FB_2D_TIMEOUT	msecs_to_jiffies(500)
+#define TEGRA_FB_2D_POLL_US	500000
+
+/* bands a reverse (overlapping, downward) copy may be split into */
+#define TEGRA_FB_2D_MAX_BANDS	64
+
+struct tegra_fb_2d {
+	struct nvhost_channel	*ch;
+	struct nvmap_handle_ref	*cmd_mem;
+	u32			*cmd_virt;
+	u32			cmd_phys;
+	/* syncpt value at which each slot's blit completes */
+	u32			fence[TEGRA_FB_2D_SLOTS];
+	int			next;
+	/* syncpt value at which the most recent blit completes */
+	u32			last;
+	/* cleared if the channel could not be set up or stopped responding */
+	bool			enabled;
+};
+
 struct tegra_fb_info {
 	struct tegra_dc_win	*win;
 	struct nvhost_device	*ndev;
@@ -50,6 +82,11 @@ struct tegra_fb_info {
 
 	int			xres;
 	int			yres;
+
+	/* fbcon drawing through the 2D engine */
+	struct tegra_fb_2d	g2d;
+
+	struct dentry		*debug_file;
 };
 
 /* palette array used by the fbcon */
@@ -259,21 +296,281 @@ static int tegra_fb_pan_display(struct fb_var_screeninfo *var,
 	return 0;
 }
 
+/* 2D (G2) class registers */
+#define G2_TRIGGER		0x09
+#define G2_CONTROLSECOND	0x1e
+#define G2_DSTBA		0x2b
+#define G2_SRCFGC		0x35
+#define G2_DSTSIZE		0x38
+#define G2_DSTPS		0x3a
+#define G2_TILEMODE		0x46
+
+#define G2_CONTROLMAIN_TURBOFILL	(1 << 2)
+#define G2_CONTROLMAIN_FILL		(1 << 6)
+#define G2_CONTROLMAIN_BPP(bpp)		(((bpp) >> 4) << 16)
+
+#define G2_ROP_SRCCOPY		0xcc
+#define G2_ROP_SRCXOR		0x66
+
+/*
+ * The blits below, and the CPU fallbacks that wait for them, are
+ * serialized by the console lock like the rest of the fb drawing ops.
+ */
+
+/* the 2D engine is fed through sleeping nvhost calls */
+static bool tegra_fb_2d_can_sleep(void)
+{
+	return !in_atomic() && !irqs_disabled() && !oops_in_progress;
+}
+
+/*
+ * Returns 0 once the fence has passed, or a timeout error.  A signal does
+ * not end the wait: the CPU must not draw until the blit has landed.
+ */
+static int tegra_fb_2d_wait(struct tegra_fb_info *tegra_fb, u32 fence)
+{
+	struct nvhost_syncpt *sp = &tegra_fb->ndev->host->syncpt;
+	int timeout = TEGRA_FB_2D_POLL_US;
+	int err;
+
+	if (nvhost_syncpt_min_cmp(sp, TEGRA_FB_2D_SYNCPT, fence))
+		return 0;
+
+	if (tegra_fb_2d_can_sleep()) {
+		err = nvhost_syncpt_wait_timeout(sp, TEGRA_FB_2D_SYNCPT, fence,
+						 TEGRA_FB_2D_TIMEOUT);
+		if (!err || err == -EAGAIN)
+			return err;
+		/* interrupted, or no interrupt action: poll instead */
+	}
+
+	/* the channel stays powered until the blit completes */
+	for (;;) {
+		nvhost_syncpt_update_min(sp, TEGRA_FB_2D_SYNCPT);
+		if (nvhost_syncpt_min_cmp(sp, TEGRA_FB_2D_SYNCPT, fence))
+			return 0;
+		if (!timeout--)
+			return -ETIMEDOUT;
+		udelay(1);
+	}
+}
+
+/*
+ * Gives up on the 2D engine for good if it stops completing blits.  Only
+ * called on a timeout from tegra_fb_2d_wait().
+ */
+static void tegra_fb_2d_hang(struct tegra_fb_info *tegra_fb, int err)
+{
+	dev_err(&tegra_fb->ndev->dev,
+		"2D blit timed out (%d), drawing with the CPU\n", err);
+	tegra_fb->g2d.enabled = false;
+	tegra_fb->info->flags &= ~(FBINFO_HWACCEL_COPYAREA |
+				   FBINFO_HWACCEL_FILLRECT);
+}
+
+/* waits for outstanding blits before the CPU touches the framebuffer */
+static int tegra_fb_sync(struct fb_info *info)
+{
+	struct tegra_fb_info *tegra_fb = info->par;
+	int err;
+
+	if (!tegra_fb->g2d.enabled)
+		return 0;
+
+	err = tegra_fb_2d_wait(tegra_fb, tegra_fb->g2d.last);
+	if (err)
+		tegra_fb_2d_hang(tegra_fb, err);
+
+	return 0;
+}
+
+static bool tegra_fb_2d_submit(struct tegra_fb_info *tegra_fb,
+			       const u32 *cmds, int words)
+{
+	struct tegra_fb_2d *g2d = &tegra_fb->g2d;
+	int slot = g2d->next;
+	u32 *virt = g2d->cmd_virt + slot * TEGRA_FB_2D_SLOT_WORDS;
+	u32 phys = g2d->cmd_phys + slot * TEGRA_FB_2D_SLOT_WORDS * 4;
+	int err;
+
+	BUG_ON(words > TEGRA_FB_2D_SLOT_WORDS);
+
+	err = tegra_fb_2d_wait(tegra_fb, g2d->fence[slot]);
+	if (err) {
+		tegra_fb_2d_hang(tegra_fb, err);
+		return false;
+	}
+
+	memcpy(virt, cmds, words * 4);
+	/* commands and earlier CPU drawing must reach memory first */
+	wmb();
+
+	g2d->fence[slot] = nvhost_channel_submit_gather(g2d->ch, phys, words,
+							TEGRA_FB_2D_SYNCPT, 1);
+	g2d->last = g2d->fence[slot];
+	g2d->next = (slot + 1) % TEGRA_FB_2D_SLOTS;
+
+	return true;
+}
+
+static bool tegra_fb_2d_fillrect(struct tegra_fb_info *tegra_fb,
+				 const struct fb_fillrect *rect)
+{
+	struct fb_info *info = tegra_fb->info;
+	u32 cmds[TEGRA_FB_2D_SLOT_WORDS];
+	u32 color = rect->color;
+	int n = 0;
+
+	if (!tegra_fb->g2d.enabled || !tegra_fb_2d_can_sleep())
+		return false;
+	if (!rect->width || !rect->height)
+		return true;
+
+	if (info->fix.visual == FB_VISUAL_TRUECOLOR ||
+	    info->fix.visual == FB_VISUAL_DIRECTCOLOR)
+		color = ((u32 *)info->pseudo_palette)[rect->color];
+
+	cmds[n++] = nvhost_opcode_setclass(NV_GRAPHICS_2D_CLASS_ID, 0, 0);
+	/* trigger, cmdsel */
+	cmds[n++] = nvhost_opcode_mask(G2_TRIGGER, 0x09);
+	cmds[n++] = G2_DSTPS;
+	cmds[n++] = 0;
+	/* controlsecond, controlmain, ropfade */
+	cmds[n++] = nvhost_opcode_mask(G2_CONTROLSECOND, 0x07);
+	cmds[n++] = 0;
+	cmds[n++] = G2_CONTROLMAIN_BPP(info->var.bits_per_pixel) |
+		G2_CONTROLMAIN_FILL | G2_CONTROLMAIN_TURBOFILL;
+	cmds[n++] = rect->rop == ROP_XOR ? G2_ROP_SRCXOR : G2_ROP_SRCCOPY;
+	/* dstba, dstst */
+	cmds[n++] = nvhost_opcode_mask(G2_DSTBA, 0x09);
+	cmds[n++] = info->fix.smem_start;
+	cmds[n++] = info->fix.line_length;
+	cmds[n++] = nvhost_opcode_nonincr(G2_SRCFGC, 1);
+	cmds[n++] = color;
+	cmds[n++] = nvhost_opcode_nonincr(G2_TILEMODE, 1);
+	cmds[n++] = 0x00100000;
+	/* dstsize, dstps */
+	cmds[n++] = nvhost_opcode_mask(G2_DSTSIZE, 0x05);
+	cmds[n++] = rect->height << 16 | rect->width;
+	cmds[n++] = rect->dy << 16 | rect->dx;
+	cmds[n++] = nvhost_opcode_imm(0, 0x100 | TEGRA_FB_2D_SYNCPT);
+
+	return tegra_fb_2d_submit(tegra_fb, cmds, n);
+}
+
+static bool tegra_fb_2d_blit(struct tegra_fb_info *tegra_fb,
+			     u32 dx, u32 dy, u32 sx, u32 sy, u32 w, u32 h)
+{
+	struct fb_info *info = tegra_fb->info;
+	u32 cmds[TEGRA_FB_2D_SLOT_WORDS];
+	int n = 0;
+
+	cmds[n++] = nvhost_opcode_setclass(NV_GRAPHICS_2D_CLASS_ID, 0, 0);
+	/* trigger, cmdsel */
+	cmds[n++] = nvhost_opcode_mask(G2_TRIGGER, 0x09);
+	cmds[n++] = G2_DSTPS;
+	cmds[n++] = 0;
+	/* controlsecond, controlmain, ropfade */
+	cmds[n++] = nvhost_opcode_mask(G2_CONTROLSECOND, 0x07);
+	cmds[n++] = 0;
+	cmds[n++] = G2_CONTROLMAIN_BPP(info->var.bits_per_pixel);
+	cmds[n++] = G2_ROP_SRCCOPY;
+	cmds[n++] = nvhost_opcode_nonincr(G2_TILEMODE, 1);
+	cmds[n++] = 0;
+	/* dstba, dstst, srcba, srcst, dstsize, srcps, dstps */
+	cmds[n++] = nvhost_opcode_mask(G2_DSTBA, 0xe149);
+	cmds[n++] = info->fix.smem_start;
+	cmds[n++] = info->fix.line_length;
+	cmds[n++] = info->fix.smem_start;
+	cmds[n++] = info->fix.line_length;
+	cmds[n++] = h << 16 | w;
+	cmds[n++] = sy << 16 | sx;
+	cmds[n++] = dy << 16 | dx;
+	cmds[n++] = nvhost_opcode_imm(0, 0x100 | TEGRA_FB_2D_SYNCPT);
+
+	return tegra_fb_2d_submit(tegra_fb, cmds, n);
+}
+
+/*
+ * The engine copies in raster order, so a copy down onto rows it has yet
+ * to read is split into bands that do not overlap, bottom band first.  A
+ * copy right within the same rows is left to the CPU.
+ */
+static bool tegra_fb_2d_copyarea(struct tegra_fb_info *tegra_fb,
+				 const struct fb_copyarea *region)
+{
+	u32 dx = region->dx, dy = region->dy;
+	u32 sx = region->sx, sy = region->sy;
+	u32 w = region->width, h = region->height;
+	u32 band, bh, y;
+
+	if (!tegra_fb->g2d.enabled || !tegra_fb_2d_can_sleep())
+		return false;
+	if (!w || !h)
+		return true;
+
+	if (dx >= sx + w || sx >= dx + w || dy >= sy + h || sy >= dy + h ||
+	    dy < sy)
+		return tegra_fb_2d_blit(tegra_fb, dx, dy, sx, sy, w, h);
+
+	if (dy == sy) {
+		if (dx > sx)
+			return false;
+		return tegra_fb_2d_blit(tegra_fb, dx, dy, sx, sy, w, h);
+	}
+
+	band = dy - sy;
+	if (DIV_ROUND_UP(h, band) > TEGRA_FB_2D_MAX_BANDS)
+		return false;
+
+	for (y = h; y > 0; y -= bh) {
+		bh = min(y, band);
+
+		if (!tegra_fb_2d_blit(tegra_fb, dx, dy + y - bh,
+				      sx, sy + y - bh, w, bh)) {
+			/* the bands below are done and their source is gone */
+			struct fb_copyarea rest = *region;
+
+			/* and the bands already queued must land first */
+			tegra_fb_sync(tegra_fb->info);
+			rest.height = y;
+			cfb_copyarea(tegra_fb->info, &rest);
+			break;
+		}
+	}
+
+	return true;
+}
+
 static void tegra_fb_fillrect(struct fb_info *info,
 			      const struct fb_fillrect *rect)
 {
+	struct tegra_fb_info *tegra_fb = info->par;
+
+	if (tegra_fb_2d_fillrect(tegra_fb, rect))
+		return;
+
+	tegra_fb_sync(info);
 	cfb_fillrect(info, rect);
 }
 
 static void tegra_fb_copyarea(struct fb_info *info,
 			      const struct fb_copyarea *region)
 {
+	struct tegra_fb_info *tegra_fb = info->par;
+
+	if (tegra_fb_2d_copyarea(tegra_fb, region))
+		return;
+
+	tegra_fb_sync(info);
 	cfb_copyarea(info, region);
 }
 
+/* glyph expansion stays on the CPU, after any blits it may overlap */
 static void tegra_fb_imageblit(struct fb_info *info,
 			       const struct fb_image *image)
 {
+	tegra_fb_sync(info);
 	cfb_imageblit(info, image);
 }
 
@@ -324,6 +621,7 @@ static struct fb_ops tegra_fb_ops = {
 	.fb_fillrect = tegra_fb_fillrect,
 	.fb_copyarea = tegra_fb_copyarea,
 	.fb_imageblit = tegra_fb_imageblit,
+	.fb_sync = tegra_fb_sync,
 	.fb_ioctl = tegra_fb_ioctl,
 };
 
@@ -395,6 +693,177 @@ void tegra_fb_transition(struct tegra_fb_info *tegra_fb, bool enable)
 }
 EXPORT_SYMBOL(tegra_fb_transition);
 
+static void tegra_fb_2d_init(struct tegra_fb_info *tegra_fb)
+{
+	struct nvhost_master *host = tegra_fb->ndev->host;
+	struct tegra_fb_2d *g2d = &tegra_fb->g2d;
+	u32 val;
+	int i;
+
+	g2d->ch = nvhost_getchannel(&host->channels[NVHOST_CHANNEL_GR2D]);
+	if (!g2d->ch)
+		goto err;
+
+	g2d->cmd_mem = nvmap_alloc(host->nvmap,
+				   TEGRA_FB_2D_SLOTS * TEGRA_FB_2D_SLOT_WORDS * 4,
+				   32, NVMAP_HANDLE_WRITE_COMBINE);
+	if (IS_ERR_OR_NULL(g2d->cmd_mem))
+		goto err_put;
+
+	g2d->cmd_virt = nvmap_mmap(g2d->cmd_mem);
+	if (!g2d->cmd_virt)
+		goto err_free;
+
+	g2d->cmd_phys = nvmap_pin(host->nvmap, g2d->cmd_mem);
+
+	val = nvhost_syncpt_read(&host->syncpt, TEGRA_FB_2D_SYNCPT);
+	for (i = 0; i < TEGRA_FB_2D_SLOTS; i++)
+		g2d->fence[i] = val;
+	g2d->last = val;
+	g2d->next = 0;
+	g2d->enabled = true;
+
+	tegra_fb->info->flags |= FBINFO_HWACCEL_COPYAREA |
+		FBINFO_HWACCEL_FILLRECT;
+	return;
+
+err_free:
+	nvmap_free(host->nvmap, g2d->cmd_mem);
+err_put:
+	nvhost_putchannel(g2d->ch, NULL);
+	g2d->ch = NULL;
+err:
+	dev_warn(&tegra_fb->ndev->dev, "no 2D channel, drawing with the CPU\n");
+}
+
+static void tegra_fb_2d_deinit(struct tegra_fb_info *tegra_fb)
+{
+	struct nvmap_client *nvmap = tegra_fb->ndev->host->nvmap;
+	struct tegra_fb_2d *g2d = &tegra_fb->g2d;
+
+	if (!g2d->ch)
+		return;
+
+	tegra_fb_sync(tegra_fb->info);
+	g2d->enabled = false;
+
+	nvmap_unpin(nvmap, g2d->cmd_mem);
+	nvmap_munmap(g2d->cmd_mem, g2d->cmd_virt);
+	nvmap_free(nvmap, g2d->cmd_mem);
+	nvhost_putchannel(g2d->ch, NULL);
+	g2d->ch = NULL;
+}
+
+#ifdef CONFIG_DEBUG_FS
+#define TEGRA_FB_BENCH_SCROLLS	100
+#define TEGRA_FB_BENCH_LINE	16
+
+/* scrolls the screen up by one text line, the way fbcon does */
+static void tegra_fb_bench_scroll(struct fb_info *info, bool accel)
+{
+	struct fb_copyarea region = {
+		.sx = 0,
+		.sy = TEGRA_FB_BENCH_LINE,
+		.dx = 0,
+		.dy = 0,
+		.width = info->var.xres,
+		.height = info->var.yres - TEGRA_FB_BENCH_LINE,
+	};
+	struct fb_fillrect rect = {
+		.dx = 0,
+		.dy = info->var.yres - TEGRA_FB_BENCH_LINE,
+		.width = info->var.xres,
+		.height = TEGRA_FB_BENCH_LINE,
+		.color = 0,
+		.rop = ROP_COPY,
+	};
+
+	if (accel) {
+		tegra_fb_copyarea(info, &region);
+		tegra_fb_fillrect(info, &rect);
+	} else {
+		cfb_copyarea(info, &region);
+		cfb_fillrect(info, &rect);
+	}
+}
+
+static s64 tegra_fb_bench_run(struct fb_info *info, bool accel)
+{
+	ktime_t start = ktime_get();
+	int i;
+
+	for (i = 0; i < TEGRA_FB_BENCH_SCROLLS; i++)
+		tegra_fb_bench_scroll(info, accel);
+	tegra_fb_sync(info);
+
+	return ktime_us_delta(ktime_get(), start);
+}
+
+/*
+ * Times fbcon-style scrolls with the CPU and with the 2D engine.  This
+ * draws over whatever is on the framebuffer.
+ */
+static int dbg_scroll_show(struct seq_file *s, void *unused)
+{
+	struct fb_info *info = s->private;
+	struct tegra_fb_info *tegra_fb = info->par;
+	s64 cpu_us, g2d_us = 0;
+	bool accel;
+
+	if (info->var.yres <= TEGRA_FB_BENCH_LINE || !info->screen_base)
+		return -EINVAL;
+
+	console_lock();
+	cpu_us = tegra_fb_bench_run(info, false);
+	accel = tegra_fb->g2d.enabled;
+	if (accel)
+		g2d_us = tegra_fb_bench_run(info, true);
+	console_unlock();
+
+	seq_printf(s, "%d scrolls of %ux%u at %u bpp\n",
+		   TEGRA_FB_BENCH_SCROLLS, info->var.xres, info->var.yres,
+		   info->var.bits_per_pixel);
+	seq_printf(s, "cpu: %lld us\n", cpu_us);
+	if (accel && tegra_fb->g2d.enabled)
+		seq_printf(s, "2d:  %lld us\n", g2d_us);
+	else
+		seq_printf(s, "2d:  unavailable\n");
+
+	return 0;
+}
+
+static int dbg_scroll_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dbg_scroll_show, inode->i_private);
+}
+
+static const struct file_operations dbg_scroll_fops = {
+	.open		= dbg_scroll_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void tegra_fb_dbg_add(struct tegra_fb_info *tegra_fb)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "tegra_fb%d_scroll",
+		 tegra_fb->info->node);
+	tegra_fb->debug_file = debugfs_create_file(name, S_IRUSR, NULL,
+						   tegra_fb->info,
+						   &dbg_scroll_fops);
+}
+
+static void tegra_fb_dbg_remove(struct tegra_fb_info *tegra_fb)
+{
+	debugfs_remove(tegra_fb->debug_file);
+}
+#else
+static void tegra_fb_dbg_add(struct tegra_fb_info *tegra_fb) {}
+static void tegra_fb_dbg_remove(struct tegra_fb_info *tegra_fb) {}
+#endif
+
 struct tegra_fb_info *tegra_fb_register(struct nvhost_device *ndev,
 					struct tegra_dc *dc,
 					struct tegra_fb_data *fb_data,
@@ -475,14 +944,17 @@ struct tegra_fb_info *tegra_fb_register(struct nvhost_device *ndev,
 	if (fb_mem) {
 		tegra_fb->in_use = true;
 		tegra_fb_set_par(info);
+		tegra_fb_2d_init(tegra_fb);
 	}
 
 	if (register_framebuffer(info)) {
 		dev_err(&ndev->dev, "failed to register framebuffer\n");
 		ret = -ENODEV;
-		goto err_iounmap_fb;
+		goto err_2d_deinit;
 	}
 
+	tegra_fb_dbg_add(tegra_fb);
+
 	dev_info(&ndev->dev, "probed\n");
 
 	if (fb_data->flags & TEGRA_FB_FLIP_ON_PROBE)
@@ -490,7 +962,8 @@ struct tegra_fb_info *tegra_fb_register(struct nvhost_device *ndev,
 
 	return tegra_fb;
 
-err_iounmap_fb:
+err_2d_deinit:
+	tegra_fb_2d_deinit(tegra_fb);
 	if (fb_base)
 		iounmap(fb_base);
 err_free:
@@ -503,7 +976,9 @@ void tegra_fb_unregister(struct tegra_fb_info *fb_info)
 {
 	struct fb_info *info = fb_info->info;
 
+	tegra_fb_dbg_remove(fb_info);
 	unregister_framebuffer(info);
+	tegra_fb_2d_deinit(fb_info);
 
 	iounmap(info->screen_base);
 	framebuffer_release(info);
@@ -155,6 +155,22 @@ static int nvhost_debug_show(struct seq_file *s, void *unused)
 
 	}
 
+	seq_printf(s, "\n---- submits ----\n");
+	for (i = 0; i < NVHOST_NUMCHANNELS; i++) {
+		struct nvhost_channel_stats *st = &m->channels[i].stats;
+
+		seq_printf(s, "%d-%s: submits %lu relocs %lu patched %lu "
+			   "pins %lu, last relocs %u patched %u pins %u, "
+			   "ctx saves %lu restores %lu (delta %lu), "
+			   "skipped saves %lu restores %lu\n",
+			   i, m->channels[i].mod.name, st->submits,
+			   st->relocs, st->relocs_patched, st->pins,
+			   st->last_relocs, st->last_patched, st->last_pins,
+			   st->ctx_saves, st->ctx_restores,
+			   st->ctx_restores_delta, st->ctx_saves_skipped,
+			   st->ctx_restores_skipped);
+	}
+
 	seq_printf(s, "\n---- channels ----\n");
 	for (i = 0; i < NVHOST_NUMCHANNELS; i++) {
 		void __iomem *regs = m->channels[i].aperture;
@@ -282,10 +298,90 @@ static const struct file_operations nvhost_debug_fops = {
 	.release	= single_release,
 };
 
+static void nvhost_debug_show_hist(struct seq_file *s, const char *name,
+				   const u32 *hist, int nr)
+{
+	int i;
+
+	seq_printf(s, "  %-8s", name);
+	for (i = 0; i < nr; i++)
+		seq_printf(s, " %u", hist[i]);
+	seq_printf(s, "\n");
+}
+
+static int nvhost_debug_cdma_show(struct seq_file *s, void *unused)
+{
+	struct nvhost_master *m = s->private;
+	int i;
+
+	seq_printf(s, "fill: push buffer use at kickoff, in eighths\n");
+	seq_printf(s, "wait, latency: log2 buckets of microseconds\n");
+	seq_printf(s, "recording %s\n\n",
+		   nvhost_cdma_stats_enabled ? "enabled" : "disabled");
+
+	for (i = 0; i < NVHOST_NUMCHANNELS; i++) {
+		struct nvhost_cdma *cdma = &m->channels[i].cdma;
+		struct nvhost_cdma_stats *st = &cdma->stats;
+
+		mutex_lock(&cdma->lock);
+		seq_printf(s, "%d-%s:\n", i, m->channels[i].mod.name);
+		nvhost_debug_show_hist(s, "fill", st->fill,
+				       NVHOST_CDMA_FILL_BUCKETS);
+		nvhost_debug_show_hist(s, "wait", st->wait,
+				       NVHOST_CDMA_HIST_BUCKETS);
+		nvhost_debug_show_hist(s, "latency", st->latency,
+				       NVHOST_CDMA_HIST_BUCKETS);
+		seq_printf(s, "  waits: push buffer %u (%llu us), "
+			   "sync queue space %u (%llu us), "
+			   "sync queue empty %u (%llu us)\n",
+			   st->waits[CDMA_EVENT_PUSH_BUFFER_SPACE],
+			   st->wait_us[CDMA_EVENT_PUSH_BUFFER_SPACE],
+			   st->waits[CDMA_EVENT_SYNC_QUEUE_SPACE],
+			   st->wait_us[CDMA_EVENT_SYNC_QUEUE_SPACE],
+			   st->waits[CDMA_EVENT_SYNC_QUEUE_EMPTY],
+			   st->wait_us[CDMA_EVENT_SYNC_QUEUE_EMPTY]);
+		mutex_unlock(&cdma->lock);
+	}
+
+	return 0;
+}
+
+static int nvhost_debug_cdma_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvhost_debug_cdma_show, inode->i_private);
+}
+
+/* any write clears the histograms */
+static ssize_t nvhost_debug_cdma_write(struct file *file,
+				       const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct nvhost_master *m = s->private;
+	int i;
+
+	for (i = 0; i < NVHOST_NUMCHANNELS; i++)
+		nvhost_cdma_stats_reset(&m->channels[i].cdma);
+
+	return count;
+}
+
+static const struct file_operations nvhost_debug_cdma_fops = {
+	.open		= nvhost_debug_cdma_open,
+	.read		= seq_read,
+	.write		= nvhost_debug_cdma_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 void nvhost_debug_init(struct nvhost_master *master)
 {
 	debug_master = master;
 	debugfs_create_file("tegra_host", S_IRUGO, NULL, master, &nvhost_debug_fops);
+	debugfs_create_file("tegra_host_cdma", S_IRUGO | S_IWUSR, NULL,
+			    master, &nvhost_debug_cdma_fops);
+	debugfs_create_bool("tegra_host_cdma_stats", S_IRUGO | S_IWUSR, NULL,
+			    &nvhost_cdma_stats_enabled);
 }
 #else
 void nvhost_debug_init(struct nvhost_master *master)
@@ -31,12 +31,16 @@
 #include <linux/uaccess.h>
 #include <linux/file.h>
 #include <linux/clk.h>
+#include <linux/vmalloc.h>
 
 #include <asm/io.h>
 
 #include <mach/nvhost.h>
 #include <mach/nvmap.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/nvhost.h>
+
 #define DRIVER_NAME "tegra_grhost"
 #define IFACE_NAME "nvhost"
 
@@ -53,6 +57,7 @@ struct nvhost_channel_userctx {
 	int pinarray_size;
 	struct nvmap_pinarray_elem pinarray[NVHOST_MAX_HANDLES];
 	struct nvmap_handle *unpinarray[NVHOST_MAX_HANDLES];
+	struct nvmap_reloc_cache *reloc_cache;
 	struct nvmap_client *nvmap;
 };
 
@@ -78,6 +83,7 @@ static int nvhost_channelrelease(struct inode *inode, struct file *filp)
 	if (!IS_ERR_OR_NULL(priv->gather_mem))
 		nvmap_free(priv->ch->dev->nvmap, priv->gather_mem);
 
+	vfree(priv->reloc_cache);
 	nvmap_client_put(priv->nvmap);
 	kfree(priv);
 	return 0;
@@ -208,15 +214,18 @@ static ssize_t nvhost_channelwrite(struct file *filp, const char __user *buf,
 	return (count - remaining);
 }
 
+/* if nonblock is set, fails with -EAGAIN rather than waiting for space in
+ * the channel's push buffer or sync queue */
 static int nvhost_ioctl_channel_flush(struct nvhost_channel_userctx *ctx,
 				      struct nvhost_get_param_args *args,
-				      int null_kickoff)
+				      int null_kickoff, bool nonblock)
 {
 	struct nvhost_cpuinterrupt ctxsw;
 	int gather_idx = 2;
 	int num_intrs = 0;
 	u32 syncval;
 	int num_unpin;
+	int num_patched = 0;
 	int err;
 	int nulled_incrs = null_kickoff ? ctx->submit_hdr.syncpt_incrs : 0;
 
@@ -236,10 +245,11 @@ static int nvhost_ioctl_channel_flush(struct nvhost_channel_userctx *ctx,
 	nvhost_module_busy(&ctx->ch->mod);
 
 	/* pin mem handles and patch physical addresses */
-	num_unpin = nvmap_pin_array(ctx->nvmap,
+	num_unpin = nvmap_pin_array_cached(ctx->nvmap,
 				    nvmap_ref_to_handle(ctx->gather_mem),
 				    ctx->pinarray, ctx->pinarray_size,
-				    ctx->unpinarray);
+				    ctx->unpinarray, ctx->reloc_cache,
+				    &num_patched);
 	if (num_unpin < 0) {
 		dev_warn(&ctx->ch->dev->pdev->dev, "nvmap_pin_array failed: "
 			 "%d\n", num_unpin);
@@ -255,14 +265,54 @@ static int nvhost_ioctl_channel_flush(struct nvhost_channel_userctx *ctx,
 		return err;
 	}
 
-	/* context switch */
-	if (ctx->ch->cur_ctx != ctx->hwctx) {
+	/* a context switch adds at most the two reserved gathers, and a null
+	 * kickoff replaces the user's gathers with syncpt increments */
+	if (nonblock) {
+		int slots = ctx->num_gathers;
+
+		if (null_kickoff)
+			slots = 2 + (nulled_incrs + 1) / 2 + 1;
+
+		if (!nvhost_cdma_has_space(&ctx->ch->cdma, slots, num_unpin)) {
+			mutex_unlock(&ctx->ch->submitlock);
+			nvmap_unpin_handles(ctx->nvmap, ctx->unpinarray,
+					    num_unpin);
+			nvhost_module_idle(&ctx->ch->mod);
+			return -EAGAIN;
+		}
+	}
+
+	ctx->ch->stats.submits++;
+	ctx->ch->stats.relocs += ctx->pinarray_size;
+	ctx->ch->stats.relocs_patched += num_patched;
+	ctx->ch->stats.pins += num_unpin;
+	ctx->ch->stats.last_relocs = ctx->pinarray_size;
+	ctx->ch->stats.last_patched = num_patched;
+	ctx->ch->stats.last_pins = num_unpin;
+
+	/* context switch; a null kickoff touches no 3D state, so the current
+	 * context is left in place rather than saved and later restored */
+	if (ctx->ch->cur_ctx != ctx->hwctx && null_kickoff) {
+		if (ctx->ch->cur_ctx)
+			ctx->ch->stats.ctx_saves_skipped++;
+	} else if (ctx->ch->cur_ctx != ctx->hwctx) {
 		struct nvhost_hwctx *hw = ctx->hwctx;
-		if (hw && hw->valid) {
+		if (hw && hw->valid && ctx->ch->hw_ctx == hw) {
+			/* still in the hardware since it was saved */
+			ctx->ch->stats.ctx_restores_skipped++;
+		} else if (hw && hw->valid) {
+			u32 phys = hw->restore_phys;
+			u32 size = hw->restore_size;
+
+			if (ctx->ch->hw_ctx && ctx->ch->ctxhandler.restore_delta &&
+			    ctx->ch->ctxhandler.restore_delta(hw,
+						ctx->ch->hw_ctx, &phys, &size))
+				ctx->ch->stats.ctx_restores_delta++;
+			ctx->ch->stats.ctx_restores++;
 			gather_idx--;
 			ctx->gathers[gather_idx].op1 =
-				nvhost_opcode_gather(0, hw->restore_size);
-			ctx->gathers[gather_idx].op2 = hw->restore_phys;
+				nvhost_opcode_gather(0, size);
+			ctx->gathers[gather_idx].op2 = phys;
 			ctx->submit_hdr.syncpt_incrs += hw->restore_incrs;
 		}
 		hw = ctx->ch->cur_ctx;
@@ -272,13 +322,17 @@ static int nvhost_ioctl_channel_flush(struct nvhost_channel_userctx *ctx,
 				nvhost_opcode_gather(0, hw->save_size);
 			ctx->gathers[gather_idx].op2 = hw->save_phys;
 			ctx->submit_hdr.syncpt_incrs += hw->save_incrs;
+			ctx->ch->stats.ctx_saves++;
 			num_intrs = 1;
 			ctxsw.syncpt_val = hw->save_incrs - 1;
 			ctxsw.intr_data = hw;
 			hw->valid = true;
 			ctx->ch->ctxhandler.get(hw);
 		}
+		trace_nvhost_channel_ctxsw(ctx->ch->mod.name, num_intrs != 0,
+					   gather_idx + num_intrs < 2);
 		ctx->ch->cur_ctx = ctx->hwctx;
+		ctx->ch->hw_ctx = NULL;
 	}
 
 	/* add a setclass for modules that require it */
@@ -319,11 +373,138 @@ static int nvhost_ioctl_channel_flush(struct nvhost_channel_userctx *ctx,
 	return 0;
 }
 
+/* number of cmdbufs copied from userspace at a time by a batched submit */
+#define SUBMIT_CMDBUF_CHUNK	16
+
+static int nvhost_ioctl_channel_submit_one(struct nvhost_channel_userctx *ctx,
+					   struct nvhost_submit_desc *desc,
+					   bool nonblock)
+{
+	struct nvhost_cmdbuf cmdbufs[SUBMIT_CMDBUF_CHUNK];
+	const struct nvhost_cmdbuf __user *ucmdbufs;
+	struct nvhost_get_param_args args;
+	u32 done;
+	int err;
+
+	if (!desc->num_cmdbufs ||
+	    desc->num_cmdbufs > NVHOST_MAX_GATHERS - 2 ||
+	    desc->num_relocs > NVHOST_MAX_HANDLES - desc->num_cmdbufs ||
+	    desc->syncpt_id >= NV_HOST1X_SYNCPT_NB_PTS)
+		return -EINVAL;
+
+	reset_submit(ctx);
+	ctx->submit_hdr.syncpt_id = desc->syncpt_id;
+	ctx->submit_hdr.syncpt_incrs = desc->syncpt_incrs;
+	ctx->num_gathers = 2;
+	ctx->pinarray_size = 0;
+
+	ucmdbufs = (const struct nvhost_cmdbuf __user *)desc->cmdbufs;
+	for (done = 0; done < desc->num_cmdbufs; ) {
+		u32 i, n = min_t(u32, desc->num_cmdbufs - done,
+				 SUBMIT_CMDBUF_CHUNK);
+
+		if (copy_from_user(cmdbufs, ucmdbufs + done,
+				   n * sizeof(cmdbufs[0]))) {
+			err = -EFAULT;
+			goto fail;
+		}
+
+		for (i = 0; i < n; i++)
+			add_gather(ctx, ctx->num_gathers++, cmdbufs[i].mem,
+				   cmdbufs[i].words, cmdbufs[i].offset);
+		done += n;
+	}
+
+	/* struct nvhost_reloc matches struct nvmap_pinarray_elem */
+	if (copy_from_user(&ctx->pinarray[ctx->pinarray_size],
+			   (const void __user *)desc->relocs,
+			   desc->num_relocs * sizeof(struct nvhost_reloc))) {
+		err = -EFAULT;
+		goto fail;
+	}
+	ctx->pinarray_size += desc->num_relocs;
+
+	nonblock |= !!(desc->flags & NVHOST_SUBMIT_NONBLOCK);
+	err = nvhost_ioctl_channel_flush(ctx, &args,
+			!!(desc->flags & NVHOST_SUBMIT_NULL_KICKOFF), nonblock);
+	if (!err)
+		desc->fence = args.value;
+
+fail:
+	/* leave nothing behind for a later FLUSH to submit again */
+	ctx->num_gathers = 2;
+	return err;
+}
+
+static int nvhost_ioctl_channel_submit(struct nvhost_channel_userctx *ctx,
+				       struct nvhost_submit_args *args,
+				       bool nonblock)
+{
+	struct nvhost_submit_desc __user *udesc;
+	struct nvhost_submit_desc desc;
+	int err = 0;
+
+	udesc = (struct nvhost_submit_desc __user *)args->submits;
+	args->num_done = 0;
+
+	if (ctx->submit_hdr.num_relocs || ctx->submit_hdr.num_cmdbufs) {
+		dev_err(&ctx->ch->dev->pdev->dev,
+			"channel submit while write() is in progress\n");
+		return -EBUSY;
+	}
+
+	while (args->num_done < args->num_submits) {
+		if (copy_from_user(&desc, udesc, sizeof(desc))) {
+			err = -EFAULT;
+			break;
+		}
+
+		err = nvhost_ioctl_channel_submit_one(ctx, &desc, nonblock);
+		if (err)
+			break;
+
+		if (put_user(desc.fence, &udesc->fence)) {
+			err = -EFAULT;
+			break;
+		}
+
+		args->num_done++;
+		udesc++;
+	}
+
+	/* report partial progress through num_done rather than an error */
+	if (err && args->num_done)
+		err = 0;
+
+	return err;
+}
+
+static int nvhost_ioctl_channel_set_reloc_cache(
+	struct nvhost_channel_userctx *ctx,
+	struct nvhost_get_param_args *args)
+{
+	struct nvmap_reloc_cache *cache = NULL;
+
+	if (args->value > 1)
+		return -EINVAL;
+
+	if (args->value) {
+		cache = vzalloc(sizeof(*cache) * NVHOST_MAX_HANDLES);
+		if (!cache)
+			return -ENOMEM;
+	}
+
+	vfree(ctx->reloc_cache);
+	ctx->reloc_cache = cache;
+	return 0;
+}
+
 static long nvhost_channelctl(struct file *filp,
 	unsigned int cmd, unsigned long arg)
 {
 	struct nvhost_channel_userctx *priv = filp->private_data;
 	u8 buf[NVHOST_IOCTL_CHANNEL_MAX_ARG_SIZE];
+	bool nonblock = !!(filp->f_flags & O_NONBLOCK);
 	int err = 0;
 
 	if ((_IOC_TYPE(cmd) != NVHOST_IOCTL_MAGIC) ||
@@ -340,10 +521,12 @@ static long nvhost_channelctl(struct file *filp,
 
 	switch (cmd) {
 	case NVHOST_IOCTL_CHANNEL_FLUSH:
-		err = nvhost_ioctl_channel_flush(priv, (void *)buf, 0);
+		err = nvhost_ioctl_channel_flush(priv, (void *)buf, 0,
+						 nonblock);
 		break;
 	case NVHOST_IOCTL_CHANNEL_NULL_KICKOFF:
-		err = nvhost_ioctl_channel_flush(priv, (void *)buf, 1);
+		err = nvhost_ioctl_channel_flush(priv, (void *)buf, 1,
+						 nonblock);
 		break;
 	case NVHOST_IOCTL_CHANNEL_GET_SYNCPOINTS:
 		((struct nvhost_get_param_args *)buf)->value =
@@ -373,6 +556,12 @@ static long nvhost_channelctl(struct file *filp,
 		priv->nvmap = new_client;
 		break;
 	}
+	case NVHOST_IOCTL_CHANNEL_SUBMIT:
+		err = nvhost_ioctl_channel_submit(priv, (void *)buf, nonblock);
+		break;
+	case NVHOST_IOCTL_CHANNEL_SET_RELOC_CACHE:
+		err = nvhost_ioctl_channel_set_reloc_cache(priv, (void *)buf);
+		break;
 	default:
 		err = -ENOTTY;
 		break;
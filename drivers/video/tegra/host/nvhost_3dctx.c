@@ -25,6 +25,8 @@
 
 #include <linux/slab.h>
 
+#include <trace/events/nvhost.h>
+
 const struct hwctx_reginfo ctxsave_regs_3d[] = {
 	HWCTX_REGINFO(0xe00, 16, DIRECT),
 	HWCTX_REGINFO(0xe10, 16, DIRECT),
@@ -256,6 +258,115 @@ static void setup_restore(u32 *ptr, u32 waitbase)
 	wmb();
 }
 
+/*** delta restore ***/
+
+/*
+ * Restore sequence for only the registers that differ from the state the
+ * idle hardware was last saved with.  One buffer is enough: it is only
+ * built when the channel has no current context, and the channel is idle
+ * again before that can next happen.
+ */
+static struct nvmap_handle_ref *context_delta_buf = NULL;
+static u32 context_delta_phys = 0;
+static u32 *context_delta_ptr = NULL;
+
+/* beyond this many words, a full restore is used instead */
+#define DELTA_RESTORE_MAX (context_restore_size / 2)
+
+static u32 *restore_delta_range(u32 *ptr, u32 *end,
+				const u32 *to, const u32 *from, u32 count,
+				u32 data_reg, u32 offset_reg, u32 offset)
+{
+	u32 i = 0;
+
+	while (i < count) {
+		u32 run = 1;
+
+		if (to[i] == from[i]) {
+			i++;
+			continue;
+		}
+		while (i + run < count && to[i + run] != from[i + run])
+			run++;
+
+		if (ptr + RESTORE_INDOFFSET_SIZE + RESTORE_INDDATA_SIZE + run
+		    > end)
+			return NULL;
+
+		if (offset_reg) {
+			restore_indoffset(ptr, offset_reg, offset + i);
+			ptr += RESTORE_INDOFFSET_SIZE;
+			restore_inddata(ptr, data_reg, run);
+			ptr += RESTORE_INDDATA_SIZE;
+		} else {
+			restore_direct(ptr, data_reg + i, run);
+			ptr += RESTORE_DIRECT_SIZE;
+		}
+		memcpy(ptr, to + i, run * sizeof(u32));
+		ptr += run;
+		i += run;
+	}
+	return ptr;
+}
+
+static bool setup_restore_delta(u32 *ptr, const u32 *to, const u32 *from,
+				unsigned int *words)
+{
+	const struct hwctx_reginfo *r;
+	const struct hwctx_reginfo *rend;
+	u32 *start = ptr;
+	u32 *end = ptr + DELTA_RESTORE_MAX - RESTORE_END_SIZE;
+	u32 offset_reg = 0;
+	u32 offset = 0;
+
+	restore_begin(ptr, NVWAITBASE_3D);
+	ptr += RESTORE_BEGIN_SIZE;
+	to += RESTORE_BEGIN_SIZE;
+	from += RESTORE_BEGIN_SIZE;
+
+	r = ctxsave_regs_3d;
+	rend = ctxsave_regs_3d + ARRAY_SIZE(ctxsave_regs_3d);
+	for ( ; r != rend; ++r) {
+		u32 count = r->count;
+		switch (r->type) {
+		case HWCTX_REGINFO_DIRECT:
+			to += RESTORE_DIRECT_SIZE;
+			from += RESTORE_DIRECT_SIZE;
+			ptr = restore_delta_range(ptr, end, to, from, count,
+						  r->offset, 0, 0);
+			break;
+		case HWCTX_REGINFO_INDIRECT:
+			to += RESTORE_INDOFFSET_SIZE + RESTORE_INDDATA_SIZE;
+			from += RESTORE_INDOFFSET_SIZE + RESTORE_INDDATA_SIZE;
+			ptr = restore_delta_range(ptr, end, to, from, count,
+						  r->offset + 1, r->offset, 0);
+			break;
+		case HWCTX_REGINFO_INDIRECT_OFFSET:
+			to += RESTORE_INDOFFSET_SIZE;
+			from += RESTORE_INDOFFSET_SIZE;
+			offset_reg = r->offset;
+			offset = count;
+			continue; /* INDIRECT_DATA follows with real count */
+		case HWCTX_REGINFO_INDIRECT_DATA:
+			to += RESTORE_INDDATA_SIZE;
+			from += RESTORE_INDDATA_SIZE;
+			ptr = restore_delta_range(ptr, end, to, from, count,
+						  r->offset, offset_reg, offset);
+			break;
+		}
+		if (!ptr)
+			return false;
+		to += count;
+		from += count;
+	}
+
+	restore_end(ptr, NVSYNCPT_3D);
+	ptr += RESTORE_END_SIZE;
+	*words = ptr - start;
+	wmb();
+	return true;
+}
+
 /*** save ***/
 
 /* the same context save command sequence is used for all contexts. */
@@ -468,6 +579,8 @@ static void ctx3d_save_service(struct nvhost_hwctx *ctx)
 
 	BUG_ON(!ctx->save_cpu_data);
 
+	trace_nvhost_ctx_save_service(ctx->channel->mod.name);
+
 	r = ctxsave_regs_3d;
 	rend = ctxsave_regs_3d + ARRAY_SIZE(ctxsave_regs_3d);
 	for ( ; r != rend; ++r) {
@@ -498,8 +611,46 @@ static void ctx3d_save_service(struct nvhost_hwctx *ctx)
 }
 
 
+static bool ctx3d_restore_delta(struct nvhost_hwctx *ctx,
+				struct nvhost_hwctx *hw, u32 *phys, u32 *size)
+{
+	unsigned int words;
+
+	if (!context_delta_ptr)
+		return false;
+
+	if (!setup_restore_delta(context_delta_ptr, ctx->save_cpu_data,
+				 hw->save_cpu_data, &words))
+		return false;
+
+	*phys = context_delta_phys;
+	*size = words;
+	return true;
+}
+
+
 /*** nvhost_3dctx ***/
 
+/* the delta restore is an optimization, so the channel works without it */
+static void __init setup_delta_buf(struct nvmap_client *nvmap)
+{
+	context_delta_buf = nvmap_alloc(nvmap, context_restore_size * 4, 32,
+					NVMAP_HANDLE_WRITE_COMBINE);
+	if (IS_ERR_OR_NULL(context_delta_buf)) {
+		context_delta_buf = NULL;
+		return;
+	}
+
+	context_delta_ptr = nvmap_mmap(context_delta_buf);
+	if (!context_delta_ptr) {
+		nvmap_free(nvmap, context_delta_buf);
+		context_delta_buf = NULL;
+		return;
+	}
+
+	context_delta_phys = nvmap_pin(nvmap, context_delta_buf);
+}
+
 int __init nvhost_3dctx_handler_init(struct nvhost_hwctx_handler *h)
 {
 	struct nvhost_channel *ch;
@@ -528,11 +679,13 @@ int __init nvhost_3dctx_handler_init(struct nvhost_hwctx_handler *h)
 
 	context_save_phys = nvmap_pin(nvmap, context_save_buf);
 	setup_save(context_save_ptr, NULL, NULL, NVSYNCPT_3D, NVWAITBASE_3D);
+	setup_delta_buf(nvmap);
 
 	h->alloc = ctx3d_alloc;
 	h->get = ctx3d_get;
 	h->put = ctx3d_put;
 	h->save_service = ctx3d_save_service;
+	h->restore_delta = ctx3d_restore_delta;
 	return 0;
 }
 
@@ -22,20 +22,40 @@
 
 #include "nvhost_cdma.h"
 #include "dev.h"
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
 #include <asm/cacheflush.h>
 
+#include <trace/events/nvhost.h>
+
 /*
- * TODO:
- *   stats
- *     - for figuring out what to optimize further
- *   resizable push buffer & sync queue
- *     - some channels hardly need any, some channels (3d) could use more
+ * The push buffer and sync queue start small, since some channels hardly
+ * need any. When a submit has to wait for space in either, it is doubled
+ * (up to the limits below) the next time a submit begins on an idle
+ * channel, and both shrink back to their initial sizes once the channel
+ * has been idle for CDMA_SHRINK_DELAY.
  */
 
+/* bytes; rounded down to a power of two */
+static unsigned int push_buffer_max_size = 64 * 1024;
+module_param(push_buffer_max_size, uint, 0644);
+
+/* words */
+static unsigned int sync_queue_max_size = 64 * 1024;
+module_param(sync_queue_max_size, uint, 0644);
+
+#define CDMA_SHRINK_DELAY (5 * HZ)
+
 #define cdma_to_channel(cdma) container_of(cdma, struct nvhost_channel, cdma)
 #define cdma_to_dev(cdma) ((cdma_to_channel(cdma))->dev)
 #define cdma_to_nvmap(cdma) ((cdma_to_dev(cdma))->nvmap)
 #define pb_to_cdma(pb) container_of(pb, struct nvhost_cdma, push_buffer)
+#define cdma_name(cdma) ((cdma_to_channel(cdma))->mod.name)
+
+/* set through debugfs; the tracepoints are independent of it */
+u32 nvhost_cdma_stats_enabled;
 
 /*
  * push_buffer
@@ -48,31 +68,31 @@
 // 8 bytes per slot. (This number does not include the final RESTART.)
 #define PUSH_BUFFER_SIZE (NVHOST_GATHER_QUEUE_SIZE * 8)
 
-static void destroy_push_buffer(struct push_buffer *pb);
+static void destroy_push_buffer(struct nvmap_client *nvmap,
+				struct push_buffer *pb);
 
 /**
  * Reset to empty push buffer
  */
 static void reset_push_buffer(struct push_buffer *pb)
 {
-	pb->fence = PUSH_BUFFER_SIZE - 8;
+	pb->fence = pb->size - 8;
 	pb->cur = 0;
 }
 
 /**
- * Init push buffer resources
+ * Init push buffer resources of pb->size bytes
  */
-static int init_push_buffer(struct push_buffer *pb)
+static int init_push_buffer(struct nvmap_client *nvmap,
+			    struct push_buffer *pb)
 {
-	struct nvhost_cdma *cdma = pb_to_cdma(pb);
-	struct nvmap_client *nvmap = cdma_to_nvmap(cdma);
 	pb->mem = NULL;
 	pb->mapped = NULL;
 	pb->phys = 0;
 	reset_push_buffer(pb);
 
 	/* allocate and map pushbuffer memory */
-	pb->mem = nvmap_alloc(nvmap, PUSH_BUFFER_SIZE + 4, 32,
+	pb->mem = nvmap_alloc(nvmap, pb->size + 4, 32,
 			      NVMAP_HANDLE_WRITE_COMBINE);
 	if (IS_ERR_OR_NULL(pb->mem)) {
 		pb->mem = NULL;
@@ -90,22 +110,21 @@ static int init_push_buffer(struct push_buffer *pb)
 	}
 
 	/* put the restart at the end of pushbuffer memory */
-	*(pb->mapped + (PUSH_BUFFER_SIZE >> 2)) = nvhost_opcode_restart(pb->phys);
+	*(pb->mapped + (pb->size >> 2)) = nvhost_opcode_restart(pb->phys);
 
 	return 0;
 
 fail:
-	destroy_push_buffer(pb);
+	destroy_push_buffer(nvmap, pb);
 	return -ENOMEM;
 }
 
 /**
  * Clean up push buffer resources
  */
-static void destroy_push_buffer(struct push_buffer *pb)
+static void destroy_push_buffer(struct nvmap_client *nvmap,
+				struct push_buffer *pb)
 {
-	struct nvhost_cdma *cdma = pb_to_cdma(pb);
-	struct nvmap_client *nvmap = cdma_to_nvmap(cdma);
 	if (pb->mapped)
 		nvmap_munmap(pb->mem, pb->mapped);
 
@@ -131,7 +150,7 @@ static void push_to_push_buffer(struct push_buffer *pb, u32 op1, u32 op2)
 	BUG_ON(cur == pb->fence);
 	*(p++) = op1;
 	*(p++) = op2;
-	pb->cur = (cur + 8) & (PUSH_BUFFER_SIZE - 1);
+	pb->cur = (cur + 8) & (pb->size - 1);
 	/* printk("push_to_push_buffer: op1=%08x; op2=%08x; cur=%x\n", op1, op2, pb->cur); */
 }
 
@@ -141,7 +160,7 @@ static void push_to_push_buffer(struct push_buffer *pb, u32 op1, u32 op2)
  */
 static void pop_from_push_buffer(struct push_buffer *pb, unsigned int slots)
 {
-	pb->fence = (pb->fence + slots * 8) & (PUSH_BUFFER_SIZE - 1);
+	pb->fence = (pb->fence + slots * 8) & (pb->size - 1);
 }
 
 /**
@@ -149,7 +168,15 @@ static void pop_from_push_buffer(struct push_buffer *pb, unsigned int slots)
  */
 static u32 push_buffer_space(struct push_buffer *pb)
 {
-	return ((pb->fence - pb->cur) & (PUSH_BUFFER_SIZE - 1)) / 8;
+	return ((pb->fence - pb->cur) & (pb->size - 1)) / 8;
+}
+
+/**
+ * Return the number of two word slots in use in the push buffer
+ */
+static u32 push_buffer_used(struct push_buffer *pb)
+{
+	return pb->size / 8 - 1 - push_buffer_space(pb);
 }
 
 static u32 push_buffer_putptr(struct push_buffer *pb)
@@ -165,8 +192,9 @@ static u32 push_buffer_putptr(struct push_buffer *pb)
  *   1: SyncPointValue
  *   2: NumSlots (how many pushbuffer slots to free)
  *   3: NumHandles
- *   4: nvmap client which pinned the handles
- *   5..: NumHandles * nvmemhandle to unpin
+ *   4: Submit timestamp in microseconds, 0 if none
+ *   5: nvmap client which pinned the handles
+ *   6..: NumHandles * nvmemhandle to unpin
  *
  * There's always one word unused, so (accounting for wrap):
  *   - Write == Read => queue empty
@@ -180,7 +208,7 @@ static u32 push_buffer_putptr(struct push_buffer *pb)
  */
 
 /* Number of words needed to store an entry containing one handle */
-#define SYNC_QUEUE_MIN_ENTRY (4 + (2 * sizeof(void *) / sizeof(u32)))
+#define SYNC_QUEUE_MIN_ENTRY (5 + (2 * sizeof(void *) / sizeof(u32)))
 
 /**
  * Reset to empty queue.
@@ -191,6 +219,26 @@ static void reset_sync_queue(struct sync_queue *queue)
 	queue->write = 0;
 }
 
+/**
+ * Allocate an empty queue of size words
+ */
+static int init_sync_queue(struct sync_queue *queue, unsigned int size)
+{
+	queue->buffer = vmalloc(size * sizeof(u32));
+	if (!queue->buffer)
+		return -ENOMEM;
+	queue->size = size;
+	reset_sync_queue(queue);
+	return 0;
+}
+
+static void destroy_sync_queue(struct sync_queue *queue)
+{
+	vfree(queue->buffer);
+	queue->buffer = NULL;
+	queue->size = 0;
+}
+
 /**
  *  Find the number of handles that can be stashed in the sync queue without
  *  waiting.
@@ -202,8 +250,8 @@ static unsigned int sync_queue_space(struct sync_queue *queue)
 	unsigned int write = queue->write;
 	u32 size;
 
-	BUG_ON(read  > (NVHOST_SYNC_QUEUE_SIZE - SYNC_QUEUE_MIN_ENTRY));
-	BUG_ON(write > (NVHOST_SYNC_QUEUE_SIZE - SYNC_QUEUE_MIN_ENTRY));
+	BUG_ON(read  > (queue->size - SYNC_QUEUE_MIN_ENTRY));
+	BUG_ON(write > (queue->size - SYNC_QUEUE_MIN_ENTRY));
 
 	/*
 	 * We can use all of the space up to the end of the buffer, unless the
@@ -213,7 +261,7 @@ static unsigned int sync_queue_space(struct sync_queue *queue)
 	if (read > write) {
 		size = (read - 1) - write;
 	} else {
-		size = NVHOST_SYNC_QUEUE_SIZE - write;
+		size = queue->size - write;
 
 		/*
 		 * If the read position is zero, it gets complicated. We can't
@@ -245,23 +293,25 @@ static unsigned int sync_queue_space(struct sync_queue *queue)
 
 static void add_to_sync_queue(struct sync_queue *queue,
 			      u32 sync_point_id, u32 sync_point_value,
-			      u32 nr_slots, struct nvmap_client *user_nvmap,
+			      u32 nr_slots, u32 stamp,
+			      struct nvmap_client *user_nvmap,
 			      struct nvmap_handle **handles, u32 nr_handles)
 {
 	u32 write = queue->write;
 	u32 *p = queue->buffer + write;
-	u32 size = 4 + (entry_size(nr_handles));
+	u32 size = 5 + (entry_size(nr_handles));
 
 	BUG_ON(sync_point_id == NVSYNCPT_INVALID);
 	BUG_ON(sync_queue_space(queue) < nr_handles);
 
 	write += size;
-	BUG_ON(write > NVHOST_SYNC_QUEUE_SIZE);
+	BUG_ON(write > queue->size);
 
 	*p++ = sync_point_id;
 	*p++ = sync_point_value;
 	*p++ = nr_slots;
 	*p++ = nr_handles;
+	*p++ = stamp;
 	BUG_ON(!user_nvmap);
 	*(struct nvmap_client **)p = nvmap_client_get(user_nvmap);
 
@@ -271,7 +321,7 @@ static void add_to_sync_queue(struct sync_queue *queue,
 		memcpy(p, handles, nr_handles * sizeof(struct nvmap_handle *));
 
 	/* If there's not enough room for another entry, wrap to the start. */
-	if ((write + SYNC_QUEUE_MIN_ENTRY) > NVHOST_SYNC_QUEUE_SIZE) {
+	if ((write + SYNC_QUEUE_MIN_ENTRY) > queue->size) {
 		/*
 		 * It's an error for the read position to be zero, as that
 		 * would mean we emptied the queue while adding something.
@@ -292,8 +342,8 @@ static u32 *sync_queue_head(struct sync_queue *queue)
 	u32 read = queue->read;
 	u32 write = queue->write;
 
-	BUG_ON(read  > (NVHOST_SYNC_QUEUE_SIZE - SYNC_QUEUE_MIN_ENTRY));
-	BUG_ON(write > (NVHOST_SYNC_QUEUE_SIZE - SYNC_QUEUE_MIN_ENTRY));
+	BUG_ON(read  > (queue->size - SYNC_QUEUE_MIN_ENTRY));
+	BUG_ON(write > (queue->size - SYNC_QUEUE_MIN_ENTRY));
 
 	if (read == write)
 		return NULL;
@@ -311,13 +361,13 @@ dequeue_sync_queue_head(struct sync_queue *queue)
 
 	BUG_ON(read == queue->write);
 
-	size = 4 + entry_size(queue->buffer[read + 3]);
+	size = 5 + entry_size(queue->buffer[read + 3]);
 
 	read += size;
-	BUG_ON(read > NVHOST_SYNC_QUEUE_SIZE);
+	BUG_ON(read > queue->size);
 
 	/* If there's not enough room for another entry, wrap to the start. */
-	if ((read + SYNC_QUEUE_MIN_ENTRY) > NVHOST_SYNC_QUEUE_SIZE)
+	if ((read + SYNC_QUEUE_MIN_ENTRY) > queue->size)
 		read = 0;
 
 	queue->read = read;
@@ -326,6 +376,33 @@ dequeue_sync_queue_head(struct sync_queue *queue)
 
 /*** Cdma internal stuff ***/
 
+static unsigned int hist_bucket(u32 us)
+{
+	return min_t(unsigned int, fls(us), NVHOST_CDMA_HIST_BUCKETS - 1);
+}
+
+static u32 stamp_us(void)
+{
+	return (u32)ktime_to_us(ktime_get()) ?: 1;
+}
+
+/**
+ * Account for time spent blocked in wait_cdma
+ */
+static void cdma_waited(struct nvhost_cdma *cdma, enum cdma_event event,
+			ktime_t start)
+{
+	u32 us = (u32)ktime_us_delta(ktime_get(), start);
+
+	trace_nvhost_cdma_wait(cdma_name(cdma), event, us);
+
+	if (nvhost_cdma_stats_enabled) {
+		cdma->stats.wait[hist_bucket(us)]++;
+		cdma->stats.waits[event]++;
+		cdma->stats.wait_us[event] += us;
+	}
+}
+
 /**
  * Kick channel DMA into action by writing its PUT offset (if it has changed)
  */
@@ -372,10 +449,26 @@ static unsigned int cdma_status(struct nvhost_cdma *cdma, enum cdma_event event)
  */
 static unsigned int wait_cdma(struct nvhost_cdma *cdma, enum cdma_event event)
 {
+	bool waited = false;
+	ktime_t start;
+
 	for (;;) {
 		unsigned int space = cdma_status(cdma, event);
-		if (space)
+		if (space) {
+			if (waited)
+				cdma_waited(cdma, event, start);
 			return space;
+		}
+
+		if (!waited) {
+			start = ktime_get();
+			waited = true;
+		}
+
+		if (event == CDMA_EVENT_PUSH_BUFFER_SPACE)
+			cdma->grow_push_buffer = true;
+		else if (event == CDMA_EVENT_SYNC_QUEUE_SPACE)
+			cdma->grow_sync_queue = true;
 
 		BUG_ON(cdma->event != CDMA_EVENT_NONE);
 		cdma->event = event;
@@ -408,7 +501,7 @@ static void update_cdma(struct nvhost_cdma *cdma)
 	 * to consume as many sync queue entries as possible without blocking
 	 */
 	for (;;) {
-		u32 syncpt_id, syncpt_val;
+		u32 syncpt_id, syncpt_val, stamp;
 		unsigned int nr_slots, nr_handles;
 		struct nvmap_handle **handles;
 		struct nvmap_client *nvmap;
@@ -418,6 +511,10 @@ static void update_cdma(struct nvhost_cdma *cdma)
 		if (!sync) {
 			if (cdma->event == CDMA_EVENT_SYNC_QUEUE_EMPTY)
 				signal = true;
+			if (cdma->push_buffer.size > PUSH_BUFFER_SIZE ||
+			    cdma->sync_queue.size > NVHOST_SYNC_QUEUE_SIZE)
+				schedule_delayed_work(&cdma->shrink,
+						      CDMA_SHRINK_DELAY);
 			break;
 		}
 
@@ -432,12 +529,22 @@ static void update_cdma(struct nvhost_cdma *cdma)
 
 		nr_slots = *sync++;
 		nr_handles = *sync++;
+		stamp = *sync++;
 		nvmap = *(struct nvmap_client **)sync;
 		sync = ((void *)sync + sizeof(struct nvmap_client *));
 		handles = (struct nvmap_handle **)sync;
 
 		BUG_ON(!nvmap);
 
+		if (stamp) {
+			u32 us = stamp_us() - stamp;
+
+			trace_nvhost_cdma_complete(cdma_name(cdma), syncpt_id,
+						   syncpt_val, us);
+			if (nvhost_cdma_stats_enabled)
+				cdma->stats.latency[hist_bucket(us)]++;
+		}
+
 		/* Unpin the memory */
 		nvmap_unpin_handles(nvmap, handles, nr_handles);
 
@@ -462,21 +569,125 @@ static void update_cdma(struct nvhost_cdma *cdma)
 	}
 }
 
+/**
+ * Replace the push buffer and sync queue of an idle cdma with ones of the
+ * given sizes. The old ones are kept if the new ones can't be allocated.
+ * Command DMA is restarted on the new push buffer by the next submit.
+ * Must be called with the cdma lock held and the sync queue empty.
+ */
+static int resize_cdma(struct nvhost_cdma *cdma, u32 pb_size, u32 sq_size)
+{
+	struct nvmap_client *nvmap = cdma_to_nvmap(cdma);
+	struct push_buffer pb = { .size = pb_size };
+	struct sync_queue sq;
+	int err;
+
+	BUG_ON(sync_queue_head(&cdma->sync_queue));
+
+	if (pb_size == cdma->push_buffer.size &&
+	    sq_size == cdma->sync_queue.size)
+		return 0;
+
+	if (pb_size != cdma->push_buffer.size) {
+		err = init_push_buffer(nvmap, &pb);
+		if (err)
+			return err;
+	}
+
+	if (sq_size != cdma->sync_queue.size) {
+		err = init_sync_queue(&sq, sq_size);
+		if (err) {
+			if (pb.mem)
+				destroy_push_buffer(nvmap, &pb);
+			return err;
+		}
+		destroy_sync_queue(&cdma->sync_queue);
+		cdma->sync_queue = sq;
+	}
+
+	if (pb.mem) {
+		destroy_push_buffer(nvmap, &cdma->push_buffer);
+		cdma->push_buffer = pb;
+	}
+
+	/* the sync queue being empty means the channel has fetched and
+	 * executed everything up to its last sync point increment */
+	cdma->running = false;
+	return 0;
+}
+
+/**
+ * Double the buffers which submits have run out of, if the channel is idle
+ * Must be called with the cdma lock held.
+ */
+static void grow_cdma(struct nvhost_cdma *cdma)
+{
+	u32 pb_size = cdma->push_buffer.size;
+	u32 sq_size = cdma->sync_queue.size;
+	u32 pb_max = rounddown_pow_of_two(max_t(u32, push_buffer_max_size,
+						PUSH_BUFFER_SIZE));
+
+	if (sync_queue_head(&cdma->sync_queue))
+		return;
+
+	if (cdma->grow_push_buffer)
+		pb_size = min(pb_size * 2, pb_max);
+	if (cdma->grow_sync_queue)
+		sq_size = min_t(u32, sq_size * 2,
+				max_t(u32, sync_queue_max_size, sq_size));
+
+	cdma->grow_push_buffer = false;
+	cdma->grow_sync_queue = false;
+
+	if (resize_cdma(cdma, pb_size, sq_size))
+		dev_warn(&cdma_to_dev(cdma)->pdev->dev,
+			 "%s: failed to grow to %u/%u\n", cdma_name(cdma),
+			 pb_size, sq_size);
+}
+
+static void shrink_cdma(struct work_struct *work)
+{
+	struct nvhost_cdma *cdma;
+	unsigned long idle;
+
+	cdma = container_of(to_delayed_work(work), struct nvhost_cdma, shrink);
+
+	mutex_lock(&cdma->lock);
+	idle = cdma->last_submit + CDMA_SHRINK_DELAY;
+	if (sync_queue_head(&cdma->sync_queue)) {
+		/* update_cdma will reschedule us once the queue drains */
+	} else if (time_before(jiffies, idle)) {
+		schedule_delayed_work(&cdma->shrink, idle - jiffies);
+	} else {
+		resize_cdma(cdma, PUSH_BUFFER_SIZE, NVHOST_SYNC_QUEUE_SIZE);
+	}
+	mutex_unlock(&cdma->lock);
+}
+
 /**
  * Create a cdma
  */
 int nvhost_cdma_init(struct nvhost_cdma *cdma)
 {
+	struct nvmap_client *nvmap = cdma_to_nvmap(cdma);
 	int err;
 
 	mutex_init(&cdma->lock);
 	sema_init(&cdma->sem, 0);
+	INIT_DELAYED_WORK(&cdma->shrink, shrink_cdma);
 	cdma->event = CDMA_EVENT_NONE;
 	cdma->running = false;
-	err = init_push_buffer(&cdma->push_buffer);
+	cdma->grow_push_buffer = false;
+	cdma->grow_sync_queue = false;
+	cdma->push_buffer.size = PUSH_BUFFER_SIZE;
+	err = init_push_buffer(nvmap, &cdma->push_buffer);
 	if (err)
 		return err;
-	reset_sync_queue(&cdma->sync_queue);
+	err = init_sync_queue(&cdma->sync_queue, NVHOST_SYNC_QUEUE_SIZE);
+	if (err) {
+		destroy_push_buffer(nvmap, &cdma->push_buffer);
+		return err;
+	}
 	return 0;
 }
 
@@ -486,7 +697,9 @@ int nvhost_cdma_init(struct nvhost_cdma *cdma)
 void nvhost_cdma_deinit(struct nvhost_cdma *cdma)
 {
 	BUG_ON(cdma->running);
-	destroy_push_buffer(&cdma->push_buffer);
+	cancel_delayed_work_sync(&cdma->shrink);
+	destroy_push_buffer(cdma_to_nvmap(cdma), &cdma->push_buffer);
+	destroy_sync_queue(&cdma->sync_queue);
 }
 
 static void start_cdma(struct nvhost_cdma *cdma)
@@ -538,6 +751,8 @@ void nvhost_cdma_stop(struct nvhost_cdma *cdma)
 void nvhost_cdma_begin(struct nvhost_cdma *cdma)
 {
 	mutex_lock(&cdma->lock);
+	if (cdma->grow_push_buffer || cdma->grow_sync_queue)
+		grow_cdma(cdma);
 	if (!cdma->running)
 		start_cdma(cdma);
 	cdma->slots_free = 0;
@@ -572,7 +787,17 @@ void nvhost_cdma_end(struct nvmap_client *user_nvmap, struct nvhost_cdma *cdma,
 		     u32 sync_point_id, u32 sync_point_value,
 		     struct nvmap_handle **handles, unsigned int nr_handles)
 {
+	u32 used = push_buffer_used(&cdma->push_buffer);
+	u32 stamp = stamp_us();
+
 	kick_cdma(cdma);
+	cdma->last_submit = jiffies;
+
+	trace_nvhost_cdma_end(cdma_name(cdma), sync_point_id,
+			      sync_point_value, cdma->slots_used, used);
+	if (nvhost_cdma_stats_enabled)
+		cdma->stats.fill[used * NVHOST_CDMA_FILL_BUCKETS /
+				 (cdma->push_buffer.size / 8)]++;
 
 	while (nr_handles || cdma->slots_used) {
 		unsigned int count;
@@ -589,10 +814,11 @@ void nvhost_cdma_end(struct nvmap_client *user_nvmap, struct nvhost_cdma *cdma,
 		if (count > nr_handles)
 			count = nr_handles;
 		add_to_sync_queue(&cdma->sync_queue, sync_point_id,
-				  sync_point_value, cdma->slots_used,
+				  sync_point_value, cdma->slots_used, stamp,
 				  user_nvmap, handles, count);
-		/* NumSlots only goes in the first packet */
+		/* NumSlots and the timestamp only go in the first packet */
 		cdma->slots_used = 0;
+		stamp = 0;
 		handles += count;
 		nr_handles -= count;
 	}
@@ -600,6 +826,37 @@ void nvhost_cdma_end(struct nvmap_client *user_nvmap, struct nvhost_cdma *cdma,
 	mutex_unlock(&cdma->lock);
 }
 
+/**
+ * Check whether a submit of nr_slots push buffer slots and nr_handles handles
+ * to unpin could be made without waiting for space. If not, the buffers
+ * which are short of space are grown at the next opportunity. A submit
+ * which can't fit even into an empty push buffer is reported as fitting,
+ * and will wait for space as it goes.
+ */
+bool nvhost_cdma_has_space(struct nvhost_cdma *cdma,
+			   unsigned int nr_slots, unsigned int nr_handles)
+{
+	struct push_buffer *pb = &cdma->push_buffer;
+	bool fits = true;
+
+	mutex_lock(&cdma->lock);
+	if (cdma->running)
+		update_cdma(cdma);
+
+	if (nr_slots < pb->size / 8 && nr_slots > push_buffer_space(pb)) {
+		cdma->grow_push_buffer = true;
+		fits = false;
+	}
+	if (sync_queue_head(&cdma->sync_queue) &&
+	    sync_queue_space(&cdma->sync_queue) < max(nr_handles, 1U)) {
+		cdma->grow_sync_queue = true;
+		fits = false;
+	}
+	mutex_unlock(&cdma->lock);
+
+	return fits;
+}
+
 /**
  * Update cdma state according to current sync point values
  */
@@ -626,6 +883,16 @@ void nvhost_cdma_flush(struct nvhost_cdma *cdma)
 	mutex_unlock(&cdma->lock);
 }
 
+/**
+ * Clear the histograms of a cdma
+ */
+void nvhost_cdma_stats_reset(struct nvhost_cdma *cdma)
+{
+	mutex_lock(&cdma->lock);
+	memset(&cdma->stats, 0, sizeof(cdma->stats));
+	mutex_unlock(&cdma->lock);
+}
+
 /**
  * Find the currently executing gather in the push buffer and return
  * its physical address and size.
@@ -25,6 +25,7 @@
 
 #include <linux/sched.h>
 #include <linux/semaphore.h>
+#include <linux/workqueue.h>
 
 #include <mach/nvhost.h>
 #include <mach/nvmap.h>
@@ -45,18 +46,22 @@
  *	update - call to update sync queue and push buffer, unpin memory
  */
 
-/* Size of the sync queue. If it is too small, we won't be able to queue up
- * many command buffers. If it is too large, we waste memory. */
+/* Initial size of the sync queue, in words. If it is too small, we won't be
+ * able to queue up many command buffers. If it is too large, we waste
+ * memory. The queue grows while clients have to wait for space in it, and
+ * shrinks back to this size when the channel is idle. */
 #define NVHOST_SYNC_QUEUE_SIZE 8192
 
-/* Number of gathers we allow to be queued up per channel. Must be a
-   power of two. Currently sized such that pushbuffer is 4KB (512*8B). */
+/* Initial number of gathers we allow to be queued up per channel. Must be a
+   power of two. Currently sized such that pushbuffer is 4KB (512*8B). The
+   push buffer grows and shrinks like the sync queue. */
 #define NVHOST_GATHER_QUEUE_SIZE 512
 
 struct push_buffer {
 	struct nvmap_handle_ref *mem; /* handle to pushbuffer memory */
 	u32 *mapped;		/* mapped pushbuffer memory */
 	u32 phys;		/* physical address of pushbuffer */
+	u32 size;		/* bytes, excluding the final RESTART */
 	u32 fence;		/* index we've written */
 	u32 cur;		/* index to write to */
 };
@@ -64,7 +69,8 @@ struct push_buffer {
 struct sync_queue {
 	unsigned int read;		    /* read position within buffer */
 	unsigned int write;		    /* write position within buffer */
-	u32 buffer[NVHOST_SYNC_QUEUE_SIZE]; /* queue data */
+	unsigned int size;		    /* size of buffer in words */
+	u32 *buffer;			    /* queue data */
 };
 
 enum cdma_event {
@@ -74,6 +80,25 @@ enum cdma_event {
 	CDMA_EVENT_PUSH_BUFFER_SPACE	/* wait for space in push buffer */
 };
 
+/* Buckets of the wait time and latency histograms; bucket n counts times of
+ * [2^(n-1), 2^n) microseconds, and the last one everything above that. */
+#define NVHOST_CDMA_HIST_BUCKETS 20
+
+/* Buckets of the push buffer fill histogram, in eighths of its size. */
+#define NVHOST_CDMA_FILL_BUCKETS 8
+
+/* Recorded when nvhost_cdma_stats_enabled is set; protected by the cdma
+ * lock. */
+struct nvhost_cdma_stats {
+	u32 fill[NVHOST_CDMA_FILL_BUCKETS];	/* push buffer use at kickoff */
+	u32 wait[NVHOST_CDMA_HIST_BUCKETS];	/* time blocked in wait_cdma */
+	u32 latency[NVHOST_CDMA_HIST_BUCKETS];	/* submit to completion */
+	u32 waits[CDMA_EVENT_PUSH_BUFFER_SPACE + 1];	/* by event */
+	u64 wait_us[CDMA_EVENT_PUSH_BUFFER_SPACE + 1];	/* by event */
+};
+
+extern u32 nvhost_cdma_stats_enabled;
+
 struct nvhost_cdma {
 	struct mutex lock;		/* controls access to shared state */
 	struct semaphore sem;		/* signalled when event occurs */
@@ -83,6 +108,11 @@ struct nvhost_cdma {
 	unsigned int last_put;		/* last value written to DMAPUT */
 	struct push_buffer push_buffer;	/* channel's push buffer */
 	struct sync_queue sync_queue;	/* channel's sync queue */
+	struct nvhost_cdma_stats stats;	/* see nvhost_cdma_stats_enabled */
+	struct delayed_work shrink;	/* shrinks the buffers when idle */
+	unsigned long last_submit;	/* jiffies at the last submit */
+	bool grow_push_buffer;		/* a submit ran out of pb space */
+	bool grow_sync_queue;		/* a submit ran out of sq space */
 	bool running;
 };
 
@@ -95,8 +125,11 @@ void	nvhost_cdma_end(struct nvmap_client *user_nvmap,
 			struct nvhost_cdma *cdma,
 			u32 sync_point_id, u32 sync_point_value,
 			struct nvmap_handle **handles, unsigned int nr_handles);
+bool	nvhost_cdma_has_space(struct nvhost_cdma *cdma,
+			      unsigned int nr_slots, unsigned int nr_handles);
 void	nvhost_cdma_update(struct nvhost_cdma *cdma);
 void	nvhost_cdma_flush(struct nvhost_cdma *cdma);
+void	nvhost_cdma_stats_reset(struct nvhost_cdma *cdma);
 void    nvhost_cdma_find_gather(struct nvhost_cdma *cdma, u32 dmaget,
                 u32 *addr, u32 *size);
 
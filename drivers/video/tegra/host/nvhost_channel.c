@@ -25,6 +25,7 @@
 #include "nvhost_hwctx.h"
 
 #include <linux/platform_device.h>
+#include <linux/module.h>
 
 #define NVMODMUTEX_2D_FULL   (1)
 #define NVMODMUTEX_2D_SIMPLE (2)
@@ -140,6 +141,7 @@ struct nvhost_channel *nvhost_getchannel(struct nvhost_channel *ch)
 
 	return err ? NULL : ch;
 }
+EXPORT_SYMBOL_GPL(nvhost_getchannel);
 
 void nvhost_putchannel(struct nvhost_channel *ch, struct nvhost_hwctx *ctx)
 {
@@ -147,6 +149,8 @@ void nvhost_putchannel(struct nvhost_channel *ch, struct nvhost_hwctx *ctx)
 		mutex_lock(&ch->submitlock);
 		if (ch->cur_ctx == ctx)
 			ch->cur_ctx = NULL;
+		if (ch->hw_ctx == ctx)
+			ch->hw_ctx = NULL;
 		mutex_unlock(&ch->submitlock);
 	}
 
@@ -160,6 +164,7 @@ void nvhost_putchannel(struct nvhost_channel *ch, struct nvhost_hwctx *ctx)
 	ch->refcount--;
 	mutex_unlock(&ch->reflock);
 }
+EXPORT_SYMBOL_GPL(nvhost_putchannel);
 
 void nvhost_channel_suspend(struct nvhost_channel *ch)
 {
@@ -168,6 +173,12 @@ void nvhost_channel_suspend(struct nvhost_channel *ch)
 	if (ch->refcount)
 		nvhost_cdma_stop(&ch->cdma);
 	mutex_unlock(&ch->reflock);
+
+	/* register state does not survive LP0, so nothing is known to
+	 * be in the hardware after resume */
+	mutex_lock(&ch->submitlock);
+	ch->hw_ctx = NULL;
+	mutex_unlock(&ch->submitlock);
 }
 
 void nvhost_channel_submit(struct nvhost_channel *ch,
@@ -223,6 +234,38 @@ void nvhost_channel_submit(struct nvhost_channel *ch,
                         unpins, num_unpins);
 }
 
+/*
+ * Submits one gather of kernel-owned commands, which must leave the
+ * current hwctx alone and increment syncpt_id syncpt_incrs times.
+ * Returns the syncpoint value at which the commands have completed.
+ */
+u32 nvhost_channel_submit_gather(struct nvhost_channel *ch,
+				 u32 phys, u32 words,
+				 u32 syncpt_id, u32 syncpt_incrs)
+{
+	struct nvhost_op_pair gather;
+	u32 syncval;
+
+	/* keep module powered until the submit completes */
+	nvhost_module_busy(&ch->mod);
+
+	gather.op1 = nvhost_opcode_gather(0, words);
+	gather.op2 = phys;
+
+	mutex_lock(&ch->submitlock);
+	ch->stats.submits++;
+	syncval = nvhost_syncpt_incr_max(&ch->dev->syncpt,
+					 syncpt_id, syncpt_incrs);
+	nvhost_channel_submit(ch, ch->dev->nvmap, &gather, 1, NULL, 0,
+			      NULL, 0, syncpt_id, syncval, 0);
+	nvhost_intr_add_action(&ch->dev->intr, syncpt_id, syncval,
+			NVHOST_INTR_ACTION_SUBMIT_COMPLETE, ch, NULL);
+	mutex_unlock(&ch->submitlock);
+
+	return syncval;
+}
+EXPORT_SYMBOL_GPL(nvhost_channel_submit_gather);
+
 static void power_2d(struct nvhost_module *mod, enum nvhost_power_action action)
 {
 	/* TODO: [ahatala 2010-06-17] reimplement EPP hang war */
@@ -243,6 +286,7 @@ static void power_3d(struct nvhost_module *mod, enum nvhost_power_action action)
 			struct nvhost_cpuinterrupt ctxsw;
 			u32 syncval;
 			void *ref;
+			struct nvhost_hwctx *saved = ch->cur_ctx;
 			syncval = nvhost_syncpt_incr_max(&ch->dev->syncpt,
 							NVSYNCPT_3D,
 							ch->cur_ctx->save_incrs);
@@ -267,7 +311,11 @@ static void power_3d(struct nvhost_module *mod, enum nvhost_power_action action)
 							 NVSYNCPT_3D, syncval));
 			nvhost_intr_put_ref(&ch->dev->intr, ref);
 			nvhost_cdma_update(&ch->cdma);
+			ch->hw_ctx = saved;
 		}
+		/* the 3D state is only kept if the module is not powergated */
+		if (mod->powergate_id != -1)
+			ch->hw_ctx = NULL;
 		mutex_unlock(&ch->submitlock);
 	}
 }
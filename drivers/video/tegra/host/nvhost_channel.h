@@ -35,6 +35,9 @@
 #define NVHOST_MAX_GATHERS 512
 #define NVHOST_MAX_HANDLES 1280
 
+/* index of the 2D channel in nvhost_master.channels */
+#define NVHOST_CHANNEL_GR2D 2
+
 struct nvhost_master;
 
 struct nvhost_channeldesc {
@@ -46,6 +49,22 @@ struct nvhost_channeldesc {
 	u32 class;
 };
 
+/* relocation and pinning work done by submits, protected by submitlock */
+struct nvhost_channel_stats {
+	unsigned long submits;
+	unsigned long relocs;
+	unsigned long relocs_patched;
+	unsigned long pins;
+	unsigned long ctx_saves;
+	unsigned long ctx_restores;
+	unsigned long ctx_restores_delta;
+	unsigned long ctx_saves_skipped;
+	unsigned long ctx_restores_skipped;
+	unsigned int last_relocs;
+	unsigned int last_patched;
+	unsigned int last_pins;
+};
+
 struct nvhost_channel {
 	int refcount;
 	struct mutex reflock;
@@ -54,11 +73,16 @@ struct nvhost_channel {
 	struct nvhost_master *dev;
 	const struct nvhost_channeldesc *desc;
 	struct nvhost_hwctx *cur_ctx;
+	/* with no cur_ctx, the context whose saved state the idle hardware
+	 * still holds, or NULL if that is unknown (e.g. after powergating
+	 * or system suspend) */
+	struct nvhost_hwctx *hw_ctx;
 	struct device *node;
 	struct cdev cdev;
 	struct nvhost_hwctx_handler ctxhandler;
 	struct nvhost_module mod;
 	struct nvhost_cdma cdma;
+	struct nvhost_channel_stats stats;
 };
 
 struct nvhost_op_pair {
@@ -88,6 +112,10 @@ void nvhost_channel_submit(
 	u32 syncpt_val,
 	int num_nulled_incrs);
 
+u32 nvhost_channel_submit_gather(struct nvhost_channel *ch,
+				 u32 phys, u32 words,
+				 u32 syncpt_id, u32 syncpt_incrs);
+
 struct nvhost_channel *nvhost_getchannel(struct nvhost_channel *ch);
 void nvhost_putchannel(struct nvhost_channel *ch, struct nvhost_hwctx *ctx);
 void nvhost_channel_suspend(struct nvhost_channel *ch);
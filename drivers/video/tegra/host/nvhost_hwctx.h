@@ -54,6 +54,8 @@ struct nvhost_hwctx_handler {
 	void (*get) (struct nvhost_hwctx *ctx);
 	void (*put) (struct nvhost_hwctx *ctx);
 	void (*save_service) (struct nvhost_hwctx *ctx);
+	bool (*restore_delta) (struct nvhost_hwctx *ctx,
+			       struct nvhost_hwctx *hw, u32 *phys, u32 *size);
 };
 
 int nvhost_3dctx_handler_init(struct nvhost_hwctx_handler *h);
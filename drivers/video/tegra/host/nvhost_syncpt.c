@@ -119,6 +119,7 @@ u32 nvhost_syncpt_update_min(struct nvhost_syncpt *sp, u32 id)
 
 	return live;
 }
+EXPORT_SYMBOL_GPL(nvhost_syncpt_update_min);
 
 /**
  * Get the current syncpoint value
@@ -367,19 +367,24 @@ static unsigned long handle_phys(struct nvmap_handle *h)
  *     patch[patch_offset] = address_of(pin) + pin_offset;
  * }
  */
+/* patches the relocations in arr. if cache is non-NULL, it holds the
+ * relocation and address last written into each slot of arr; slots whose
+ * relocation and target address are unchanged are skipped, so that command
+ * buffers which are resubmitted without being rewritten need no CPU writes
+ * (and no kernel mapping) at all. returns the number of words patched. */
 static int nvmap_reloc_pin_array(struct nvmap_client *client,
 				 const struct nvmap_pinarray_elem *arr,
-				 int nr, struct nvmap_handle *gather)
+				 int nr, struct nvmap_handle *gather,
+				 struct nvmap_reloc_cache *cache)
 {
 	struct nvmap_handle *last_patch = NULL;
 	unsigned int last_pfn = 0;
-	pte_t **pte;
-	void *addr;
+	pte_t **pte = NULL;
+	void *addr = NULL;
+	int patched = 0;
 	int i;
 
-	pte = nvmap_alloc_pte(client->dev, &addr);
-	if (IS_ERR(pte))
-		return PTR_ERR(pte);
+	nvmap_handle_busy_get(gather);
 
 	for (i = 0; i < nr; i++) {
 		struct nvmap_handle *patch;
@@ -391,23 +396,45 @@ static int nvmap_reloc_pin_array(struct nvmap_client *client,
 		/* all of the handles are validated and get'ted prior to
 		 * calling this function, so casting is safe here */
 		pin = (struct nvmap_handle *)arr[i].pin_mem;
+		reloc_addr = handle_phys(pin) + arr[i].pin_offset;
 
 		if (arr[i].patch_mem == (unsigned long)last_patch) {
 			patch = last_patch;
 		} else if (arr[i].patch_mem == (unsigned long)gather) {
 			patch = gather;
 		} else {
-			if (last_patch)
+			if (last_patch) {
+				nvmap_handle_busy_put(last_patch);
 				nvmap_handle_put(last_patch);
+				last_patch = NULL;
+			}
 
 			patch = nvmap_get_handle_id(client, arr[i].patch_mem);
 			if (!patch) {
-				nvmap_free_pte(client->dev, pte);
-				return -EPERM;
+				patched = -EPERM;
+				break;
 			}
+			nvmap_handle_busy_get(patch);
 			last_patch = patch;
 		}
 
+		/* handle ids are recycled pointers, so the serials tell a
+		 * handle apart from an earlier one at the same address */
+		if (cache && cache[i].addr == reloc_addr &&
+		    cache[i].pin_serial == pin->serial &&
+		    cache[i].patch_serial == patch->serial &&
+		    !memcmp(&cache[i].elem, &arr[i], sizeof(arr[i])))
+			continue;
+
+		if (!pte) {
+			pte = nvmap_alloc_pte(client->dev, &addr);
+			if (IS_ERR(pte)) {
+				patched = PTR_ERR(pte);
+				pte = NULL;
+				break;
+			}
+		}
+
 		if (patch->heap_pgalloc) {
 			unsigned int page = arr[i].patch_offset >> PAGE_SHIFT;
 			phys = page_to_phys(patch->pgalloc.pages[page]);
@@ -425,18 +452,29 @@ static int nvmap_reloc_pin_array(struct nvmap_client *client,
 			last_pfn = pfn;
 		}
 
-		reloc_addr = handle_phys(pin) + arr[i].pin_offset;
 		__raw_writel(reloc_addr, addr + (phys & ~PAGE_MASK));
+		patched++;
+
+		if (cache) {
+			cache[i].elem = arr[i];
+			cache[i].addr = reloc_addr;
+			cache[i].pin_serial = pin->serial;
+			cache[i].patch_serial = patch->serial;
+		}
 	}
 
-	nvmap_free_pte(client->dev, pte);
+	if (pte)
+		nvmap_free_pte(client->dev, pte);
 
-	if (last_patch)
+	nvmap_handle_busy_put(gather);
+	if (last_patch) {
+		nvmap_handle_busy_put(last_patch);
 		nvmap_handle_put(last_patch);
+	}
 
 	wmb();
 
-	return 0;
+	return patched;
 }
 
 static int nvmap_validate_get_pin_array(struct nvmap_client *client,
@@ -526,10 +564,15 @@ static int nvmap_validate_get_pin_array(struct nvmap_client *client,
  * @unique_arr: list of nvmap_handle objects which were pinned by
  *              nvmap_pin_array. must be unpinned by the caller after the
  *              command buffers referenced in gather have completed.
+ * @cache:  optional array of nr entries remembering the relocations last
+ *          written by a previous call; see nvmap_reloc_pin_array.
+ * @patched: if non-NULL, receives the number of words actually patched
  */
-int nvmap_pin_array(struct nvmap_client *client, struct nvmap_handle *gather,
-		    const struct nvmap_pinarray_elem *arr, int nr,
-		    struct nvmap_handle **unique_arr)
+int nvmap_pin_array_cached(struct nvmap_client *client,
+			   struct nvmap_handle *gather,
+			   const struct nvmap_pinarray_elem *arr, int nr,
+			   struct nvmap_handle **unique_arr,
+			   struct nvmap_reloc_cache *cache, int *patched)
 {
 	int count = 0;
 	int ret = 0;
@@ -555,8 +598,14 @@ int nvmap_pin_array(struct nvmap_client *client, struct nvmap_handle *gather,
 
 	mutex_unlock(&client->share->pin_lock);
 
-	if (!ret)
-		ret = nvmap_reloc_pin_array(client, arr, nr, gather);
+	if (!ret) {
+		ret = nvmap_reloc_pin_array(client, arr, nr, gather, cache);
+		if (ret >= 0) {
+			if (patched)
+				*patched = ret;
+			ret = 0;
+		}
+	}
 
 	if (WARN_ON(ret)) {
 		for (i = 0; i < count; i++)
@@ -574,6 +623,14 @@ int nvmap_pin_array(struct nvmap_client *client, struct nvmap_handle *gather,
 	return count;
 }
 
+int nvmap_pin_array(struct nvmap_client *client, struct nvmap_handle *gather,
+		    const struct nvmap_pinarray_elem *arr, int nr,
+		    struct nvmap_handle **unique_arr)
+{
+	return nvmap_pin_array_cached(client, gather, arr, nr, unique_arr,
+				      NULL, NULL);
+}
+
 unsigned long nvmap_pin(struct nvmap_client *client,
 			struct nvmap_handle_ref *ref)
 {
@@ -671,13 +728,16 @@ void *nvmap_mmap(struct nvmap_handle_ref *ref)
 		return vm_map_ram(h->pgalloc.pages, h->size >> PAGE_SHIFT,
 				  -1, prot);
 
-	/* carveout - explicitly map the pfns into a vmalloc area */
+	/* carveout - explicitly map the pfns into a vmalloc area, which
+	 * keeps the handle busy until it is unmapped */
+	nvmap_handle_busy_get(h);
 	adj_size = h->carveout->base & ~PAGE_MASK;
 	adj_size += h->size;
 	adj_size = PAGE_ALIGN(adj_size);
 
 	v = alloc_vm_area(adj_size);
 	if (!v) {
+		nvmap_handle_busy_put(h);
 		nvmap_handle_put(h);
 		return NULL;
 	}
@@ -709,6 +769,7 @@ void *nvmap_mmap(struct nvmap_handle_ref *ref)
 
 	if (offs != adj_size) {
 		free_vm_area(v);
+		nvmap_handle_busy_put(h);
 		nvmap_handle_put(h);
 		return NULL;
 	}
@@ -736,6 +797,7 @@ void nvmap_munmap(struct nvmap_handle_ref *ref, void *addr)
 		addr -= (h->carveout->base & ~PAGE_MASK);
 		vm = remove_vm_area(addr);
 		BUG_ON(!vm);
+		nvmap_handle_busy_put(h);
 	}
 
 	nvmap_handle_put(h);
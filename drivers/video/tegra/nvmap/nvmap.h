@@ -50,7 +50,14 @@
 
 #define nvmap_ref_to_id(_ref)		((unsigned long)(_ref)->handle)
 
+#ifdef CONFIG_NVMAP_HIGHMEM_ONLY
+#define GFP_NVMAP		(__GFP_HIGHMEM | __GFP_NOWARN)
+#else
+#define GFP_NVMAP		(GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
+#endif
+
 struct nvmap_device;
+struct nvmap_page_pool;
 struct page;
 struct tegra_iovmm_area;
 
@@ -60,14 +67,17 @@ struct nvmap_pgalloc {
 	struct page **pages;
 	struct tegra_iovmm_area *area;
 	struct list_head mru_list;	/* MRU entry for IOVMM reclamation */
+	unsigned int reuse;		/* recent re-pins from the MRU lists */
 	bool contig;			/* contiguous system memory */
 	bool dirty;			/* area is invalid and needs mapping */
+	bool evicted;			/* area was reclaimed while unpinned */
 };
 
 struct nvmap_handle {
 	struct rb_node node;	/* entry on global handle tree */
 	atomic_t ref;		/* reference count (i.e., # of duplications) */
 	atomic_t pin;		/* pin count */
+	atomic_t busy;		/* CPU users of the physical address */
 	unsigned long flags;
 	size_t size;		/* padded (as-allocated) size */
 	size_t orig_size;	/* original (as-requested) size */
@@ -81,6 +91,7 @@ struct nvmap_handle {
 	bool secure;		/* zap IOVMM area on unpin */
 	bool heap_pgalloc;	/* handle is page allocated (sysmem / iovmm) */
 	bool alloc;		/* handle has memory allocated */
+	u32 serial;		/* unique among handles ever created */
 	struct mutex lock;
 };
 
@@ -90,8 +101,13 @@ struct nvmap_share {
 	struct mutex pin_lock;
 #ifdef CONFIG_NVMAP_RECLAIM_UNPINNED_VM
 	struct mutex mru_lock;
-	struct list_head *mru_lists;
+	struct list_head *mru_lists;	/* nr_mru cold, then nr_mru hot */
 	int nr_mru;
+	unsigned long mru_hits;		/* pins which found their area */
+	unsigned long mru_refaults;	/* pins of handles evicted earlier */
+	unsigned long mru_evictions;
+	unsigned long mru_evicted_bytes;
+	unsigned long mru_remapped_bytes;
 #endif
 };
 
@@ -157,6 +173,11 @@ void nvmap_carveout_commit_subtract(struct nvmap_client *client,
 
 struct nvmap_share *nvmap_get_share_from_dev(struct nvmap_device *dev);
 
+struct nvmap_page_pool *nvmap_get_pool_from_dev(struct nvmap_device *dev,
+						unsigned long flags);
+
+void nvmap_flush_pages(struct page *page, unsigned int nr);
+
 struct nvmap_handle *nvmap_validate_get(struct nvmap_client *client,
 					unsigned long handle);
 
@@ -198,6 +219,21 @@ static inline void nvmap_handle_put(struct nvmap_handle *h)
 		_nvmap_handle_free(h);
 }
 
+/* carveout blocks which are neither pinned nor busy may be moved by heap
+ * compaction; the handle lock serializes marking a handle busy against the
+ * compactor's check, so once this returns the carveout address is stable */
+static inline void nvmap_handle_busy_get(struct nvmap_handle *h)
+{
+	mutex_lock(&h->lock);
+	atomic_inc(&h->busy);
+	mutex_unlock(&h->lock);
+}
+
+static inline void nvmap_handle_busy_put(struct nvmap_handle *h)
+{
+	atomic_dec(&h->busy);
+}
+
 static inline pgprot_t nvmap_pgprot(struct nvmap_handle *h, pgprot_t prot)
 {
 	if (h->flags == NVMAP_HANDLE_UNCACHEABLE)
@@ -44,6 +44,7 @@
 #include "nvmap.h"
 #include "nvmap_ioctl.h"
 #include "nvmap_mru.h"
+#include "nvmap_pool.h"
 
 #define NVMAP_NUM_PTES		64
 #define NVMAP_CARVEOUT_KILLER_RETRY_TIME 100 /* msecs */
@@ -55,6 +56,12 @@ static bool carveout_killer;
 #endif
 module_param(carveout_killer, bool, 0640);
 
+/* maximum number of blocks moved to make room for a failed carveout
+ * allocation, before the carveout killer is fired; 0 disables compaction
+ * on allocation failure */
+static unsigned int carveout_compact_moves = 16;
+module_param(carveout_compact_moves, uint, 0644);
+
 struct nvmap_carveout_node {
 	unsigned int		heap_bit;
 	struct nvmap_heap	*carveout;
@@ -80,6 +87,7 @@ struct nvmap_device {
 	struct nvmap_share iovmm_master;
 	struct list_head clients;
 	spinlock_t	clients_lock;
+	struct nvmap_page_pool *pools[NVMAP_NUM_POOLS];
 };
 
 struct nvmap_device *nvmap_dev;
@@ -139,6 +147,12 @@ struct nvmap_share *nvmap_get_share_from_dev(struct nvmap_device *dev)
 	return &dev->iovmm_master;
 }
 
+struct nvmap_page_pool *nvmap_get_pool_from_dev(struct nvmap_device *dev,
+						unsigned long flags)
+{
+	return dev->pools[flags & NVMAP_HANDLE_CACHE_FLAG];
+}
+
 /* allocates a PTE for the caller's use; returns the PTE pointer or
  * a negative errno. may be called from IRQs */
 pte_t **nvmap_alloc_pte_irq(struct nvmap_device *dev, void **vaddr)
@@ -286,6 +300,107 @@ static int nvmap_flush_heap_block(struct nvmap_client *client,
 	return 0;
 }
 
+/* copies len bytes from src to dst through cacheable kernel mappings, and
+ * writes dst back to memory. src is written back and dropped from the outer
+ * cache first: lines left there by an earlier copy go stale once the device
+ * writes the block again */
+static int nvmap_copy_heap_block(struct nvmap_device *dev,
+				 struct nvmap_heap_block *dst,
+				 struct nvmap_heap_block *src, size_t len)
+{
+	pte_t **src_pte, **dst_pte;
+	void *src_addr, *dst_addr;
+	size_t offs = 0;
+
+	src_pte = nvmap_alloc_pte(dev, &src_addr);
+	if (IS_ERR(src_pte))
+		return PTR_ERR(src_pte);
+
+	dst_pte = nvmap_alloc_pte(dev, &dst_addr);
+	if (IS_ERR(dst_pte)) {
+		nvmap_free_pte(dev, src_pte);
+		return PTR_ERR(dst_pte);
+	}
+
+	outer_flush_range(src->base, src->base + len);
+
+	while (offs < len) {
+		unsigned long src_phys = src->base + offs;
+		unsigned long dst_phys = dst->base + offs;
+		unsigned long s = (unsigned long)src_addr;
+		unsigned long d = (unsigned long)dst_addr;
+		size_t bytes;
+
+		bytes = min(PAGE_SIZE - (src_phys & ~PAGE_MASK),
+			    PAGE_SIZE - (dst_phys & ~PAGE_MASK));
+		bytes = min(bytes, len - offs);
+
+		set_pte_at(&init_mm, s, *src_pte,
+			   pfn_pte(__phys_to_pfn(src_phys), pgprot_kernel));
+		flush_tlb_kernel_page(s);
+		set_pte_at(&init_mm, d, *dst_pte,
+			   pfn_pte(__phys_to_pfn(dst_phys), pgprot_kernel));
+		flush_tlb_kernel_page(d);
+
+		s += src_phys & ~PAGE_MASK;
+		d += dst_phys & ~PAGE_MASK;
+		__cpuc_flush_dcache_area((void *)s, bytes);
+		memcpy((void *)d, (void *)s, bytes);
+		__cpuc_flush_dcache_area((void *)d, bytes);
+		offs += bytes;
+	}
+
+	outer_flush_range(dst->base, dst->base + len);
+
+	nvmap_free_pte(dev, dst_pte);
+	nvmap_free_pte(dev, src_pte);
+	return 0;
+}
+
+/* called by the heap compactor, with the heap locked, for each block it
+ * would like to move. the block is only moved if nothing can be using its
+ * address: the handle must be unpinned (new pins are held off by the pin
+ * lock, see nvmap_carveout_compact) and not busy, i.e., not mapped into
+ * the kernel or user space and not being accessed by the CPU otherwise. */
+static int nvmap_relocate_block(struct nvmap_heap_block *dst,
+				struct nvmap_heap_block *src, void *arg)
+{
+	struct nvmap_device *dev = arg;
+	struct nvmap_handle *h = src->handle;
+	int err = -EBUSY;
+
+	if (!mutex_trylock(&h->lock))
+		return -EBUSY;
+
+	if (atomic_read(&h->ref) > 0 && !atomic_read(&h->pin) &&
+	    !atomic_read(&h->busy) && h->carveout == src) {
+		err = nvmap_copy_heap_block(dev, dst, src, h->size);
+		if (!err) {
+			dst->handle = h;
+			h->carveout = dst;
+		}
+	}
+
+	mutex_unlock(&h->lock);
+	return err;
+}
+
+/* moves blocks around the carveout until it has a free block of at least
+ * want bytes; returns the number of blocks moved */
+static unsigned int nvmap_carveout_compact(struct nvmap_device *dev,
+					   struct nvmap_carveout_node *node,
+					   size_t want, unsigned int max_moves)
+{
+	unsigned int moved;
+
+	mutex_lock(&dev->iovmm_master.pin_lock);
+	moved = nvmap_heap_compact(node->carveout, want, max_moves,
+				   nvmap_relocate_block, dev);
+	mutex_unlock(&dev->iovmm_master.pin_lock);
+
+	return moved;
+}
+
 void nvmap_carveout_commit_add(struct nvmap_client *client,
 			       struct nvmap_carveout_node *node,
 			       size_t len)
@@ -435,6 +550,34 @@ struct nvmap_heap_block *do_nvmap_carveout_alloc(struct nvmap_client *client,
 	return NULL;
 }
 
+/* compacts each carveout which may satisfy the allocation and retries it */
+static struct nvmap_heap_block *nvmap_carveout_compact_alloc(
+	struct nvmap_client *client, size_t len, size_t align,
+	unsigned long usage, unsigned int prot)
+{
+	struct nvmap_device *dev = client->dev;
+	unsigned int moved = 0;
+	int i;
+
+	if (!carveout_compact_moves)
+		return NULL;
+
+	for (i = 0; i < dev->nr_carveouts; i++) {
+		struct nvmap_carveout_node *co_heap = &dev->heaps[i];
+
+		if (!(co_heap->heap_bit & usage))
+			continue;
+
+		moved += nvmap_carveout_compact(dev, co_heap, len + align - 1,
+						carveout_compact_moves);
+	}
+
+	if (!moved)
+		return NULL;
+
+	return do_nvmap_carveout_alloc(client, len, align, usage, prot);
+}
+
 static bool nvmap_carveout_freed(int count)
 {
 	smp_rmb();
@@ -457,6 +600,9 @@ struct nvmap_heap_block *nvmap_carveout_alloc(struct nvmap_client *client,
 	do {
 		block = do_nvmap_carveout_alloc(client, len, align,
 						usage, prot);
+		if (!block && !count)
+			block = nvmap_carveout_compact_alloc(client, len, align,
+							     usage, prot);
 		if (!carveout_killer)
 			return block;
 
@@ -843,6 +989,14 @@ static long nvmap_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		err = nvmap_ioctl_cache_maint(filp, uarg);
 		break;
 
+	case NVMAP_IOC_CACHE_BENCH:
+		err = nvmap_ioctl_cache_bench(filp, uarg);
+		break;
+
+	case NVMAP_IOC_CACHE_LIST:
+		err = nvmap_ioctl_cache_maint_list(filp, uarg);
+		break;
+
 	default:
 		return -ENOTTY;
 	}
@@ -870,8 +1024,10 @@ static void nvmap_vma_close(struct vm_area_struct *vma)
 	struct nvmap_vma_priv *priv = vma->vm_private_data;
 
 	if (priv && !atomic_dec_return(&priv->count)) {
-		if (priv->handle)
+		if (priv->handle) {
+			nvmap_handle_busy_put(priv->handle);
 			nvmap_handle_put(priv->handle);
+		}
 		kfree(priv);
 	}
 
@@ -921,11 +1077,30 @@ static ssize_t attr_show_usage(struct device *dev,
 	return sprintf(buf, "%08x\n", node->heap_bit);
 }
 
+/* writing n moves up to n blocks to coalesce the carveout's free space */
+static ssize_t attr_store_compact(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct nvmap_carveout_node *node = nvmap_heap_device_to_arg(dev);
+	unsigned long moves;
+
+	if (strict_strtoul(buf, 10, &moves) || !moves || moves > UINT_MAX)
+		return -EINVAL;
+
+	nvmap_carveout_compact(nvmap_dev, node, 0, moves);
+	return count;
+}
+
 static struct device_attribute heap_attr_show_usage =
 	__ATTR(usage, S_IRUGO, attr_show_usage, NULL);
 
+static struct device_attribute heap_attr_compact =
+	__ATTR(compact, S_IWUSR, NULL, attr_store_compact);
+
 static struct attribute *heap_extra_attrs[] = {
 	&heap_attr_show_usage.attr,
+	&heap_attr_compact.attr,
 	NULL,
 };
 
@@ -1097,6 +1272,29 @@ static int nvmap_debug_iovmm_allocations_open(struct inode *inode,
 			    inode->i_private);
 }
 
+#ifdef CONFIG_NVMAP_RECLAIM_UNPINNED_VM
+static int nvmap_debug_iovmm_mru_show(struct seq_file *s, void *unused)
+{
+	struct nvmap_device *dev = s->private;
+
+	nvmap_mru_show(&dev->iovmm_master, s);
+	return 0;
+}
+
+static int nvmap_debug_iovmm_mru_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvmap_debug_iovmm_mru_show,
+			   inode->i_private);
+}
+
+static const struct file_operations debug_iovmm_mru_fops = {
+	.open = nvmap_debug_iovmm_mru_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
 static const struct file_operations debug_iovmm_allocations_fops = {
 	.open = nvmap_debug_iovmm_allocations_open,
 	.read = seq_read,
@@ -1210,6 +1408,11 @@ static int nvmap_probe(struct platform_device *pdev)
 		goto fail;
 	}
 
+	/* allocations still work without a pool, just more slowly */
+	for (i = 0; i < NVMAP_NUM_POOLS; i++)
+		dev->pools[i] = nvmap_page_pool_create(
+					dev->dev_user.this_device, i);
+
 	dev->nr_carveouts = 0;
 	dev->heaps = kzalloc(sizeof(struct nvmap_carveout_node) *
 			     plat->nr_carveouts, GFP_KERNEL);
@@ -1265,6 +1468,10 @@ static int nvmap_probe(struct platform_device *pdev)
 				dev, &debug_iovmm_clients_fops);
 			debugfs_create_file("allocations", 0444, iovmm_root,
 				dev, &debug_iovmm_allocations_fops);
+#ifdef CONFIG_NVMAP_RECLAIM_UNPINNED_VM
+			debugfs_create_file("mru", 0444, iovmm_root,
+				dev, &debug_iovmm_mru_fops);
+#endif
 		}
 	}
 
@@ -1278,6 +1485,8 @@ fail_heaps:
 		nvmap_heap_destroy(node->carveout);
 	}
 fail:
+	for (i = 0; i < NVMAP_NUM_POOLS; i++)
+		nvmap_page_pool_destroy(dev->pools[i]);
 	kfree(dev->heaps);
 	nvmap_mru_destroy(&dev->iovmm_master);
 	if (dev->dev_super.minor != MISC_DYNAMIC_MINOR)
@@ -1321,6 +1530,9 @@ static int nvmap_remove(struct platform_device *pdev)
 	}
 	kfree(dev->heaps);
 
+	for (i = 0; i < NVMAP_NUM_POOLS; i++)
+		nvmap_page_pool_destroy(dev->pools[i]);
+
 	free_vm_area(dev->vm_rgn);
 	kfree(dev);
 	nvmap_dev = NULL;
@@ -37,19 +37,18 @@
 
 #include "nvmap.h"
 #include "nvmap_mru.h"
+#include "nvmap_pool.h"
 
 #define NVMAP_SECURE_HEAPS	(NVMAP_HEAP_CARVEOUT_IRAM | NVMAP_HEAP_IOVMM)
-#ifdef CONFIG_NVMAP_HIGHMEM_ONLY
-#define GFP_NVMAP		(__GFP_HIGHMEM | __GFP_NOWARN)
-#else
-#define GFP_NVMAP		(GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
-#endif
 /* handles may be arbitrarily large (16+MiB), and any handle allocated from
  * the kernel (i.e., not a carveout handle) includes its array of pages. to
  * preserve kmalloc space, if the array of pages exceeds PAGELIST_VMALLOC_MIN,
  * the array is allocated using vmalloc. */
 #define PAGELIST_VMALLOC_MIN	(PAGE_SIZE * 2)
 
+/* source of nvmap_handle.serial */
+static atomic_t nvmap_handle_serial = ATOMIC_INIT(0);
+
 static inline void *altalloc(size_t len)
 {
 	if (len >= PAGELIST_VMALLOC_MIN)
@@ -72,6 +71,7 @@ static inline void altfree(void *ptr, size_t len)
 void _nvmap_handle_free(struct nvmap_handle *h)
 {
 	struct nvmap_device *dev = h->dev;
+	struct nvmap_page_pool *pool;
 	unsigned int i, nr_page;
 
 	if (nvmap_handle_remove(dev, h) != 0)
@@ -81,7 +81,13 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 		goto out;
 
 	if (!h->heap_pgalloc) {
-		nvmap_heap_free(h->carveout);
+		struct nvmap_heap_block *b;
+
+		/* the compactor may be moving the block */
+		mutex_lock(&h->lock);
+		b = h->carveout;
+		mutex_unlock(&h->lock);
+		nvmap_heap_free(b);
 		goto out;
 	}
 
@@ -95,8 +101,12 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 	if (h->pgalloc.area)
 		tegra_iovmm_free_vm(h->pgalloc.area);
 
-	for (i = 0; i < nr_page; i++)
-		__free_page(h->pgalloc.pages[i]);
+	pool = nvmap_get_pool_from_dev(dev, h->flags);
+	for (i = 0; i < nr_page; i++) {
+		struct page *page = h->pgalloc.pages[i];
+		if (!nvmap_page_pool_release(pool, page))
+			__free_page(page);
+	}
 
 	altfree(h->pgalloc.pages, nr_page * sizeof(struct page *));
 
@@ -106,11 +116,23 @@ out:
 
 extern void __flush_dcache_page(struct address_space *, struct page *);
 
+/* flushes nr physically contiguous pages from the inner and outer caches */
+void nvmap_flush_pages(struct page *page, unsigned int nr)
+{
+	struct page *p, *e = page + nr;
+	unsigned long base;
+
+	for (p = page; p < e; p++)
+		__flush_dcache_page(page_mapping(p), p);
+
+	base = page_to_phys(page);
+	outer_flush_range(base, base + (nr << PAGE_SHIFT));
+}
+
 static struct page *nvmap_alloc_pages_exact(gfp_t gfp, size_t size)
 {
 	struct page *page, *p, *e;
 	unsigned int order;
-	unsigned long base;
 
 	size = PAGE_ALIGN(size);
 	order = get_order(size);
@@ -125,12 +147,17 @@ static struct page *nvmap_alloc_pages_exact(gfp_t gfp, size_t size)
 	for (p = page + (size >> PAGE_SHIFT); p < e; p++)
 		__free_page(p);
 
-	e = page + (size >> PAGE_SHIFT);
-	for (p = page; p < e; p++)
-		__flush_dcache_page(page_mapping(p), p);
+	nvmap_flush_pages(page, size >> PAGE_SHIFT);
+	return page;
+}
 
-	base = page_to_phys(page);
-	outer_flush_range(base, base + size);
+static struct page *nvmap_alloc_page(struct nvmap_page_pool *pool)
+{
+	struct page *page;
+
+	page = nvmap_page_pool_alloc(pool);
+	if (!page)
+		page = nvmap_alloc_pages_exact(GFP_NVMAP, PAGE_SIZE);
 	return page;
 }
 
@@ -139,6 +166,7 @@ static int handle_page_alloc(struct nvmap_client *client,
 {
 	size_t size = PAGE_ALIGN(h->size);
 	unsigned int nr_page = size >> PAGE_SHIFT;
+	struct nvmap_page_pool *pool;
 	pgprot_t prot;
 	unsigned int i = 0;
 	struct page **pages;
@@ -148,6 +176,7 @@ static int handle_page_alloc(struct nvmap_client *client,
 		return -ENOMEM;
 
 	prot = nvmap_pgprot(h, pgprot_kernel);
+	pool = nvmap_get_pool_from_dev(client->dev, h->flags);
 
 #ifdef CONFIG_NVMAP_ALLOW_SYSMEM
 	if (nr_page == 1)
@@ -155,7 +184,12 @@ static int handle_page_alloc(struct nvmap_client *client,
 #endif
 
 	h->pgalloc.area = NULL;
-	if (contiguous) {
+	if (contiguous && nr_page == 1) {
+		pages[0] = nvmap_alloc_page(pool);
+		if (!pages[0])
+			goto fail;
+		i = 1;
+	} else if (contiguous) {
 		struct page *page;
 		page = nvmap_alloc_pages_exact(GFP_NVMAP, size);
 		if (!page)
@@ -166,7 +200,7 @@ static int handle_page_alloc(struct nvmap_client *client,
 
 	} else {
 		for (i = 0; i < nr_page; i++) {
-			pages[i] = nvmap_alloc_pages_exact(GFP_NVMAP, PAGE_SIZE);
+			pages[i] = nvmap_alloc_page(pool);
 			if (!pages[i])
 				goto fail;
 		}
@@ -205,6 +239,7 @@ static void alloc_handle(struct nvmap_client *client, size_t align,
 		b = nvmap_carveout_alloc(client, h->size, align,
 					 type, h->flags);
 		if (b) {
+			b->handle = h;
 			h->carveout = b;
 			h->heap_pgalloc = false;
 			h->alloc = true;
@@ -436,6 +471,7 @@ struct nvmap_handle_ref *nvmap_create_handle(struct nvmap_client *client,
 
 	atomic_set(&h->ref, 1);
 	atomic_set(&h->pin, 0);
+	h->serial = atomic_inc_return(&nvmap_handle_serial);
 	h->owner = client;
 	h->dev = client->dev;
 	BUG_ON(!h->owner);
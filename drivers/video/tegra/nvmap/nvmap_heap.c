@@ -23,6 +23,7 @@
 #include <linux/device.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
@@ -63,9 +64,22 @@
  * and to ensure that the minimum free block size in the carveout (i.e., the
  * "small" threshold) is still a meaningful size.
  *
+ * besides the address-ordered free list (used to merge neighbouring free
+ * blocks), free blocks are kept in power-of-two size bins, each sorted by
+ * address. an allocation is taken from the lowest (or, for TOP_DOWN, the
+ * highest) block of the smallest bin in which every block is large enough,
+ * so finding it doesn't depend on the number of free blocks; only when no
+ * such bin is populated are the blocks of the smaller bins checked one by
+ * one.
+ *
+ * since blocks are never moved by the allocator itself, a long-running heap
+ * can still fragment. nvmap_heap_compact moves allocated blocks into free
+ * blocks elsewhere in the heap, so that the free space around them is
+ * merged; the owner of each block decides whether it can be moved.
  */
 
 #define MAX_BUDDY_NR	128	/* maximum buddies in a buddy allocator */
+#define NR_FREE_BINS	BITS_PER_LONG
 
 enum direction {
 	TOP_DOWN,
@@ -84,6 +98,8 @@ struct heap_stat {
 	size_t total;		/* total size */
 	size_t largest;		/* largest unique block */
 	size_t count;		/* total number of blocks */
+	unsigned long compact_moves;	/* blocks moved by compaction */
+	unsigned long compact_bytes;	/* bytes moved by compaction */
 };
 
 struct buddy_heap;
@@ -99,8 +115,11 @@ struct list_block {
 	unsigned int mem_prot;
 	unsigned long orig_addr;
 	size_t size;
+	size_t align;
 	struct nvmap_heap *heap;
-	struct list_head free_list;
+	struct list_head free_list;	/* empty while allocated */
+	struct list_head bin_list;
+	bool compact_skip;		/* owner refused to move it */
 };
 
 struct combo_block {
@@ -125,11 +144,15 @@ struct buddy_heap {
 struct nvmap_heap {
 	struct list_head all_list;
 	struct list_head free_list;
+	struct list_head free_bins[NR_FREE_BINS];
+	unsigned long free_bin_map;	/* non-empty free_bins */
 	struct mutex lock;
 	struct list_head buddy_list;
 	unsigned int min_buddy_shift;
 	unsigned int buddy_heap_size;
 	unsigned int small_alloc;
+	unsigned long compact_moves;
+	unsigned long compact_bytes;
 	const char *name;
 	void *arg;
 	struct device dev;
@@ -204,6 +227,9 @@ static unsigned long heap_stat(struct nvmap_heap *heap, struct heap_stat *stat)
 		stat->free_count++;
 		stat->free_largest = max(l->size, stat->free_largest);
 	}
+
+	stat->compact_moves = heap->compact_moves;
+	stat->compact_bytes = heap->compact_bytes;
 	mutex_unlock(&heap->lock);
 
 	return base;
@@ -236,6 +262,15 @@ static struct device_attribute heap_stat_free_size =
 static struct device_attribute heap_stat_base =
 	__ATTR(base, S_IRUGO, heap_stat_show, NULL);
 
+static struct device_attribute heap_stat_fragmentation =
+	__ATTR(fragmentation, S_IRUGO, heap_stat_show, NULL);
+
+static struct device_attribute heap_stat_compact_moves =
+	__ATTR(compact_moves, S_IRUGO, heap_stat_show, NULL);
+
+static struct device_attribute heap_stat_compact_bytes =
+	__ATTR(compact_bytes, S_IRUGO, heap_stat_show, NULL);
+
 static struct device_attribute heap_attr_name =
 	__ATTR(name, S_IRUGO, heap_name_show, NULL);
 
@@ -247,6 +282,9 @@ static struct attribute *heap_stat_attrs[] = {
 	&heap_stat_free_count.attr,
 	&heap_stat_free_size.attr,
 	&heap_stat_base.attr,
+	&heap_stat_fragmentation.attr,
+	&heap_stat_compact_moves.attr,
+	&heap_stat_compact_bytes.attr,
 	&heap_attr_name.attr,
 	NULL,
 };
@@ -286,6 +324,15 @@ static ssize_t heap_stat_show(struct device *dev,
 		return sprintf(buf, "%u\n", stat.free);
 	else if (attr == &heap_stat_base)
 		return sprintf(buf, "%08lx\n", base);
+	else if (attr == &heap_stat_fragmentation)
+		/* percentage of free space outside the largest free block */
+		return sprintf(buf, "%u\n", !stat.free ? 0 : 100 -
+			       (unsigned int)div_u64(stat.free_largest * 100ull,
+						     stat.free));
+	else if (attr == &heap_stat_compact_moves)
+		return sprintf(buf, "%lu\n", stat.compact_moves);
+	else if (attr == &heap_stat_compact_bytes)
+		return sprintf(buf, "%lu\n", stat.compact_bytes);
 	else
 		return -EINVAL;
 }
@@ -371,55 +418,110 @@ static struct buddy_heap *do_buddy_free(struct nvmap_heap_block *block)
 	return NULL;
 }
 
-static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
-					      size_t len, size_t align,
-					      unsigned int mem_prot)
+static void bin_add(struct nvmap_heap *heap, struct list_block *b)
 {
-	struct list_block *b = NULL;
-	struct list_block *i = NULL;
-	struct list_block *rem = NULL;
-	unsigned long fix_base;
-	enum direction dir;
+	unsigned int bin = __fls(b->size);
+	struct list_block *n;
 
-	/* since pages are only mappable with one cache attribute,
-	 * and most allocations from carveout heaps are DMA coherent
-	 * (i.e., non-cacheable), round cacheable allocations up to
-	 * a page boundary to ensure that the physical pages will
-	 * only be mapped one way. */
-	if (mem_prot == NVMAP_HANDLE_CACHEABLE ||
-	    mem_prot == NVMAP_HANDLE_INNER_CACHEABLE) {
-		align = max_t(size_t, align, PAGE_SIZE);
-		len = PAGE_ALIGN(len);
+	list_for_each_entry(n, &heap->free_bins[bin], bin_list) {
+		if (n->block.base > b->block.base)
+			break;
 	}
 
-	dir = (len <= heap->small_alloc) ? BOTTOM_UP : TOP_DOWN;
+	list_add_tail(&b->bin_list, &n->bin_list);
+	__set_bit(bin, &heap->free_bin_map);
+}
+
+/* must be called before the size of b changes */
+static void bin_del(struct nvmap_heap *heap, struct list_block *b)
+{
+	unsigned int bin = __fls(b->size);
+
+	list_del(&b->bin_list);
+	if (list_empty(&heap->free_bins[bin]))
+		__clear_bit(bin, &heap->free_bin_map);
+}
+
+/* returns true if len bytes aligned to align fit in the free block b, and
+ * the address to place them at, at the bottom or top of b, in fix_base */
+static bool block_fits(struct list_block *b, size_t len, size_t align,
+		       enum direction dir, unsigned long *fix_base)
+{
+	unsigned long base;
+
+	if (b->size < len)
+		return false;
 
 	if (dir == BOTTOM_UP) {
-		list_for_each_entry(i, &heap->free_list, free_list) {
-			size_t fix_size;
-			fix_base = ALIGN(i->block.base, align);
-			fix_size = i->size - (fix_base - i->block.base);
-
-			if (fix_size >= len) {
-				b = i;
-				break;
-			}
-		}
+		base = ALIGN(b->block.base, align);
+		if (base - b->block.base > b->size - len)
+			return false;
 	} else {
-		list_for_each_entry_reverse(i, &heap->free_list, free_list) {
-			if (i->size >= len) {
-				fix_base = i->block.base + i->size - len;
-				fix_base &= ~(align-1);
-				if (fix_base >= i->block.base) {
-					b = i;
-					break;
-				}
-			}
+		base = (b->block.base + b->size - len) & ~(align - 1);
+		if (base < b->block.base)
+			return false;
+	}
+
+	*fix_base = base;
+	return true;
+}
+
+static struct list_block *find_free_block(struct nvmap_heap *heap,
+					  size_t len, size_t align,
+					  enum direction dir,
+					  unsigned long *fix_base)
+{
+	size_t worst = len + align - 1;
+	struct list_block *b;
+	unsigned int bin;
+
+	/* every block in bin fits len, however it is aligned */
+	bin = (worst > 1) ? __fls(worst - 1) + 1 : 0;
+	if (bin < NR_FREE_BINS) {
+		bin = find_next_bit(&heap->free_bin_map, NR_FREE_BINS, bin);
+		if (bin < NR_FREE_BINS) {
+			struct list_head *l = &heap->free_bins[bin];
+
+			if (dir == BOTTOM_UP)
+				b = list_first_entry(l, struct list_block,
+						     bin_list);
+			else
+				b = list_entry(l->prev, struct list_block,
+					       bin_list);
+			if (block_fits(b, len, align, dir, fix_base))
+				return b;
 		}
 	}
 
-	if (!b)
-		return NULL;
+	for (bin = __fls(len); bin < NR_FREE_BINS && (1ul << bin) < worst;
+	     bin++) {
+		if (!test_bit(bin, &heap->free_bin_map))
+			continue;
+
+		if (dir == BOTTOM_UP) {
+			list_for_each_entry(b, &heap->free_bins[bin], bin_list)
+				if (block_fits(b, len, align, dir, fix_base))
+					return b;
+		} else {
+			list_for_each_entry_reverse(b, &heap->free_bins[bin],
+						    bin_list)
+				if (block_fits(b, len, align, dir, fix_base))
+					return b;
+		}
+	}
+
+	return NULL;
+}
+
+/* allocates len bytes at fix_base from the free block b, returning any
+ * space left over at either end to the free lists */
+static struct list_block *carve_block(struct nvmap_heap *heap,
+				      struct list_block *b,
+				      unsigned long fix_base, size_t len)
+{
+	struct list_block *rem = NULL;
+
+	bin_del(heap, b);
 
 	if (b->block.base != fix_base) {
 		rem = kmem_cache_zalloc(block_cache, GFP_KERNEL);
@@ -439,6 +541,7 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		b->size -= rem->size;
 		list_add_tail(&rem->all_list, &heap->all_list);
 		list_add_tail(&rem->free_list, &b->free_list);
+		bin_add(heap, rem);
 	}
 
 	b->orig_addr = b->block.base;
@@ -456,12 +559,44 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 		b->size = len;
 		list_add_tail(&rem->all_list, &heap->all_list);
 		list_add(&rem->free_list, &b->free_list);
+		bin_add(heap, rem);
 	}
 
 out:
-	list_del(&b->free_list);
+	list_del_init(&b->free_list);
 	b->heap = heap;
+	b->block.handle = NULL;
+	return b;
+}
+
+static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
+					      size_t len, size_t align,
+					      unsigned int mem_prot)
+{
+	struct list_block *b;
+	unsigned long fix_base;
+	enum direction dir;
+
+	/* since pages are only mappable with one cache attribute,
+	 * and most allocations from carveout heaps are DMA coherent
+	 * (i.e., non-cacheable), round cacheable allocations up to
+	 * a page boundary to ensure that the physical pages will
+	 * only be mapped one way. */
+	if (mem_prot == NVMAP_HANDLE_CACHEABLE ||
+	    mem_prot == NVMAP_HANDLE_INNER_CACHEABLE) {
+		align = max_t(size_t, align, PAGE_SIZE);
+		len = PAGE_ALIGN(len);
+	}
+
+	dir = (len <= heap->small_alloc) ? BOTTOM_UP : TOP_DOWN;
+
+	b = find_free_block(heap, len, align, dir, &fix_base);
+	if (!b)
+		return NULL;
+
+	b = carve_block(heap, b, fix_base, len);
 	b->mem_prot = mem_prot;
+	b->align = align;
 	return &b->block;
 }
 
@@ -510,6 +645,7 @@ static void do_heap_free(struct nvmap_heap_block *block)
 	if (!list_is_last(&b->free_list, &heap->free_list)) {
 		n = list_first_entry(&b->free_list, struct list_block, free_list);
 		if (n->block.base == b->block.base + b->size) {
+			bin_del(heap, n);
 			list_del(&n->all_list);
 			list_del(&n->free_list);
 			BUG_ON(b->orig_addr >= n->orig_addr);
@@ -521,14 +657,18 @@ static void do_heap_free(struct nvmap_heap_block *block)
 	if (b->free_list.prev != &heap->free_list) {
 		n = list_entry(b->free_list.prev, struct list_block, free_list);
 		if (n->block.base + n->size == b->block.base) {
+			bin_del(heap, n);
 			list_del(&b->all_list);
 			list_del(&b->free_list);
 			BUG_ON(n->orig_addr >= b->orig_addr);
 			n->size += b->size;
 			kmem_cache_free(block_cache, b);
+			b = n;
 		}
 	}
 
+	bin_add(heap, b);
+
 	freelist_debug(heap, "free list after", b);
 }
 
@@ -616,6 +756,141 @@ void nvmap_heap_free(struct nvmap_heap_block *b)
 		mutex_unlock(&h->lock);
 }
 
+static size_t largest_free(struct nvmap_heap *heap)
+{
+	struct list_block *b;
+	size_t largest = 0;
+
+	if (!heap->free_bin_map)
+		return 0;
+
+	list_for_each_entry(b, &heap->free_bins[__fls(heap->free_bin_map)],
+			    bin_list)
+		largest = max(largest, b->size);
+
+	return largest;
+}
+
+/* picks the movable block whose space, merged with the free blocks on
+ * either side of it, would make the largest free block, along with the
+ * smallest free block elsewhere in the heap which is smaller than that
+ * and can hold it. moving blocks into holes smaller than the space they
+ * leave behind guarantees that compaction makes progress. */
+static struct list_block *find_relocation(struct nvmap_heap *heap,
+					  struct list_block **hole,
+					  unsigned long *fix_base)
+{
+	struct list_block *b, *f, *best = NULL;
+	size_t best_extent = 0;
+
+	list_for_each_entry(b, &heap->all_list, all_list) {
+		unsigned long start = b->orig_addr;
+		unsigned long end = b->block.base + b->size;
+		struct list_block *dst = NULL;
+		unsigned long dst_base = 0;
+		size_t extent = end - start;
+
+		/* buddy heaps and blocks being allocated have no owner */
+		if (!list_empty(&b->free_list) || !b->block.handle ||
+		    b->compact_skip)
+			continue;
+
+		list_for_each_entry(f, &heap->free_list, free_list) {
+			if (f->block.base + f->size == start ||
+			    f->block.base == end)
+				extent += f->size;
+		}
+
+		if (extent <= best_extent)
+			continue;
+
+		list_for_each_entry(f, &heap->free_list, free_list) {
+			unsigned long base;
+
+			if (f->size >= extent || (dst && f->size >= dst->size))
+				continue;
+			if (f->block.base + f->size == start ||
+			    f->block.base == end)
+				continue;
+			if (!block_fits(f, b->size, b->align, BOTTOM_UP, &base))
+				continue;
+
+			dst = f;
+			dst_base = base;
+		}
+
+		if (dst) {
+			best = b;
+			best_extent = extent;
+			*hole = dst;
+			*fix_base = dst_base;
+		}
+	}
+
+	return best;
+}
+
+/* nvmap_heap_compact: moves allocated blocks until the heap has a free block
+ * of at least want bytes (or, if want is 0, until no move would help), or
+ * until max_moves blocks have been moved. relocate is called with the heap
+ * locked to copy each block to its new location and point its owner at it;
+ * blocks for which it returns an error are left in place. returns the number
+ * of blocks moved. */
+unsigned int nvmap_heap_compact(struct nvmap_heap *heap, size_t want,
+				unsigned int max_moves,
+				int (*relocate)(struct nvmap_heap_block *dst,
+						struct nvmap_heap_block *src,
+						void *arg),
+				void *arg)
+{
+	struct list_block *b, *dst, *hole;
+	unsigned long fix_base;
+	unsigned int moves = 0;
+	size_t free = 0;
+
+	mutex_lock(&heap->lock);
+
+	list_for_each_entry(b, &heap->free_list, free_list)
+		free += b->size;
+
+	if (want > free || (want && largest_free(heap) >= want))
+		goto out;
+
+	list_for_each_entry(b, &heap->all_list, all_list)
+		b->compact_skip = false;
+
+	while (moves < max_moves) {
+		size_t len;
+
+		b = find_relocation(heap, &hole, &fix_base);
+		if (!b)
+			break;
+
+		len = b->size;
+		dst = carve_block(heap, hole, fix_base, len);
+		dst->mem_prot = b->mem_prot;
+		dst->align = b->align;
+
+		if (relocate(&dst->block, &b->block, arg)) {
+			b->compact_skip = true;
+			do_heap_free(&dst->block);
+			continue;
+		}
+
+		do_heap_free(&b->block);
+		heap->compact_moves++;
+		heap->compact_bytes += len;
+		moves++;
+
+		if (want && largest_free(heap) >= want)
+			break;
+	}
+
+out:
+	mutex_unlock(&heap->lock);
+	return moves;
+}
+
 struct nvmap_heap *nvmap_block_to_heap(struct nvmap_heap_block *b)
 {
 	if (b->type == BLOCK_BUDDY) {
@@ -647,6 +922,7 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 {
 	struct nvmap_heap *h = NULL;
 	struct list_block *l = NULL;
+	int i;
 
 	if (WARN_ON(buddy_size && buddy_size < NVMAP_HEAP_MIN_BUDDY_SIZE)) {
 		dev_warn(parent, "%s: buddy_size %u too small\n", __func__,
@@ -710,6 +986,8 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 	INIT_LIST_HEAD(&h->free_list);
 	INIT_LIST_HEAD(&h->buddy_list);
 	INIT_LIST_HEAD(&h->all_list);
+	for (i = 0; i < NR_FREE_BINS; i++)
+		INIT_LIST_HEAD(&h->free_bins[i]);
 	mutex_init(&h->lock);
 	l->block.base = base;
 	l->block.type = BLOCK_FIRST_FIT;
@@ -717,6 +995,7 @@ struct nvmap_heap *nvmap_heap_create(struct device *parent, const char *name,
 	l->orig_addr = base;
 	list_add_tail(&l->free_list, &h->free_list);
 	list_add_tail(&l->all_list, &h->all_list);
+	bin_add(h, l);
 	return h;
 
 fail_register:
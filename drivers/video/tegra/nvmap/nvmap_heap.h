@@ -25,11 +25,13 @@
 
 struct device;
 struct nvmap_heap;
+struct nvmap_handle;
 struct attribute_group;
 
 struct nvmap_heap_block {
 	unsigned long	base;
 	unsigned int	type;
+	struct nvmap_handle *handle;	/* owner, or NULL for internal blocks */
 };
 
 #define NVMAP_HEAP_MIN_BUDDY_SIZE	8192
@@ -51,6 +53,13 @@ struct nvmap_heap *nvmap_block_to_heap(struct nvmap_heap_block *b);
 
 void nvmap_heap_free(struct nvmap_heap_block *block);
 
+unsigned int nvmap_heap_compact(struct nvmap_heap *heap, size_t want,
+				unsigned int max_moves,
+				int (*relocate)(struct nvmap_heap_block *dst,
+						struct nvmap_heap_block *src,
+						void *arg),
+				void *arg);
+
 int nvmap_heap_create_group(struct nvmap_heap *heap,
 			    const struct attribute_group *grp);
 
@@ -23,7 +23,11 @@
 #include <linux/dma-mapping.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
+#include <linux/smp.h>
 #include <linux/uaccess.h>
 
 #include <asm/cacheflush.h>
@@ -36,6 +40,14 @@
 #include "nvmap_ioctl.h"
 #include "nvmap.h"
 
+#define NVMAP_CACHE_BENCH_ITERS	8
+
+/* carveout cache maintenance larger than this many bytes cleans the whole
+ * inner cache by set/way rather than walking the range by address; 0
+ * disables whole-cache maintenance */
+static unsigned int cache_maint_all_threshold = 32 * 1024;
+module_param(cache_maint_all_threshold, uint, 0644);
+
 static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 			 int is_read, unsigned long h_offs,
 			 unsigned long sys_addr, unsigned long h_stride,
@@ -45,6 +57,17 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 		       unsigned long start, unsigned long end, unsigned int op);
 
+static int carveout_cache_maint(struct nvmap_client *client,
+				struct nvmap_handle *h, unsigned long start,
+				unsigned long end, enum dma_data_direction dir,
+				int strategy);
+
+static enum dma_data_direction cache_op_to_dir(unsigned int op);
+
+static int cache_maint_list(struct nvmap_client *client,
+			    struct nvmap_cache_op_entry *ops,
+			    unsigned int count, void *scratch);
+
 
 int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg)
 {
@@ -283,6 +306,8 @@ int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg)
 		goto out;
 	}
 
+	/* the mapping keeps the handle busy until the VMA is closed */
+	nvmap_handle_busy_get(h);
 	vpriv->handle = h;
 	vpriv->offs = op.offset;
 
@@ -376,9 +401,11 @@ int nvmap_ioctl_rw_handle(struct file *filp, int is_read, void __user* arg)
 	if (!h)
 		return -EPERM;
 
+	nvmap_handle_busy_get(h);
 	copied = rw_handle(client, h, is_read, op.offset,
 			   (unsigned long)op.addr, op.hmem_stride,
 			   op.user_stride, op.elem_size, op.count);
+	nvmap_handle_busy_put(h);
 
 	if (copied < 0) {
 		err = copied;
@@ -435,6 +462,111 @@ out:
 	return err;
 }
 
+int nvmap_ioctl_cache_bench(struct file *filp, void __user *arg)
+{
+	struct nvmap_client *client = filp->private_data;
+	struct nvmap_cache_bench op;
+	struct nvmap_handle *h;
+	enum dma_data_direction dir;
+	int strategy;
+	int err = 0;
+
+	if (!client->super)
+		return -EPERM;
+
+	if (copy_from_user(&op, arg, sizeof(op)))
+		return -EFAULT;
+
+	if (!op.handle || !op.len || op.op < NVMAP_CACHE_OP_WB ||
+	    op.op > NVMAP_CACHE_OP_WB_INV)
+		return -EINVAL;
+
+	h = nvmap_get_handle_id(client, op.handle);
+	if (!h)
+		return -EINVAL;
+
+	if (!h->alloc || h->heap_pgalloc || op.len > h->size) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	dir = cache_op_to_dir(op.op);
+	nvmap_handle_busy_get(h);
+
+	for (strategy = 0; strategy < NVMAP_CACHE_NR_STRATEGIES; strategy++) {
+		ktime_t start = ktime_get();
+		u64 ns;
+		int i;
+
+		op.ns_per_mb[strategy] = 0;
+
+		for (i = 0; i < NVMAP_CACHE_BENCH_ITERS && !err; i++)
+			err = carveout_cache_maint(client, h, 0, op.len, dir,
+						   strategy);
+		if (err)
+			break;
+
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		ns = div64_u64(ns << 20, (u64)op.len * NVMAP_CACHE_BENCH_ITERS);
+		op.ns_per_mb[strategy] = min_t(u64, ns, UINT_MAX);
+	}
+
+	nvmap_handle_busy_put(h);
+
+	if (!err && copy_to_user(arg, &op, sizeof(op)))
+		err = -EFAULT;
+
+out:
+	nvmap_handle_put(h);
+	return err;
+}
+
+struct cache_maint_range {
+	struct nvmap_handle *h;
+	unsigned long start;
+	unsigned long end;
+	unsigned int op;
+};
+
+int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg)
+{
+	struct nvmap_cache_op_list op;
+	struct nvmap_cache_op_entry on_stack[8];
+	struct cache_maint_range on_stack_ranges[8];
+	struct nvmap_cache_op_entry *ops;
+	void *ranges;
+	int err;
+
+	if (copy_from_user(&op, arg, sizeof(op)))
+		return -EFAULT;
+
+	if (!op.count || op.count > NVMAP_CACHE_LIST_MAX)
+		return -EINVAL;
+
+	if (op.count > ARRAY_SIZE(on_stack)) {
+		ops = kmalloc(op.count * (sizeof(*ops) +
+			      sizeof(struct cache_maint_range)), GFP_KERNEL);
+		if (!ops)
+			return -ENOMEM;
+		ranges = ops + op.count;
+	} else {
+		ops = on_stack;
+		ranges = on_stack_ranges;
+	}
+
+	if (copy_from_user(ops, (void __user *)op.ops,
+			   op.count * sizeof(*ops)))
+		err = -EFAULT;
+	else
+		err = cache_maint_list(filp->private_data, ops, op.count,
+				       ranges);
+
+	if (ops != on_stack)
+		kfree(ops);
+
+	return err;
+}
+
 int nvmap_ioctl_free(struct file *filp, unsigned long arg)
 {
 	struct nvmap_client *client = filp->private_data;
@@ -446,14 +578,147 @@ int nvmap_ioctl_free(struct file *filp, unsigned long arg)
 	return 0;
 }
 
-static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
-		       unsigned long start, unsigned long end, unsigned int op)
+static void flush_inner_cache_all(void *unused)
+{
+	__cpuc_flush_kern_all();
+}
+
+/* performs inner cache maintenance on [start, end) of carveout handle h,
+ * using the requested strategy. start and end are offsets into the handle */
+static int inner_cache_maint(struct nvmap_client *client,
+			     struct nvmap_handle *h, unsigned long start,
+			     unsigned long end, enum dma_data_direction dir,
+			     int strategy)
 {
-	enum dma_data_direction dir;
 	pgprot_t prot;
-	pte_t **pte = NULL;
+	pte_t **pte;
 	unsigned long kaddr;
 	unsigned long loop;
+
+	if (strategy == NVMAP_CACHE_STRATEGY_ALL) {
+		/* set/way operations only reach the local CPU's cache */
+		on_each_cpu(flush_inner_cache_all, NULL, 1);
+		return 0;
+	}
+
+	prot = nvmap_pgprot(h, pgprot_kernel);
+	pte = nvmap_alloc_pte(client->dev, (void **)&kaddr);
+	if (IS_ERR(pte))
+		return PTR_ERR(pte);
+
+	start += h->carveout->base;
+	end += h->carveout->base;
+
+	loop = start;
+
+	while (loop < end) {
+		unsigned long next = (loop + PAGE_SIZE) & PAGE_MASK;
+		void *base = (void *)kaddr + (loop & ~PAGE_MASK);
+		next = min(next, end);
+
+		set_pte_at(&init_mm, kaddr, *pte,
+			   pfn_pte(__phys_to_pfn(loop), prot));
+		flush_tlb_kernel_page(kaddr);
+
+		dmac_map_area(base, next - loop, dir);
+		loop = next;
+	}
+
+	nvmap_free_pte(client->dev, pte);
+	return 0;
+}
+
+static void outer_maint_range(unsigned long start, unsigned long end,
+			      enum dma_data_direction dir)
+{
+	if (dir != DMA_FROM_DEVICE)
+		outer_clean_range(start, end);
+	else
+		outer_inv_range(start, end);
+}
+
+/* performs outer cache maintenance on [start, end) of handle h, for when
+ * the inner cache has already been taken care of */
+static void outer_cache_maint(struct nvmap_handle *h, unsigned long start,
+			      unsigned long end, enum dma_data_direction dir)
+{
+	if (!h->heap_pgalloc) {
+		if (h->flags != NVMAP_HANDLE_INNER_CACHEABLE)
+			outer_maint_range(h->carveout->base + start,
+					  h->carveout->base + end, dir);
+		return;
+	}
+
+	while (start < end) {
+		unsigned long next = (start + PAGE_SIZE) & PAGE_MASK;
+		unsigned long phys;
+
+		next = min(next, end);
+		phys = page_to_phys(h->pgalloc.pages[start >> PAGE_SHIFT]);
+		phys += start & ~PAGE_MASK;
+		outer_maint_range(phys, phys + next - start, dir);
+		start = next;
+	}
+}
+
+static int carveout_cache_maint(struct nvmap_client *client,
+				struct nvmap_handle *h, unsigned long start,
+				unsigned long end, enum dma_data_direction dir,
+				int strategy)
+{
+	int err;
+
+	err = inner_cache_maint(client, h, start, end, dir, strategy);
+	if (err)
+		return err;
+
+	outer_cache_maint(h, start, end, dir);
+	return 0;
+}
+
+static void pgalloc_cache_maint(struct nvmap_handle *h, unsigned long start,
+				unsigned long end, enum dma_data_direction dir)
+{
+	while (start < end) {
+		unsigned long next = (start + PAGE_SIZE) & PAGE_MASK;
+		struct page *page;
+
+		page = h->pgalloc.pages[start >> PAGE_SHIFT];
+		next = min(next, end);
+		__dma_page_cpu_to_dev(page, start & ~PAGE_MASK,
+				      next - start, dir);
+		start = next;
+	}
+}
+
+/* picks the cheapest way to maintain len bytes of carveout handle h. the
+ * whole inner cache is never used for invalidates, since it would write
+ * back unrelated dirty lines over data the device may have produced */
+static int cache_maint_strategy(struct nvmap_handle *h, unsigned long len,
+				unsigned int op)
+{
+	if (op != NVMAP_CACHE_OP_INV && cache_maint_all_threshold &&
+	    len >= cache_maint_all_threshold)
+		return NVMAP_CACHE_STRATEGY_ALL;
+
+	return NVMAP_CACHE_STRATEGY_REMAP;
+}
+
+static enum dma_data_direction cache_op_to_dir(unsigned int op)
+{
+	if (op == NVMAP_CACHE_OP_WB_INV)
+		return DMA_BIDIRECTIONAL;
+	else if (op == NVMAP_CACHE_OP_WB)
+		return DMA_TO_DEVICE;
+	else
+		return DMA_FROM_DEVICE;
+}
+
+static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
+		       unsigned long start, unsigned long end, unsigned int op)
+{
+	enum dma_data_direction dir;
+	int strategy;
 	int err = 0;
 
 	h = nvmap_handle_get(h);
@@ -470,70 +735,141 @@ static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 	    start == end)
 		goto out;
 
-	if (WARN_ON_ONCE(op == NVMAP_CACHE_OP_WB_INV))
-		dir = DMA_BIDIRECTIONAL;
-	else if (op == NVMAP_CACHE_OP_WB)
-		dir = DMA_TO_DEVICE;
-	else
-		dir = DMA_FROM_DEVICE;
+	WARN_ON_ONCE(op == NVMAP_CACHE_OP_WB_INV);
+	dir = cache_op_to_dir(op);
 
 	if (h->heap_pgalloc) {
-		while (start < end) {
-			unsigned long next = (start + PAGE_SIZE) & PAGE_MASK;
-			struct page *page;
-
-			page = h->pgalloc.pages[start >> PAGE_SHIFT];
-			next = min(next, end);
-			__dma_page_cpu_to_dev(page, start & ~PAGE_MASK,
-					      next - start, dir);
-			start = next;
-		}
-		goto out;
-	}
-
-	prot = nvmap_pgprot(h, pgprot_kernel);
-	pte = nvmap_alloc_pte(client->dev, (void **)&kaddr);
-	if (IS_ERR(pte)) {
-		err = PTR_ERR(pte);
-		pte = NULL;
+		pgalloc_cache_maint(h, start, end, dir);
 		goto out;
 	}
 
 	if (start > h->size || end > h->size) {
 		nvmap_warn(client, "cache maintenance outside handle\n");
-		return -EINVAL;
+		err = -EINVAL;
+		goto out;
 	}
 
-	start += h->carveout->base;
-	end += h->carveout->base;
+	strategy = cache_maint_strategy(h, end - start, op);
+	err = carveout_cache_maint(client, h, start, end, dir, strategy);
 
-	loop = start;
+out:
+	nvmap_handle_put(h);
+	wmb();
+	return err;
+}
 
-	while (loop < end) {
-		unsigned long next = (loop + PAGE_SIZE) & PAGE_MASK;
-		void *base = (void *)kaddr + (loop & ~PAGE_MASK);
-		next = min(next, end);
+/* performs the entries in the order given, looking a handle up once for a
+ * run of entries on it, and merging each entry into the one before it if
+ * both have the same handle and op and their ranges overlap or touch.
+ * scratch must have room for count ranges. if the merged ranges add up to
+ * more than the whole-cache threshold, and none of them is an invalidate,
+ * the inner cache is flushed once and only the outer cache is maintained
+ * by range. the flush comes first, so it would write back dirty lines an
+ * earlier invalidate in the list asked to discard. */
+static int cache_maint_list(struct nvmap_client *client,
+			    struct nvmap_cache_op_entry *ops,
+			    unsigned int count, void *scratch)
+{
+	struct cache_maint_range *ranges = scratch;
+	struct nvmap_handle *h = NULL;
+	unsigned long id = 0;
+	unsigned long total = 0;
+	unsigned int i, n = 0;
+	bool all;
+	int err = 0;
 
-		set_pte_at(&init_mm, kaddr, *pte,
-			   pfn_pte(__phys_to_pfn(loop), prot));
-		flush_tlb_kernel_page(kaddr);
+	for (i = 0; i < count; i++) {
+		struct nvmap_cache_op_entry *e = &ops[i];
+		struct cache_maint_range *r = n ? &ranges[n - 1] : NULL;
 
-		dmac_map_area(base, next - loop, dir);
-		loop = next;
+		if (e->op < NVMAP_CACHE_OP_WB || e->op > NVMAP_CACHE_OP_WB_INV) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (!e->handle) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (e->handle != id) {
+			if (h)
+				nvmap_handle_put(h);
+			id = e->handle;
+			h = nvmap_get_handle_id(client, id);
+			if (!h) {
+				err = -EINVAL;
+				goto out;
+			}
+			if (!h->alloc) {
+				err = -EFAULT;
+				goto out;
+			}
+		}
+
+		if (e->len > h->size || e->offset > h->size - e->len) {
+			nvmap_warn(client, "cache maintenance outside handle\n");
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (h->flags == NVMAP_HANDLE_UNCACHEABLE ||
+		    h->flags == NVMAP_HANDLE_WRITE_COMBINE || !e->len)
+			continue;
+
+		if (r && r->h == h && r->op == e->op &&
+		    e->offset <= r->end && e->offset + e->len >= r->start) {
+			r->start = min_t(unsigned long, r->start, e->offset);
+			r->end = max_t(unsigned long, r->end,
+				       e->offset + e->len);
+			continue;
+		}
+
+		r = &ranges[n++];
+		r->h = nvmap_handle_get(h);
+		nvmap_handle_busy_get(r->h);
+		r->start = e->offset;
+		r->end = e->offset + e->len;
+		r->op = e->op;
 	}
 
-	if (h->flags != NVMAP_HANDLE_INNER_CACHEABLE) {
-		if (dir != DMA_FROM_DEVICE)
-			outer_clean_range(start, end);
-		else
-			outer_inv_range(start, end);
+	for (i = 0; i < n; i++) {
+		if (ranges[i].op == NVMAP_CACHE_OP_INV) {
+			total = 0;
+			break;
+		}
+		total += ranges[i].end - ranges[i].start;
 	}
 
-out:
-	if (pte)
-		nvmap_free_pte(client->dev, pte);
-	nvmap_handle_put(h);
+	all = cache_maint_all_threshold && total >= cache_maint_all_threshold;
+	if (all)
+		on_each_cpu(flush_inner_cache_all, NULL, 1);
+
+	for (i = 0; i < n && !err; i++) {
+		struct cache_maint_range *r = &ranges[i];
+		enum dma_data_direction dir = cache_op_to_dir(r->op);
+		int strategy;
+
+		if (all && r->op != NVMAP_CACHE_OP_INV) {
+			outer_cache_maint(r->h, r->start, r->end, dir);
+		} else if (r->h->heap_pgalloc) {
+			pgalloc_cache_maint(r->h, r->start, r->end, dir);
+		} else {
+			strategy = cache_maint_strategy(r->h,
+					r->end - r->start, r->op);
+			err = carveout_cache_maint(client, r->h, r->start,
+						   r->end, dir, strategy);
+		}
+	}
 	wmb();
+
+out:
+	for (i = 0; i < n; i++) {
+		nvmap_handle_busy_put(ranges[i].h);
+		nvmap_handle_put(ranges[i].h);
+	}
+	if (h)
+		nvmap_handle_put(h);
 	return err;
 }
 
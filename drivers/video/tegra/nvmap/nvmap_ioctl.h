@@ -95,6 +95,34 @@ struct nvmap_cache_op {
 	__s32 op;
 };
 
+struct nvmap_cache_op_entry {
+	__u32 handle;
+	__u32 offset;		/* offset into hmem */
+	__u32 len;
+	__s32 op;
+};
+
+#define NVMAP_CACHE_LIST_MAX	1024
+
+struct nvmap_cache_op_list {
+	unsigned long ops;	/* array of struct nvmap_cache_op_entry */
+	__u32 count;		/* number of entries in ops */
+};
+
+/* ways of performing cache maintenance on a carveout handle */
+enum {
+	NVMAP_CACHE_STRATEGY_REMAP,	/* by address, remapping each page */
+	NVMAP_CACHE_STRATEGY_ALL,	/* whole inner cache, by set/way */
+	NVMAP_CACHE_NR_STRATEGIES,
+};
+
+struct nvmap_cache_bench {
+	__u32 handle;
+	__u32 len;		/* bytes from the start of the handle */
+	__s32 op;
+	__u32 ns_per_mb[NVMAP_CACHE_NR_STRATEGIES];
+};
+
 #define NVMAP_IOC_MAGIC 'N'
 
 /* Creates a new memory handle. On input, the argument is the size of the new
@@ -134,7 +162,18 @@ struct nvmap_cache_op {
  * reference to the same handle */
 #define NVMAP_IOC_GET_ID  _IOWR(NVMAP_IOC_MAGIC, 13, struct nvmap_create_handle)
 
-#define NVMAP_IOC_MAXNR (_IOC_NR(NVMAP_IOC_GET_ID))
+/* Times each cache maintenance strategy on the first len bytes of a
+ * carveout handle, so that the whole-cache threshold can be tuned */
+#define NVMAP_IOC_CACHE_BENCH \
+	_IOWR(NVMAP_IOC_MAGIC, 14, struct nvmap_cache_bench)
+
+/* Performs cache maintenance on a list of handle ranges in one pass, in
+ * the order given. An entry that overlaps or touches the one before it,
+ * on the same handle with the same op, is merged into it */
+#define NVMAP_IOC_CACHE_LIST \
+	_IOW(NVMAP_IOC_MAGIC, 15, struct nvmap_cache_op_list)
+
+#define NVMAP_IOC_MAXNR (_IOC_NR(NVMAP_IOC_CACHE_LIST))
 
 int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg);
 
@@ -152,6 +191,10 @@ int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg);
 
 int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg);
 
+int nvmap_ioctl_cache_bench(struct file *filp, void __user *arg);
+
+int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg);
+
 int nvmap_ioctl_rw_handle(struct file *filp, int is_read, void __user* arg);
 
 
@@ -23,6 +23,7 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/mm_types.h>
+#include <linux/seq_file.h>
 
 #include <asm/pgtable.h>
 
@@ -32,29 +33,45 @@
 #include "nvmap_mru.h"
 
 /* if IOVMM reclamation is enabled (CONFIG_NVMAP_RECLAIM_UNPINNED_VM),
- * unpinned handles are placed onto a most-recently-used eviction list;
- * multiple lists are maintained, segmented by size (sizes were chosen to
- * roughly correspond with common sizes for graphics surfaces).
+ * unpinned handles are placed onto eviction lists instead of having their
+ * IOVMM area freed; multiple lists are maintained, segmented by size (sizes
+ * were chosen to roughly correspond with common sizes for graphics
+ * surfaces).
  *
- * if a handle is located on the MRU list, then the code below may
+ * if a handle is located on an eviction list, then the code below may
  * steal its IOVMM area at any time to satisfy a pin operation if no
  * free IOVMM space is available
+ *
+ * in the style of 2Q, each size class has a cold list, for handles which
+ * haven't been re-pinned since they were last mapped, and a hot list for
+ * handles which have; both are kept in unpin order. cold handles are
+ * evicted first, oldest first. hot handles are aged like CLOCK: each
+ * re-pin from the lists earns a handle one more pass over the hot list
+ * before it is evicted, up to MRU_MAX_REUSE.
  */
 
+#define MRU_MAX_REUSE	3
+
 static const size_t mru_cutoff[] = {
 	262144, 393216, 786432, 1048576, 1572864
 };
 
-static inline struct list_head *mru_list(struct nvmap_share *share, size_t size)
+static inline unsigned int mru_index(size_t size)
 {
 	unsigned int i;
 
-	BUG_ON(!share->mru_lists);
 	for (i = 0; i < ARRAY_SIZE(mru_cutoff); i++)
 		if (size <= mru_cutoff[i])
 			break;
 
-	return &share->mru_lists[i];
+	return i;
+}
+
+static inline struct list_head *mru_list(struct nvmap_share *share,
+					 size_t size, bool hot)
+{
+	BUG_ON(!share->mru_lists);
+	return &share->mru_lists[mru_index(size) + (hot ? share->nr_mru : 0)];
 }
 
 size_t nvmap_mru_vm_size(struct tegra_iovmm_client *iovmm)
@@ -67,7 +84,8 @@ size_t nvmap_mru_vm_size(struct tegra_iovmm_client *iovmm)
 void nvmap_mru_insert_locked(struct nvmap_share *share, struct nvmap_handle *h)
 {
 	size_t len = h->pgalloc.area->iovm_length;
-	list_add(&h->pgalloc.mru_list, mru_list(share, len));
+	list_add_tail(&h->pgalloc.mru_list,
+		      mru_list(share, len, h->pgalloc.reuse != 0));
 }
 
 void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h)
@@ -79,28 +97,84 @@ void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h)
 	INIT_LIST_HEAD(&h->pgalloc.mru_list);
 }
 
+/* takes the IOVMM area away from an unpinned handle */
+static struct tegra_iovmm_area *mru_evict(struct nvmap_share *share,
+					  struct nvmap_handle *evict)
+{
+	struct tegra_iovmm_area *vm = evict->pgalloc.area;
+
+	BUG_ON(atomic_read(&evict->pin) != 0);
+	BUG_ON(!vm);
+	list_del_init(&evict->pgalloc.mru_list);
+	evict->pgalloc.area = NULL;
+	evict->pgalloc.evicted = true;
+	share->mru_evictions++;
+	share->mru_evicted_bytes += vm->iovm_length;
+	return vm;
+}
+
+/* returns the next handle to evict from the list, giving hot handles which
+ * have been re-pinned since the last pass another trip around the list */
+static struct nvmap_handle *mru_next_victim(struct list_head *mru, bool hot)
+{
+	struct nvmap_handle *h;
+
+	while (!list_empty(mru)) {
+		h = list_first_entry(mru, struct nvmap_handle,
+				     pgalloc.mru_list);
+		if (!hot || !h->pgalloc.reuse)
+			return h;
+
+		h->pgalloc.reuse--;
+		list_move_tail(&h->pgalloc.mru_list, mru);
+	}
+
+	return NULL;
+}
+
+/* returns the cold handle in the same size class with the smallest IOVMM
+ * area which can hold size bytes */
+static struct nvmap_handle *mru_best_fit(struct nvmap_share *share,
+					 size_t size)
+{
+	struct nvmap_handle *h, *best = NULL;
+
+	list_for_each_entry(h, mru_list(share, size, false), pgalloc.mru_list) {
+		size_t len = h->pgalloc.area->iovm_length;
+
+		if (len >= size &&
+		    (!best || len < best->pgalloc.area->iovm_length))
+			best = h;
+	}
+
+	return best;
+}
+
 /* returns a tegra_iovmm_area for a handle. if the handle already has
  * an iovmm_area allocated, the handle is simply removed from its MRU list
  * and the existing iovmm_area is returned.
  *
  * if no existing allocation exists, try to allocate a new IOVMM area.
  *
- * if a new area can not be allocated, try to re-use the most-recently-unpinned
- * handle's allocation.
+ * if a new area can not be allocated, try to re-use the smallest large
+ * enough area of a cold handle in the same size bin.
  *
- * and if that fails, iteratively evict handles from the MRU lists and free
- * their allocations, until the new allocation succeeds.
+ * and if that fails, evict cold handles and then hot ones, until the new
+ * allocation succeeds. size bins at least as large as the handle are
+ * evicted from first, since a single victim there is likely to free
+ * enough space; smaller bins follow, largest first.
  */
 struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 					    struct nvmap_handle *h)
 {
-	struct list_head *mru;
-	struct nvmap_handle *evict = NULL;
+	struct nvmap_share *share = c->share;
+	struct nvmap_handle *evict;
 	struct tegra_iovmm_area *vm = NULL;
-	unsigned int i, idx;
+	unsigned int i, idx, nr;
 	pgprot_t prot;
+	int hot;
 
-	BUG_ON(!h || !c || !c->share);
+	BUG_ON(!h || !c || !share);
 
 	prot = nvmap_pgprot(h, pgprot_kernel);
 
@@ -108,70 +182,89 @@ struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 		BUG_ON(list_empty(&h->pgalloc.mru_list));
 		list_del(&h->pgalloc.mru_list);
 		INIT_LIST_HEAD(&h->pgalloc.mru_list);
+		h->pgalloc.reuse = min_t(unsigned int, h->pgalloc.reuse + 1,
+					 MRU_MAX_REUSE);
+		share->mru_hits++;
 		return h->pgalloc.area;
 	}
 
-	vm = tegra_iovmm_create_vm(c->share->iovmm, NULL, h->size, prot);
+	if (h->pgalloc.evicted)
+		share->mru_refaults++;
 
-	if (vm) {
-		INIT_LIST_HEAD(&h->pgalloc.mru_list);
-		return vm;
-	}
-	/* attempt to re-use the most recently unpinned IOVMM area in the
-	 * same size bin as the current handle. If that fails, iteratively
-	 * evict handles (starting from the current bin) until an allocation
-	 * succeeds or no more areas can be evicted */
-
-	mru = mru_list(c->share, h->size);
-	if (!list_empty(mru))
-		evict = list_first_entry(mru, struct nvmap_handle,
-					 pgalloc.mru_list);
-
-	if (evict && evict->pgalloc.area->iovm_length >= h->size) {
-		list_del(&evict->pgalloc.mru_list);
-		vm = evict->pgalloc.area;
-		evict->pgalloc.area = NULL;
-		INIT_LIST_HEAD(&evict->pgalloc.mru_list);
-		return vm;
+	vm = tegra_iovmm_create_vm(share->iovmm, NULL, h->size, prot);
+	if (vm)
+		goto out;
+
+	evict = mru_best_fit(share, h->size);
+	if (evict) {
+		vm = mru_evict(share, evict);
+		goto out;
 	}
 
-	idx = mru - c->share->mru_lists;
-
-	for (i = 0; i < c->share->nr_mru && !vm; i++, idx++) {
-		if (idx >= c->share->nr_mru)
-			idx = 0;
-		mru = &c->share->mru_lists[idx];
-		while (!list_empty(mru) && !vm) {
-			evict = list_first_entry(mru, struct nvmap_handle,
-						 pgalloc.mru_list);
-
-			BUG_ON(atomic_read(&evict->pin) != 0);
-			BUG_ON(!evict->pgalloc.area);
-			list_del(&evict->pgalloc.mru_list);
-			INIT_LIST_HEAD(&evict->pgalloc.mru_list);
-			tegra_iovmm_free_vm(evict->pgalloc.area);
-			evict->pgalloc.area = NULL;
-			vm = tegra_iovmm_create_vm(c->share->iovmm,
-						   NULL, h->size, prot);
+	nr = share->nr_mru;
+	idx = mru_index(h->size);
+
+	for (hot = 0; hot < 2 && !vm; hot++) {
+		for (i = 0; i < nr && !vm; i++) {
+			struct list_head *mru;
+			unsigned int bin;
+
+			bin = (i < nr - idx) ? idx + i : nr - 1 - i;
+			mru = &share->mru_lists[bin + (hot ? nr : 0)];
+			while (!vm && (evict = mru_next_victim(mru, hot))) {
+				tegra_iovmm_free_vm(mru_evict(share, evict));
+				vm = tegra_iovmm_create_vm(share->iovmm, NULL,
+							   h->size, prot);
+			}
 		}
 	}
 
+out:
+	if (vm) {
+		INIT_LIST_HEAD(&h->pgalloc.mru_list);
+		if (h->pgalloc.evicted)
+			share->mru_remapped_bytes += h->size;
+		h->pgalloc.evicted = false;
+		h->pgalloc.reuse = 0;
+	}
 	return vm;
 }
 
+void nvmap_mru_show(struct nvmap_share *share, struct seq_file *s)
+{
+	unsigned int cold, hot;
+	struct list_head *l;
+	int i;
+
+	nvmap_mru_lock(share);
+	seq_printf(s, "hits %lu\nrefaults %lu\nevictions %lu\n",
+		   share->mru_hits, share->mru_refaults, share->mru_evictions);
+	seq_printf(s, "evicted_bytes %lu\nremapped_bytes %lu\n",
+		   share->mru_evicted_bytes, share->mru_remapped_bytes);
+	for (i = 0; i < share->nr_mru; i++) {
+		cold = hot = 0;
+		list_for_each(l, &share->mru_lists[i])
+			cold++;
+		list_for_each(l, &share->mru_lists[share->nr_mru + i])
+			hot++;
+		seq_printf(s, "bin%d %u cold %u hot\n", i, cold, hot);
+	}
+	nvmap_mru_unlock(share);
+}
+
 int nvmap_mru_init(struct nvmap_share *share)
 {
 	int i;
 	mutex_init(&share->mru_lock);
 	share->nr_mru = ARRAY_SIZE(mru_cutoff) + 1;
 
-	share->mru_lists = kzalloc(sizeof(struct list_head) * share->nr_mru,
+	share->mru_lists = kzalloc(sizeof(struct list_head) * share->nr_mru * 2,
 				   GFP_KERNEL);
 
 	if (!share->mru_lists)
 		return -ENOMEM;
 
-	for (i = 0; i <= share->nr_mru; i++)
+	for (i = 0; i < share->nr_mru * 2; i++)
 		INIT_LIST_HEAD(&share->mru_lists[i]);
 
 	return 0;
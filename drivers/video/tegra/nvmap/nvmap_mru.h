@@ -28,6 +28,7 @@
 
 #include "nvmap.h"
 
+struct seq_file;
 struct tegra_iovmm_area;
 struct tegra_iovmm_client;
 
@@ -56,6 +57,8 @@ void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h);
 struct tegra_iovmm_area *nvmap_handle_iovmm_locked(struct nvmap_client *c,
 					    struct nvmap_handle *h);
 
+void nvmap_mru_show(struct nvmap_share *share, struct seq_file *s);
+
 #else
 
 #define nvmap_mru_lock(_s)	do { } while (0)
@@ -0,0 +1,386 @@
+/*
+ * drivers/video/tegra/nvmap/nvmap_pool.c
+ *
+ * Pools of ready-to-use pages for nvmap system memory handles
+ *
+ * Copyright (c) 2010, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <linux/device.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include <mach/nvmap.h>
+
+#include "nvmap.h"
+#include "nvmap_pool.h"
+
+/* pages of system memory handles are zeroed and flushed from the CPU caches
+ * before use, since they will be accessed through uncached, write-combined
+ * or IOVMM mappings. doing this, and calling into the page allocator, for
+ * every page of every allocation is expensive for buffers which are created
+ * and destroyed every frame.
+ *
+ * each handle cache type therefore keeps a pool of pages which are already
+ * zeroed and flushed. the pool is refilled from a work item when it drops
+ * below its low watermark, and the pages of freed handles are recycled
+ * into it (after being zeroed by the work item) up to its high watermark.
+ * pooled pages are given back to the system under memory pressure. */
+
+struct nvmap_page_pool {
+	spinlock_t lock;
+	struct list_head pages;		/* zeroed and flushed */
+	struct list_head dirty;		/* recycled, not yet zeroed */
+	unsigned int count;
+	unsigned int nr_dirty;
+	unsigned int low;
+	unsigned int high;
+	unsigned long hits;
+	unsigned long misses;
+	struct work_struct refill;
+	struct shrinker shrinker;
+	struct device dev;
+};
+
+static const struct {
+	const char *name;
+	unsigned int low;
+	unsigned int high;
+} pool_defaults[NVMAP_NUM_POOLS] = {
+	[NVMAP_HANDLE_UNCACHEABLE]	= { "uc",	 64, 256 },
+	[NVMAP_HANDLE_WRITE_COMBINE]	= { "wc",	 64, 256 },
+	[NVMAP_HANDLE_INNER_CACHEABLE]	= { "inner",	  0,   0 },
+	[NVMAP_HANDLE_CACHEABLE]	= { "cacheable",  0,   0 },
+};
+
+/* removes up to nr pages from the pool, preferring ones which haven't been
+ * zeroed yet, and returns them to the system */
+static void pool_drain(struct nvmap_page_pool *pool, unsigned int nr)
+{
+	LIST_HEAD(freed);
+	struct page *page, *tmp;
+
+	spin_lock(&pool->lock);
+	while (nr && pool->nr_dirty) {
+		page = list_first_entry(&pool->dirty, struct page, lru);
+		list_move(&page->lru, &freed);
+		pool->nr_dirty--;
+		nr--;
+	}
+	while (nr && pool->count) {
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_move(&page->lru, &freed);
+		pool->count--;
+		nr--;
+	}
+	spin_unlock(&pool->lock);
+
+	list_for_each_entry_safe(page, tmp, &freed, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+}
+
+static void pool_refill(struct work_struct *work)
+{
+	struct nvmap_page_pool *pool;
+	struct page *page;
+
+	pool = container_of(work, struct nvmap_page_pool, refill);
+
+	for (;;) {
+		spin_lock(&pool->lock);
+		if (pool->nr_dirty) {
+			page = list_first_entry(&pool->dirty, struct page, lru);
+			list_del(&page->lru);
+			pool->nr_dirty--;
+		} else if (pool->count < pool->high) {
+			page = NULL;
+		} else {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		spin_unlock(&pool->lock);
+
+		if (!page) {
+			page = alloc_page(GFP_NVMAP);
+			if (!page)
+				break;
+		}
+
+		clear_highpage(page);
+		nvmap_flush_pages(page, 1);
+
+		spin_lock(&pool->lock);
+		if (pool->count < pool->high) {
+			list_add_tail(&page->lru, &pool->pages);
+			pool->count++;
+			page = NULL;
+		}
+		spin_unlock(&pool->lock);
+
+		if (page)
+			__free_page(page);
+
+		cond_resched();
+	}
+}
+
+/* returns a zeroed, flushed page, or NULL if the pool is empty */
+struct page *nvmap_page_pool_alloc(struct nvmap_page_pool *pool)
+{
+	struct page *page = NULL;
+	bool refill;
+
+	if (!pool)
+		return NULL;
+
+	spin_lock(&pool->lock);
+	if (pool->count) {
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_del(&page->lru);
+		pool->count--;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	refill = pool->count < pool->low;
+	spin_unlock(&pool->lock);
+
+	if (refill)
+		schedule_work(&pool->refill);
+
+	return page;
+}
+
+/* offers the page of a freed handle to the pool; returns false if the pool
+ * is full, in which case the caller must free the page itself */
+bool nvmap_page_pool_release(struct nvmap_page_pool *pool, struct page *page)
+{
+	bool kept = false;
+
+	if (!pool || page_count(page) != 1)
+		return false;
+
+	spin_lock(&pool->lock);
+	if (pool->count + pool->nr_dirty < pool->high) {
+		list_add_tail(&page->lru, &pool->dirty);
+		pool->nr_dirty++;
+		kept = true;
+	}
+	spin_unlock(&pool->lock);
+
+	if (kept)
+		schedule_work(&pool->refill);
+
+	return kept;
+}
+
+static int pool_shrink(struct shrinker *shrinker, int nr_to_scan,
+		       gfp_t gfp_mask)
+{
+	struct nvmap_page_pool *pool;
+	int nr;
+
+	pool = container_of(shrinker, struct nvmap_page_pool, shrinker);
+
+	if (nr_to_scan)
+		pool_drain(pool, nr_to_scan);
+
+	spin_lock(&pool->lock);
+	nr = pool->count + pool->nr_dirty;
+	spin_unlock(&pool->lock);
+
+	return nr;
+}
+
+static ssize_t pool_stat_show(struct device *dev,
+			      struct device_attribute *attr, char *buf);
+
+static ssize_t pool_watermark_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count);
+
+static struct device_attribute pool_stat_count =
+	__ATTR(count, S_IRUGO, pool_stat_show, NULL);
+
+static struct device_attribute pool_stat_hits =
+	__ATTR(hits, S_IRUGO, pool_stat_show, NULL);
+
+static struct device_attribute pool_stat_misses =
+	__ATTR(misses, S_IRUGO, pool_stat_show, NULL);
+
+static struct device_attribute pool_attr_low =
+	__ATTR(low_watermark, S_IRUGO | S_IWUSR, pool_stat_show,
+	       pool_watermark_store);
+
+static struct device_attribute pool_attr_high =
+	__ATTR(high_watermark, S_IRUGO | S_IWUSR, pool_stat_show,
+	       pool_watermark_store);
+
+static struct attribute *pool_attrs[] = {
+	&pool_stat_count.attr,
+	&pool_stat_hits.attr,
+	&pool_stat_misses.attr,
+	&pool_attr_low.attr,
+	&pool_attr_high.attr,
+	NULL,
+};
+
+static struct attribute_group pool_attr_group = {
+	.attrs	= pool_attrs,
+};
+
+static ssize_t pool_stat_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct nvmap_page_pool *pool;
+	unsigned long val;
+
+	pool = container_of(dev, struct nvmap_page_pool, dev);
+
+	spin_lock(&pool->lock);
+	if (attr == &pool_stat_count)
+		val = pool->count;
+	else if (attr == &pool_stat_hits)
+		val = pool->hits;
+	else if (attr == &pool_stat_misses)
+		val = pool->misses;
+	else if (attr == &pool_attr_low)
+		val = pool->low;
+	else
+		val = pool->high;
+	spin_unlock(&pool->lock);
+
+	return sprintf(buf, "%lu\n", val);
+}
+
+static ssize_t pool_watermark_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct nvmap_page_pool *pool;
+	unsigned int excess = 0;
+	unsigned long val;
+	int err = 0;
+
+	pool = container_of(dev, struct nvmap_page_pool, dev);
+
+	if (strict_strtoul(buf, 10, &val) || val > UINT_MAX)
+		return -EINVAL;
+
+	spin_lock(&pool->lock);
+	if (attr == &pool_attr_low) {
+		if (val > pool->high)
+			err = -EINVAL;
+		else
+			pool->low = val;
+	} else {
+		if (val < pool->low)
+			err = -EINVAL;
+		else
+			pool->high = val;
+	}
+	if (pool->count + pool->nr_dirty > pool->high)
+		excess = pool->count + pool->nr_dirty - pool->high;
+	spin_unlock(&pool->lock);
+
+	if (err)
+		return err;
+
+	if (excess)
+		pool_drain(pool, excess);
+	else
+		schedule_work(&pool->refill);
+
+	return count;
+}
+
+static void pool_release(struct device *dev)
+{
+}
+
+struct nvmap_page_pool *nvmap_page_pool_create(struct device *parent,
+					       unsigned int flags)
+{
+	struct nvmap_page_pool *pool;
+
+	if (WARN_ON(flags >= NVMAP_NUM_POOLS))
+		return NULL;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
+	INIT_LIST_HEAD(&pool->dirty);
+	INIT_WORK(&pool->refill, pool_refill);
+	pool->low = pool_defaults[flags].low;
+	pool->high = pool_defaults[flags].high;
+
+	dev_set_name(&pool->dev, "pagepool-%s", pool_defaults[flags].name);
+	pool->dev.parent = parent;
+	pool->dev.driver = NULL;
+	pool->dev.release = pool_release;
+	if (device_register(&pool->dev)) {
+		dev_err(parent, "%s: failed to register %s\n", __func__,
+			dev_name(&pool->dev));
+		goto fail_alloc;
+	}
+	if (sysfs_create_group(&pool->dev.kobj, &pool_attr_group)) {
+		dev_err(&pool->dev, "%s: failed to create attributes\n",
+			__func__);
+		goto fail_register;
+	}
+
+	pool->shrinker.shrink = pool_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	schedule_work(&pool->refill);
+	return pool;
+
+fail_register:
+	device_unregister(&pool->dev);
+fail_alloc:
+	kfree(pool);
+	return NULL;
+}
+
+void nvmap_page_pool_destroy(struct nvmap_page_pool *pool)
+{
+	if (!pool)
+		return;
+
+	unregister_shrinker(&pool->shrinker);
+	sysfs_remove_group(&pool->dev.kobj, &pool_attr_group);
+	device_unregister(&pool->dev);
+
+	spin_lock(&pool->lock);
+	pool->low = pool->high = 0;
+	spin_unlock(&pool->lock);
+
+	cancel_work_sync(&pool->refill);
+	pool_drain(pool, UINT_MAX);
+	kfree(pool);
+}
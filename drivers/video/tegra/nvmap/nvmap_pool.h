@@ -0,0 +1,64 @@
+/*
+ * drivers/video/tegra/nvmap/nvmap_pool.h
+ *
+ * Pools of ready-to-use pages for nvmap system memory handles
+ *
+ * Copyright (c) 2010, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __VIDEO_TEGRA_NVMAP_POOL_H
+#define __VIDEO_TEGRA_NVMAP_POOL_H
+
+#include <mach/nvmap.h>
+
+struct device;
+struct page;
+struct nvmap_page_pool;
+
+/* one pool per handle cache type */
+#define NVMAP_NUM_POOLS		(NVMAP_HANDLE_CACHE_FLAG + 1)
+
+#ifdef CONFIG_NVMAP_PAGE_POOLS
+
+struct nvmap_page_pool *nvmap_page_pool_create(struct device *parent,
+					       unsigned int flags);
+
+void nvmap_page_pool_destroy(struct nvmap_page_pool *pool);
+
+struct page *nvmap_page_pool_alloc(struct nvmap_page_pool *pool);
+
+bool nvmap_page_pool_release(struct nvmap_page_pool *pool, struct page *page);
+
+#else
+
+#define nvmap_page_pool_create(_p, _f)	NULL
+#define nvmap_page_pool_destroy(_p)	do { } while (0)
+
+static inline struct page *nvmap_page_pool_alloc(struct nvmap_page_pool *pool)
+{
+	return NULL;
+}
+
+static inline bool nvmap_page_pool_release(struct nvmap_page_pool *pool,
+					   struct page *page)
+{
+	return false;
+}
+
+#endif
+
+#endif
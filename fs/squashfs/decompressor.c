@@ -24,6 +24,8 @@
 #include <linux/types.h>
 #include <linux/mutex.h>
 #include <linux/buffer_head.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -51,6 +53,12 @@ static const struct squashfs_decompressor squashfs_xz_comp_ops = {
 };
 #endif
 
+#ifndef CONFIG_SQUASHFS_SNAPPY
+static const struct squashfs_decompressor squashfs_snappy_comp_ops = {
+	NULL, NULL, NULL, SNAPPY_COMPRESSION, "snappy", 0
+};
+#endif
+
 static const struct squashfs_decompressor squashfs_unknown_comp_ops = {
 	NULL, NULL, NULL, 0, "unknown", 0
 };
@@ -59,6 +67,7 @@ static const struct squashfs_decompressor *decompressor[] = {
 	&squashfs_zlib_comp_ops,
 	&squashfs_lzo_comp_ops,
 	&squashfs_xz_comp_ops,
+	&squashfs_snappy_comp_ops,
 	&squashfs_lzma_unsupported_comp_ops,
 	&squashfs_unknown_comp_ops
 };
@@ -74,3 +83,113 @@ const struct squashfs_decompressor *squashfs_lookup_decompressor(int id)
 
 	return decompressor[i];
 }
+
+
+static int squashfs_stream_init(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	stream->stream = msblk->decompressor->init(msblk);
+	if (stream->stream == NULL)
+		return -ENOMEM;
+
+	mutex_init(&stream->mutex);
+	return 0;
+}
+
+
+/*
+ * Allocate the decompressor streams for a mount.  By default a single
+ * stream is shared by all readers, which serialises decompression.  If
+ * percpu is set, one stream is allocated per possible CPU so that readers
+ * running on different CPUs decompress in parallel, at the cost of one
+ * decompressor workspace per CPU.
+ */
+int squashfs_decompressor_create(struct squashfs_sb_info *msblk, int percpu)
+{
+	int cpu;
+
+	if (!percpu) {
+		msblk->stream = kmalloc(sizeof(*msblk->stream), GFP_KERNEL);
+		if (msblk->stream == NULL)
+			return -ENOMEM;
+
+		if (squashfs_stream_init(msblk, msblk->stream)) {
+			kfree(msblk->stream);
+			msblk->stream = NULL;
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	msblk->percpu_stream = alloc_percpu(struct squashfs_stream);
+	if (msblk->percpu_stream == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		if (squashfs_stream_init(msblk,
+				per_cpu_ptr(msblk->percpu_stream, cpu)))
+			goto failed;
+
+	return 0;
+
+failed:
+	squashfs_decompressor_destroy(msblk);
+	return -ENOMEM;
+}
+
+
+void squashfs_decompressor_destroy(struct squashfs_sb_info *msblk)
+{
+	int cpu;
+
+	if (msblk->stream) {
+		msblk->decompressor->free(msblk->stream->stream);
+		kfree(msblk->stream);
+		msblk->stream = NULL;
+	}
+
+	if (msblk->percpu_stream) {
+		for_each_possible_cpu(cpu)
+			msblk->decompressor->free(
+				per_cpu_ptr(msblk->percpu_stream, cpu)->stream);
+		free_percpu(msblk->percpu_stream);
+		msblk->percpu_stream = NULL;
+	}
+}
+
+
+/*
+ * The per-CPU stream is only a placement hint: the reader may sleep and
+ * migrate while decompressing, so the stream is still protected by its
+ * mutex.  Contention only happens between readers scheduled on the same
+ * CPU.
+ */
+static struct squashfs_stream *squashfs_get_stream(
+	struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream;
+
+	if (msblk->percpu_stream)
+		stream = per_cpu_ptr(msblk->percpu_stream,
+			raw_smp_processor_id());
+	else
+		stream = msblk->stream;
+
+	mutex_lock(&stream->mutex);
+	return stream;
+}
+
+
+int squashfs_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	struct squashfs_stream *stream = squashfs_get_stream(msblk);
+	int res;
+
+	res = msblk->decompressor->decompress(msblk, stream->stream, buffer,
+		bh, b, offset, length, srclength, pages);
+
+	mutex_unlock(&stream->mutex);
+	return res;
+}
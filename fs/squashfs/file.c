@@ -47,6 +47,8 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -371,6 +373,123 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
+/*
+ * Decompress a datablock straight into the page cache pages it covers,
+ * rather than into the read_page cache and then copying.  This needs every
+ * page of the block (up to the end of file) to be grabbed and not already
+ * uptodate; if that's not possible -EAGAIN is returned and the caller falls
+ * back to reading through the cache.  On success all the pages, including
+ * target_page, are uptodate and unlocked.  On failure target_page is left
+ * locked.
+ */
+static int squashfs_readpage_block(struct page *target_page, u64 block,
+	int bsize)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int end_index = start_index | mask;
+	int last_page = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int i, pages, bytes, missing = 0, res = -EAGAIN;
+	struct page **page;
+	void **pageaddr, *vaddr = NULL;
+
+	if (end_index > last_page)
+		end_index = last_page;
+	pages = end_index - start_index + 1;
+
+	page = kcalloc(pages, sizeof(*page), GFP_KERNEL);
+	pageaddr = kcalloc(pages, sizeof(*pageaddr), GFP_KERNEL);
+	if (page == NULL || pageaddr == NULL)
+		goto out;
+
+	for (i = 0; i < pages; i++) {
+		int n = start_index + i;
+
+		page[i] = (n == target_page->index) ? target_page :
+			grab_cache_page_nowait(target_page->mapping, n);
+
+		if (page[i] == NULL) {
+			missing++;
+			continue;
+		}
+
+		/*
+		 * Don't decompress over a page that is already uptodate, it
+		 * may be mapped and in use.
+		 */
+		if (page[i] != target_page && PageUptodate(page[i])) {
+			unlock_page(page[i]);
+			page_cache_release(page[i]);
+			page[i] = NULL;
+			missing++;
+		}
+	}
+
+	if (missing)
+		goto release_pages;
+
+	/*
+	 * Highmem pages are mapped with a single vmap() rather than one
+	 * kmap() each: a large block could otherwise take a sizeable share
+	 * of the kmap pool and deadlock against other readers doing the same.
+	 */
+	for (i = 0; i < pages && !PageHighMem(page[i]); i++)
+		pageaddr[i] = page_address(page[i]);
+
+	if (i < pages) {
+		vaddr = vmap(page, pages, VM_MAP, PAGE_KERNEL);
+		if (vaddr == NULL)
+			goto release_pages;
+		for (i = 0; i < pages; i++)
+			pageaddr[i] = vaddr + (i << PAGE_CACHE_SHIFT);
+	}
+
+	bytes = squashfs_read_data(inode->i_sb, pageaddr, block, bsize, NULL,
+		pages << PAGE_CACHE_SHIFT, pages);
+
+	if (bytes >= 0) {
+		/* Zero the part of the pages not filled by the datablock */
+		for (i = 0; i < pages; i++) {
+			int avail = bytes - (i << PAGE_CACHE_SHIFT);
+
+			avail = clamp_t(int, avail, 0, PAGE_CACHE_SIZE);
+			memset(pageaddr[i] + avail, 0, PAGE_CACHE_SIZE - avail);
+		}
+		res = 0;
+	} else {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		res = bytes;
+	}
+
+	if (vaddr)
+		vunmap(vaddr);
+
+	if (res == 0) {
+		for (i = 0; i < pages; i++) {
+			flush_dcache_page(page[i]);
+			SetPageUptodate(page[i]);
+		}
+	}
+
+release_pages:
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL || (page[i] == target_page && res))
+			continue;
+		unlock_page(page[i]);
+		if (page[i] != target_page)
+			page_cache_release(page[i]);
+	}
+
+out:
+	kfree(pageaddr);
+	kfree(page);
+	return res;
+}
+
+
 static int squashfs_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
@@ -410,8 +529,16 @@ static int squashfs_readpage(struct file *file, struct page *page)
 			sparse = 1;
 		} else {
 			/*
-			 * Read and decompress datablock.
+			 * Try to decompress directly into the page cache,
+			 * otherwise read and decompress the datablock
+			 * through the read_page cache.
 			 */
+			int res = squashfs_readpage_block(page, block, bsize);
+			if (res == 0)
+				return 0;
+			if (res != -EAGAIN)
+				goto error_out;
+
 			buffer = squashfs_get_datablock(inode->i_sb,
 								block, bsize);
 			if (buffer->error) {
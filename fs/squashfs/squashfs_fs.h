@@ -240,6 +240,12 @@ struct meta_index {
 #define LZO_COMPRESSION		3
 #define XZ_COMPRESSION		4
 
+/*
+ * Not an upstream id: upstream ids count up from 1, and 5 is lz4.  Kept
+ * well clear of them so that no other kernel or tool misreads the image.
+ */
+#define SNAPPY_COMPRESSION	0x100
+
 struct squashfs_super_block {
 	__le32			s_magic;
 	__le32			inodes;
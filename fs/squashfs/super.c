@@ -36,6 +36,9 @@
 #include <linux/module.h>
 #include <linux/magic.h>
 #include <linux/xattr.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/mount.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -47,6 +50,59 @@
 static struct file_system_type squashfs_fs_type;
 static const struct super_operations squashfs_super_ops;
 
+enum {
+	Opt_threads_single,
+	Opt_threads_percpu,
+	Opt_threads_err,
+	Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_threads_single, "threads=single"},
+	{Opt_threads_percpu, "threads=percpu"},
+	{Opt_threads_err, "threads=%s"},
+	{Opt_err, NULL}
+};
+
+
+/*
+ * Parse the mount options.  The only option is the decompressor threading
+ * model: "threads=single" (the default) shares one decompressor between all
+ * readers, "threads=percpu" gives each CPU its own.  *percpu is left alone
+ * if the model isn't given.  Squashfs used to ignore all mount options, so
+ * anything else is still ignored.
+ */
+static int squashfs_parse_options(char *options, int *percpu)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_threads_single:
+			*percpu = 0;
+			break;
+		case Opt_threads_percpu:
+			*percpu = 1;
+			break;
+		case Opt_threads_err:
+			ERROR("Invalid threads option \"%s\"\n", p);
+			return -EINVAL;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+
 static const struct squashfs_decompressor *supported_squashfs_filesystem(short
 	major, short minor, short id)
 {
@@ -84,10 +140,14 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	unsigned short flags;
 	unsigned int fragments;
 	u64 lookup_table_start, xattr_id_table_start;
-	int err;
+	int err, percpu = 0;
 
 	TRACE("Entered squashfs_fill_superblock\n");
 
+	err = squashfs_parse_options(data, &percpu);
+	if (err)
+		return err;
+
 	sb->s_fs_info = kzalloc(sizeof(*msblk), GFP_KERNEL);
 	if (sb->s_fs_info == NULL) {
 		ERROR("Failed to allocate squashfs_sb_info\n");
@@ -104,7 +164,6 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	msblk->devblksize = sb_min_blocksize(sb, BLOCK_SIZE);
 	msblk->devblksize_log2 = ffz(~msblk->devblksize);
 
-	mutex_init(&msblk->read_data_mutex);
 	mutex_init(&msblk->meta_index_mutex);
 
 	/*
@@ -199,8 +258,7 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	err = -ENOMEM;
 
-	msblk->stream = squashfs_decompressor_init(msblk);
-	if (msblk->stream == NULL)
+	if (squashfs_decompressor_create(msblk, percpu))
 		goto failed_mount;
 
 	msblk->block_cache = squashfs_cache_init("metadata",
@@ -208,8 +266,13 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (msblk->block_cache == NULL)
 		goto failed_mount;
 
-	/* Allocate read_page block */
-	msblk->read_page = squashfs_cache_init("data", 1, msblk->block_size);
+	/*
+	 * Allocate read_page blocks.  With per-CPU decompressors, allow one
+	 * datablock read in flight per CPU, otherwise readers would serialise
+	 * on the single read_page entry instead.
+	 */
+	msblk->read_page = squashfs_cache_init("data",
+			percpu ? num_online_cpus() : 1, msblk->block_size);
 	if (msblk->read_page == NULL) {
 		ERROR("Failed to allocate read_page block\n");
 		goto failed_mount;
@@ -306,7 +369,7 @@ failed_mount:
 	squashfs_cache_delete(msblk->block_cache);
 	squashfs_cache_delete(msblk->fragment_cache);
 	squashfs_cache_delete(msblk->read_page);
-	squashfs_decompressor_free(msblk, msblk->stream);
+	squashfs_decompressor_destroy(msblk);
 	kfree(msblk->inode_lookup_table);
 	kfree(msblk->fragment_index);
 	kfree(msblk->id_table);
@@ -346,11 +409,35 @@ static int squashfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 static int squashfs_remount(struct super_block *sb, int *flags, char *data)
 {
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	int err, percpu = msblk->percpu_stream != NULL;
+
+	err = squashfs_parse_options(data, &percpu);
+	if (err)
+		return err;
+
+	/* the decompressor streams are set up once, at mount time */
+	if (percpu != (msblk->percpu_stream != NULL)) {
+		ERROR("Can't change the threads option on remount\n");
+		return -EINVAL;
+	}
+
 	*flags |= MS_RDONLY;
 	return 0;
 }
 
 
+static int squashfs_show_options(struct seq_file *seq, struct vfsmount *mnt)
+{
+	struct squashfs_sb_info *msblk = mnt->mnt_sb->s_fs_info;
+
+	if (msblk->percpu_stream)
+		seq_puts(seq, ",threads=percpu");
+
+	return 0;
+}
+
+
 static void squashfs_put_super(struct super_block *sb)
 {
 	if (sb->s_fs_info) {
@@ -358,7 +445,7 @@ static void squashfs_put_super(struct super_block *sb)
 		squashfs_cache_delete(sbi->block_cache);
 		squashfs_cache_delete(sbi->fragment_cache);
 		squashfs_cache_delete(sbi->read_page);
-		squashfs_decompressor_free(sbi, sbi->stream);
+		squashfs_decompressor_destroy(sbi);
 		kfree(sbi->id_table);
 		kfree(sbi->fragment_index);
 		kfree(sbi->meta_index);
@@ -466,7 +553,8 @@ static const struct super_operations squashfs_super_ops = {
 	.destroy_inode = squashfs_destroy_inode,
 	.statfs = squashfs_statfs,
 	.put_super = squashfs_put_super,
-	.remount_fs = squashfs_remount
+	.remount_fs = squashfs_remount,
+	.show_options = squashfs_show_options
 };
 
 module_init(init_squashfs_fs);
@@ -128,8 +128,11 @@ int dm_bht_salt(struct dm_bht *bht, char *hexsalt);
 bool dm_bht_is_populated(struct dm_bht *bht, unsigned int block);
 int dm_bht_populate(struct dm_bht *bht, void *read_cb_ctx,
 		    unsigned int block);
+int dm_bht_populate_level(struct dm_bht *bht, void *read_cb_ctx, int depth);
 int dm_bht_verify_block(struct dm_bht *bht, unsigned int block,
 			struct page *pg, unsigned int offset);
+int dm_bht_verify_blocks(struct dm_bht *bht, unsigned int block,
+			 struct page **pages, unsigned int count);
 
 /* Functions for creating struct dm_bhts on disk.  A newly created dm_bht
  * should not be directly used for verification. (It should be repopulated.)
@@ -0,0 +1,128 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nvhost
+
+#if !defined(_TRACE_NVHOST_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_NVHOST_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(nvhost_cdma_end,
+
+	TP_PROTO(const char *name, u32 syncpt_id, u32 syncpt_val,
+		 u32 slots, u32 pb_used),
+
+	TP_ARGS(name, syncpt_id, syncpt_val, slots, pb_used),
+
+	TP_STRUCT__entry(
+		__field(	const char *,	name		)
+		__field(	u32,		syncpt_id	)
+		__field(	u32,		syncpt_val	)
+		__field(	u32,		slots		)
+		__field(	u32,		pb_used		)
+	),
+
+	TP_fast_assign(
+		__entry->name		= name;
+		__entry->syncpt_id	= syncpt_id;
+		__entry->syncpt_val	= syncpt_val;
+		__entry->slots		= slots;
+		__entry->pb_used	= pb_used;
+	),
+
+	TP_printk("name=%s syncpt_id=%u syncpt_val=%u slots=%u pb_used=%u",
+		  __entry->name, __entry->syncpt_id, __entry->syncpt_val,
+		  __entry->slots, __entry->pb_used)
+);
+
+TRACE_EVENT(nvhost_cdma_wait,
+
+	TP_PROTO(const char *name, int cdma_event, u32 wait_us),
+
+	TP_ARGS(name, cdma_event, wait_us),
+
+	TP_STRUCT__entry(
+		__field(	const char *,	name		)
+		__field(	int,		cdma_event	)
+		__field(	u32,		wait_us		)
+	),
+
+	TP_fast_assign(
+		__entry->name		= name;
+		__entry->cdma_event	= cdma_event;
+		__entry->wait_us	= wait_us;
+	),
+
+	TP_printk("name=%s event=%d wait_us=%u",
+		  __entry->name, __entry->cdma_event, __entry->wait_us)
+);
+
+TRACE_EVENT(nvhost_cdma_complete,
+
+	TP_PROTO(const char *name, u32 syncpt_id, u32 syncpt_val,
+		 u32 latency_us),
+
+	TP_ARGS(name, syncpt_id, syncpt_val, latency_us),
+
+	TP_STRUCT__entry(
+		__field(	const char *,	name		)
+		__field(	u32,		syncpt_id	)
+		__field(	u32,		syncpt_val	)
+		__field(	u32,		latency_us	)
+	),
+
+	TP_fast_assign(
+		__entry->name		= name;
+		__entry->syncpt_id	= syncpt_id;
+		__entry->syncpt_val	= syncpt_val;
+		__entry->latency_us	= latency_us;
+	),
+
+	TP_printk("name=%s syncpt_id=%u syncpt_val=%u latency_us=%u",
+		  __entry->name, __entry->syncpt_id, __entry->syncpt_val,
+		  __entry->latency_us)
+);
+
+TRACE_EVENT(nvhost_channel_ctxsw,
+
+	TP_PROTO(const char *name, bool save, bool restore),
+
+	TP_ARGS(name, save, restore),
+
+	TP_STRUCT__entry(
+		__field(	const char *,	name		)
+		__field(	bool,		save		)
+		__field(	bool,		restore		)
+	),
+
+	TP_fast_assign(
+		__entry->name		= name;
+		__entry->save		= save;
+		__entry->restore	= restore;
+	),
+
+	TP_printk("name=%s save=%d restore=%d",
+		  __entry->name, __entry->save, __entry->restore)
+);
+
+TRACE_EVENT(nvhost_ctx_save_service,
+
+	TP_PROTO(const char *name),
+
+	TP_ARGS(name),
+
+	TP_STRUCT__entry(
+		__field(	const char *,	name		)
+	),
+
+	TP_fast_assign(
+		__entry->name		= name;
+	),
+
+	TP_printk("name=%s", __entry->name)
+);
+
+#endif /* _TRACE_NVHOST_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
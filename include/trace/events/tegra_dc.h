@@ -0,0 +1,73 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tegra_dc
+
+#if !defined(_TRACE_TEGRA_DC_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_TEGRA_DC_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(tegra_dc_window_config,
+
+	TP_PROTO(int dc, int win, u32 fmt, unsigned in_w, unsigned in_h,
+		 unsigned out_w, unsigned out_h, unsigned long bandwidth),
+
+	TP_ARGS(dc, win, fmt, in_w, in_h, out_w, out_h, bandwidth),
+
+	TP_STRUCT__entry(
+		__field(	int,		dc		)
+		__field(	int,		win		)
+		__field(	u32,		fmt		)
+		__field(	unsigned,	in_w		)
+		__field(	unsigned,	in_h		)
+		__field(	unsigned,	out_w		)
+		__field(	unsigned,	out_h		)
+		__field(	unsigned long,	bandwidth	)
+	),
+
+	TP_fast_assign(
+		__entry->dc		= dc;
+		__entry->win		= win;
+		__entry->fmt		= fmt;
+		__entry->in_w		= in_w;
+		__entry->in_h		= in_h;
+		__entry->out_w		= out_w;
+		__entry->out_h		= out_h;
+		__entry->bandwidth	= bandwidth;
+	),
+
+	TP_printk("dc=%d win=%d fmt=%u in=%ux%u out=%ux%u bandwidth_kbps=%lu",
+		  __entry->dc, __entry->win, __entry->fmt,
+		  __entry->in_w, __entry->in_h,
+		  __entry->out_w, __entry->out_h, __entry->bandwidth)
+);
+
+TRACE_EVENT(tegra_dc_underflow,
+
+	TP_PROTO(int dc, int win, int frames, unsigned long bandwidth),
+
+	TP_ARGS(dc, win, frames, bandwidth),
+
+	TP_STRUCT__entry(
+		__field(	int,		dc		)
+		__field(	int,		win		)
+		__field(	int,		frames		)
+		__field(	unsigned long,	bandwidth	)
+	),
+
+	TP_fast_assign(
+		__entry->dc		= dc;
+		__entry->win		= win;
+		__entry->frames		= frames;
+		__entry->bandwidth	= bandwidth;
+	),
+
+	TP_printk("dc=%d win=%d frames=%d bandwidth_kbps=%lu",
+		  __entry->dc, __entry->win, __entry->frames,
+		  __entry->bandwidth)
+);
+
+#endif /* _TRACE_TEGRA_DC_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
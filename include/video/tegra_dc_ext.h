@@ -94,6 +94,43 @@ struct tegra_dc_ext_flip {
 	__u32	post_syncpt_val;
 };
 
+/*
+ * An atomic flip across heads.  Each used entry names the device node of
+ * one head by a file descriptor (-1 for none), and receives that head's
+ * post syncpoint in its flip.
+ */
+#define TEGRA_DC_EXT_FLIP_N_HEADS	2
+
+struct tegra_dc_ext_flip_head {
+	__s32	fd;
+	__u32	pad;
+	struct tegra_dc_ext_flip flip;
+};
+
+struct tegra_dc_ext_flip_heads {
+	struct tegra_dc_ext_flip_head head[TEGRA_DC_EXT_FLIP_N_HEADS];
+};
+
+/*
+ * Queue and latch times of the most recent flips on a head, oldest first.
+ * Each frame is identified by the post syncpoint its flip returned.  Times
+ * are CLOCK_MONOTONIC.
+ */
+#define TEGRA_DC_EXT_FLIP_LOG_SIZE	16
+
+struct tegra_dc_ext_flip_latch {
+	__u32	post_syncpt_id;
+	__u32	post_syncpt_val;
+	struct timespec queued;
+	struct timespec latched;
+};
+
+struct tegra_dc_ext_flip_log {
+	__u32	count;
+	__u32	pad;
+	struct tegra_dc_ext_flip_latch frames[TEGRA_DC_EXT_FLIP_LOG_SIZE];
+};
+
 /*
  * Cursor image format:
  * - Tegra hardware supports two colors: foreground and background, specified
@@ -202,6 +239,12 @@ struct tegra_dc_ext_status {
 #define TEGRA_DC_EXT_GET_VBLANK_SYNCPT \
 	_IOR('D', 0x09, __u32)
 
+#define TEGRA_DC_EXT_GET_FLIP_LOG \
+	_IOR('D', 0x0a, struct tegra_dc_ext_flip_log)
+
+#define TEGRA_DC_EXT_FLIP_HEADS \
+	_IOWR('D', 0x0b, struct tegra_dc_ext_flip_heads)
+
 
 enum tegra_dc_ext_control_output_type {
 	TEGRA_DC_EXT_DSI,